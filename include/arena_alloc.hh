@@ -10,7 +10,12 @@
 
 #include <cstdlib>
 #include <utility>
+#include <vector>
+#include <algorithm>
 #include <malloc.h>
+#include <sys/mman.h>
+#include "config.hh"
+#include "assert.hh"
 
 namespace bparser {
 
@@ -19,35 +24,77 @@ inline size_t align_size(size_t al, size_t size) {
 	return (size + al -1) / al * al;
 }
 
+/**
+ * Arena (bump) allocator with aligned allocations.
+ *
+ * Memory is taken from a list of chunks. The first chunk has the size given
+ * in the constructor, when an allocation does not fit into the current chunk
+ * a new chunk is appended, so the estimated initial size need not to be exact.
+ * Nothing is released until the arena is destroyed, however the arena can be
+ * rewound to a previous mark() or reset() and its chunks reused,
+ * e.g. by the next compilation of an expression.
+ *
+ * With 'huge_pages' the chunks of at least 'huge_page_size' bytes are mapped using MAP_HUGETLB,
+ * or using regular pages with madvise(MADV_HUGEPAGE) if there are no reserved huge pages.
+ */
 struct ArenaAlloc {
-	ArenaAlloc(std::size_t alignment, std::size_t size)
+	static const std::size_t huge_page_size = 2 * 1024 * 1024;
+
+	/// Position in the arena, see mark() and rewind().
+	struct Mark {
+		std::size_t i_chunk;
+		char * ptr;
+		std::size_t used;
+	};
+
+	ArenaAlloc(std::size_t alignment, std::size_t size, bool huge_pages = false)
 	: alignment_(alignment),
-	  size_(0)
+	  chunk_size_(align_size(alignment, std::max(size, alignment))),
+	  huge_pages_(huge_pages),
+	  i_chunk_(0),
+	  used_(0),
+	  high_water_(0)
 	{
-		size_ = align_size(alignment_, size);
-		base_ = (char *)memalign(alignment_, size_);
-		BP_ASSERT(base_ != nullptr);
-		ptr_ = base_;
-		//std::cout << "arena begin: " << (void *)base_ << " end: " << end() << std::endl;
+		add_chunk(chunk_size_);
+		ptr_ = chunks_[0].base;
+		//std::cout << "arena begin: " << (void *)ptr_ << " end: " << end() << std::endl;
 	}
-	
+
+	ArenaAlloc(const ArenaAlloc &) = delete;
+	ArenaAlloc &operator=(const ArenaAlloc &) = delete;
+
 	~ArenaAlloc() {
         destroy();
     }
 
 	void destroy() {
-		free(base_);
+		for(Chunk &chunk : chunks_) {
+			if (chunk.mapped)
+				munmap(chunk.base, chunk.size);
+			else
+				free(chunk.base);
+		}
+		chunks_.clear();
 	}
 
+	/// End of the current chunk.
 	void *end() {
-		return base_ + size_;
+		return chunks_[i_chunk_].base + chunks_[i_chunk_].size;
 	}
 
 	void * allocate(std::size_t size) {
 		size = align_size(alignment_, size);
+		while (size > std::size_t((char *)end() - ptr_)) {
+			// try next (already allocated) chunk or append a new one
+			if (i_chunk_ + 1 == chunks_.size())
+				add_chunk(std::max(chunk_size_, size));
+			++i_chunk_;
+			ptr_ = chunks_[i_chunk_].base;
+		}
 		void * ptr = ptr_;
 		ptr_ += size;
-		BP_ASSERT(ptr_ <= end());
+		used_ += size;
+		high_water_ = std::max(high_water_, used_);
 		//std::cout << "allocated: " << ptr << " end: " << (void *)ptr_ << " aend: " << end() << "\n";
 		return ptr;
 	}
@@ -64,11 +111,90 @@ struct ArenaAlloc {
 		return new (ptr) T[n_items];
 	}
 
+	/// Current position, all later allocations are released by rewind(mark).
+	Mark mark() const {
+		return {i_chunk_, ptr_, used_};
+	}
+
+	/// Release all allocations done after the 'mark', the memory is kept for reuse.
+	void rewind(const Mark &mark) {
+		BP_ASSERT(mark.i_chunk < chunks_.size());
+		i_chunk_ = mark.i_chunk;
+		ptr_ = mark.ptr;
+		used_ = mark.used;
+	}
+
+	/// Release all allocations, the memory is kept for reuse.
+	void reset() {
+		rewind({0, chunks_[0].base, 0});
+	}
+
+	/// Bytes currently allocated (including alignment padding).
+	std::size_t used() const {
+		return used_;
+	}
+
+	/// Maximum of used() over the arena lifetime.
+	std::size_t high_water() const {
+		return high_water_;
+	}
+
+	/// Total size of the chunks.
+	std::size_t capacity() const {
+		std::size_t size = 0;
+		for(const Chunk &chunk : chunks_) size += chunk.size;
+		return size;
+	}
+
+	std::size_t n_chunks() const {
+		return chunks_.size();
+	}
+
+private:
+	struct Chunk {
+		char * base;
+		std::size_t size;
+		bool mapped;
+	};
+
+	void add_chunk(std::size_t size) {
+		Chunk chunk = {nullptr, align_size(alignment_, size), false};
+		if (huge_pages_ && chunk.size >= huge_page_size) {
+			chunk.size = align_size(huge_page_size, chunk.size);
+			chunk.base = map_huge(chunk.size);
+			chunk.mapped = (chunk.base != nullptr);
+		}
+		if (chunk.base == nullptr)
+			chunk.base = (char *)memalign(alignment_, chunk.size);
+		if (chunk.base == nullptr)
+			Throw() << "ArenaAlloc: can not allocate chunk of " << chunk.size << " bytes.\n";
+		chunks_.push_back(chunk);
+	}
+
+	static char * map_huge(std::size_t size) {
+		void * ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (ptr == MAP_FAILED) {
+			ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+			madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+		}
+		return (char *)ptr;
+	}
 
 	std::size_t alignment_;
-	std::size_t size_;
-	char * base_;
+	/// Size of the first chunk, minimal size of further chunks.
+	std::size_t chunk_size_;
+	bool huge_pages_;
+	std::vector<Chunk> chunks_;
+	std::size_t i_chunk_;
 	char * ptr_;
+	std::size_t used_;
+	std::size_t high_water_;
 };
 
 } // namespace bparser
@@ -16,6 +16,7 @@
 #include <boost/math/constants/constants.hpp>
 #include "config.hh"
 #include "scalar_node.hh"
+#include "derivative.hh"
 #include "test_tools.hh"
 
 namespace bparser {
@@ -577,14 +578,14 @@ public:
 
 
 	static Array deg_to_rad_factor() {
-		static ScalarNodePtr angle = details::ScalarNode::create_const( boost::math::constants::pi<double>() / 180 );
+		static ScalarNodePtr angle = details::ScalarNode::create_shared_const( boost::math::constants::pi<double>() / 180 );
 		Array a;
 		a.elements_[0] = angle;
 		return a;
 	}
 
 	static Array rad_to_deg_factor() {
-		static ScalarNodePtr angle = details::ScalarNode::create_const( boost::math::constants::pi<double>() / 180 );
+		static ScalarNodePtr angle = details::ScalarNode::create_shared_const( boost::math::constants::pi<double>() / 180 );
 		Array a;
 		a.elements_[0] = angle;
 		return a;
@@ -677,6 +678,130 @@ public:
 
 	}
 
+	/// Value of the constant number node, also negated, as '-1' is parsed into the minus of 1.
+	static bool constant_value(details::ScalarNodePtr node, double &value) {
+		if (node->result_storage == details::constant) {
+			value = node->value_;
+			return true;
+		}
+		if (node->op_code_ == details::_minus_::op_code && constant_value(node->inputs_[0], value)) {
+			value = -value;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Piecewise linear interpolation of 'x' (elementwise) in the table of the increasing breakpoints 'xp'
+	 * and the values 'fp', constant outside of the table, as numpy.interp. The table is copied to the node,
+	 * its elements must be constant numbers.
+	 */
+	static Array interp(const Array &x, const Array &xp, const Array &fp) {
+		if (xp.shape_.size() != 1 || ! same_shape(xp.shape_, fp.shape_) || xp.shape_[0] == 0)
+			Throw() << "interp: breakpoints and values must be non-empty vectors of the same size, got shapes "
+					<< print_shape(xp.shape_) << " and " << print_shape(fp.shape_) << ".\n";
+		uint n = xp.shape_[0];
+		std::vector<double> table(2 * n);
+		for(uint i=0; i < n; ++i) {
+			if (! constant_value(xp.elements_[i], table[i]) || ! constant_value(fp.elements_[i], table[n + i]))
+				Throw() << "interp: breakpoints and values must be constant numbers.\n";
+			if (i > 0 && ! (table[i] >= table[i - 1]))
+				Throw() << "interp: breakpoints must be increasing.\n";
+		}
+		const double * table_ptr = details::NodePool::current().create_table(table);
+
+		Array result(x.shape_);
+		MultiIdx idx(x.range());
+		for(;;) {
+			result[idx] = details::ScalarNode::create_interp(x[idx], table_ptr, 2 * n);
+			if (! idx.inc_trg()) break;
+		}
+		return result;
+	}
+
+	/**
+	 * Polynomial with the coefficients 'p' (highest power first) evaluated elementwise at 'x', as numpy.polyval.
+	 * The coefficients are copied to the node, they must be constant numbers.
+	 */
+	static Array polyval(const Array &p, const Array &x) {
+		if (p.shape_.size() != 1 || p.shape_[0] == 0 || p.shape_[0] > details::_polyval_::max_coeffs)
+			Throw() << "polyval: coefficients must be a vector of 1 to " << details::_polyval_::max_coeffs
+					<< " numbers, got shape " << print_shape(p.shape_) << ".\n";
+		uint n = p.shape_[0];
+		std::vector<double> coeffs(n);
+		for(uint i=0; i < n; ++i)
+			if (! constant_value(p.elements_[i], coeffs[i]))
+				Throw() << "polyval: coefficients must be constant numbers.\n";
+		const double * coeffs_ptr = details::NodePool::current().create_table(coeffs);
+
+		Array result(x.shape_);
+		MultiIdx idx(x.range());
+		for(;;) {
+			result[idx] = details::ScalarNode::create_polyval(x[idx], coeffs_ptr, n);
+			if (! idx.inc_trg()) break;
+		}
+		return result;
+	}
+
+	/**
+	 * Derivatives of the elements of 'f' with respect to the elements of 'x', of the shape f.shape() + x.shape().
+	 * Forward mode, one pass over 'f' per element of 'x', see ForwardDerivative.
+	 */
+	static Array derivative(const Array &f, const Array &x) {
+		Shape shape = f.shape_;
+		shape.insert(shape.end(), x.shape_.begin(), x.shape_.end());
+		Array result(shape);
+		uint n_x = x.elements_.size();
+		for(uint j=0; j < n_x; ++j) {
+			details::ForwardDerivative d(x.elements_[j]);
+			for(uint i=0; i < f.elements_.size(); ++i)
+				result.elements_[i * n_x + j] = d.derivative(f.elements_[i]);
+		}
+		return result;
+	}
+
+	/**
+	 * Replace the temporary elements of 'arrays' that are repeated or used by the other elements by their copies,
+	 * so that all the elements can be made the results, see make_result.
+	 */
+	static void separate_results(std::vector<Array> &arrays) {
+		std::vector<details::ScalarNodePtr> outputs;
+		for(const Array &a : arrays)
+			outputs.insert(outputs.end(), a.elements_.begin(), a.elements_.end());
+		std::set<details::ScalarNodePtr> shared = details::shared_outputs(outputs);
+		for(Array &a : arrays)
+			for(details::ScalarNodePtr &node : a.elements_)
+				if (node->result_storage == details::temporary && shared.count(node))
+					node = details::ScalarNode::create<details::_copy_>(node);
+	}
+
+	/**
+	 * Elementwise registered function 'op_code' of 'args' with broadcasting, see register_function.
+	 */
+	static Array native_op(unsigned char op_code, const char *op_name, const std::vector<Array> &args) {
+		BP_ASSERT(args.size() >= 1 && args.size() <= 3);
+		Shape res_shape = args[0].shape_;
+		for(const Array &a : args)
+			res_shape = MultiIdxRange::broadcast_common_shape(res_shape, a.shape_);
+
+		std::vector<MultiIdx> idx;
+		for(const Array &a : args)
+			idx.push_back(MultiIdx(a.range().broadcast(res_shape)));
+		Array result(res_shape);
+		for(;;) {
+			details::ScalarNodePtr inputs[3];
+			for(uint i=0; i < args.size(); ++i)
+				inputs[i] = args[i].elements_[idx[i].idx_src()];
+			result.elements_[idx[0].idx_trg()] =
+					details::ScalarNode::create_native(op_code, op_name, args.size(), inputs);
+			bool valid = true;
+			for(MultiIdx &i : idx)
+				valid = i.inc_trg() && valid;
+			if (!valid) break;
+		}
+		return result;
+	}
+
 	// Const scalar node.
 	static Array constant(const std::vector<double> &values, Shape shape = {}) {
 		if (values.size() == 1 && values[0] == none_value())
@@ -703,12 +828,22 @@ public:
 	}
 
 
-	// Vector value array with given shape
-	static Array value(double *v, uint array_max_size, Shape shape = {})
+	// Vector value array with given shape, T is double or float according to the processor precision.
+	// Values of the array component (flat index) 'k' start at v + k * array_max_size, consecutive values
+	// of a component are at distance 'elem_stride', e.g. elem_stride = 3, array_max_size = 1 for
+	// interleaved 3d vectors.
+	template <class T>
+	static Array value(T *v, uint array_max_size, Shape shape = {}, uint elem_stride = 1)
 	{
+		BP_ASSERT(elem_stride > 0 && elem_stride <= details::_gather_::max_stride);
 		Array res(shape);
 		for(uint i_el=0; i_el < res.elements_.size(); ++i_el) {
-			res.elements_[i_el] = details::ScalarNode::create_value(v);
+			details::ScalarNodePtr node = details::ScalarNode::create_value(v);
+			if (elem_stride != 1) {
+				node->stride_ = elem_stride;
+				node = details::ScalarNode::create<details::_gather_>(node);
+			}
+			res.elements_[i_el] = node;
 			v += array_max_size;
 		}
 		return res;
@@ -736,8 +871,27 @@ public:
 	}
 
 
-	// Vector value array with given shape
-	static Array value_copy(double *v, uint array_max_size, Shape shape = {})
+	// Vector value array of the 16-bit values in the given 'format', values of the component 'k'
+	// start at v + k * array_max_size. The values are converted to the processor precision
+	// by the load operations, see _load_fp16_.
+	static Array half_value(uint16_t *v, uint array_max_size, Shape shape, HalfFormat format)
+	{
+		Array res(shape);
+		for(uint i_el=0; i_el < res.elements_.size(); ++i_el) {
+			details::ScalarNodePtr node = details::ScalarNode::create_value(v);
+			node->half_ = true;
+			res.elements_[i_el] = (format == bf16) ?
+					details::ScalarNode::create<details::_load_bf16_>(node) :
+					details::ScalarNode::create<details::_load_fp16_>(node);
+			v += array_max_size;
+		}
+		return res;
+	}
+
+
+	// Vector value array with given shape, T is double or float according to the processor precision.
+	template <class T>
+	static Array value_copy(T *v, uint array_max_size, Shape shape = {})
 	{
 		Array res(shape);
 		for(uint i_el=0; i_el < res.elements_.size(); ++i_el) {
@@ -1141,6 +1295,21 @@ public:
 		return res;
 	}
 
+	/**
+	 * Create a packed boolean result array from *this, the component 'i' written to the bits
+	 * at 'bits + i * component_bytes', see Parser::set_packed_result.
+	 */
+	Array make_packed_result(uint8_t *bits, uint component_bytes) {
+		Array res(shape_);
+		for(uint i=0; i<elements_.size(); ++i) {
+			details::ScalarNodePtr node = elements_[i];
+			if (! details::is_bool_op(node->op_code_) && node->result_storage != details::constant_bool)
+				Throw() << "Packed result of a non-boolean expression, the result has to be a comparison or a logical operation.\n";
+			res.elements_[i] = details::ScalarNode::create_packed_result(node, bits + i * component_bytes);
+		}
+		return res;
+	}
+
 	Shape minimal_shape(Shape other) {
 		Shape result;
 		for(uint e : other)
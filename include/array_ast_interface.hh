@@ -71,6 +71,13 @@ struct ChainedCompareFn {
 
 typedef Array (*CloseChain)(const ComparisonPair &);
 
+/// Function registered by the user, see register_function.
+struct NativeFn {
+	unsigned char op_code;
+	uint n_args;
+	const char *name;
+};
+
 typedef boost::variant <
 	ArrayFnUnary,
 	ArrayFnBinary,
@@ -84,7 +91,8 @@ typedef boost::variant <
 	ArrayFnShapeDbl,
 	RangeFnListInt,
 	ListRangeFnListRange,  //IndexArray and Slice
-	RangeFnInt
+	RangeFnInt,
+	NativeFn
 	> ArrayFn;
 
 
@@ -280,6 +288,16 @@ struct call_visitor {
     	return fn(get_type<int>(alist_[0]));
     }
 
+    result_type operator()(NativeFn fn) const {
+    	if (alist_.size() != fn.n_args)
+    		Throw() << "Function '" << fn.name << "' takes " << fn.n_args
+    			<< " arguments, given " << alist_.size() << ".\n";
+    	std::vector<Array> alist;
+    	for(ParserResult item : alist_)
+    		alist.push_back(get_array(item));
+    	return Array::native_op(fn.op_code, fn.name, alist);
+    }
+
 };
 
 
@@ -21,6 +21,10 @@
 #endif
 
 
+// Define BP_PROFILE (CMake option BPARSER_PROFILE) to record call counts and cycles
+// of the individual operations in Processor::run, see Parser::profile_listing.
+// Must be the same for the library and its users.
+
 // common declarations
 
 typedef unsigned int uint;
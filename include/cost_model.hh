@@ -0,0 +1,255 @@
+/*
+ * cost_model.hh
+ *
+ * Roofline style cost model of a compiled expression.
+ * Static part counts the flops and the memory traffic per element from the sorted
+ * expression DAG, the measured part (Parser::roofline) compares the achieved
+ * GFLOP/s and GB/s with the model and with the peaks of the machine.
+ */
+
+#ifndef INCLUDE_COST_MODEL_HH_
+#define INCLUDE_COST_MODEL_HH_
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "config.hh"
+#include "scalar_node.hh"
+#include "expression_dag.hh"
+#include "fast_math.hh"
+
+namespace bparser {
+
+
+/**
+ * Floating point operations of the single evaluation of the operation 'op_code'.
+ * Elementary functions are weighted by the approximate number of operations
+ * of the VCL implementation (polynomial terms, range reduction, special values).
+ * Comparisons, logical operations, selects and copies count as no flops.
+ */
+inline double op_flops(unsigned char op_code) {
+	using namespace details;
+	switch (op_code) {
+	case _minus_::op_code:
+	case _add_::op_code:
+	case _sub_::op_code:
+	case _mul_::op_code:
+	case _div_::op_code:
+	case _neg_::op_code:
+	case _abs_::op_code:
+	case _sqrt_::op_code:
+	case _max_::op_code:
+	case _min_::op_code:
+	case _sgn_::op_code:
+	case _ceil_::op_code:
+	case _floor_::op_code:
+		return 1;
+	case _mod_::op_code:
+		return 4;
+	case _exp_::op_code:
+	case _fast_exp_::op_code:
+		return 20;
+	case _log_::op_code:
+	case _log10_::op_code:
+	case _log2_::op_code:
+	case _fast_log_::op_code:
+	case _fast_log10_::op_code:
+	case _fast_log2_::op_code:
+		return 25;
+	case _sin_::op_code:
+	case _cos_::op_code:
+	case _fast_sin_::op_code:
+	case _fast_cos_::op_code:
+		return 25;
+	case _tan_::op_code:
+		return 30;
+	case _sinh_::op_code:
+	case _cosh_::op_code:
+	case _tanh_::op_code:
+	case _fast_tanh_::op_code:
+		return 25;
+	case _asin_::op_code:
+	case _acos_::op_code:
+	case _atan_::op_code:
+		return 35;
+	case _atan2_::op_code:
+		return 40;
+	case _pow_::op_code:
+	case _fast_pow_::op_code:
+		return 50;
+	case _interp_::op_code:
+		// clamp, subtraction and FMA, the search only compares
+		return 5;
+	default:
+		return 0;
+	}
+}
+
+
+/**
+ * Static cost of the expression per element (single value of every array component).
+ */
+struct CostModel {
+	/// Number of operations of the program.
+	uint n_ops = 0;
+	/// Flops per element, elementary functions weighted by op_flops.
+	double flops = 0;
+	/// Loads of the operands and stores of the results by the operations, per element.
+	double loads = 0;
+	double stores = 0;
+	/// Bytes per element moved by the operations (mostly in cache).
+	double bytes_internal = 0;
+	/// Bytes per element read from the input values and written to the results (main memory for large vectors).
+	double bytes_external = 0;
+
+	/// Flops per byte of the external traffic.
+	double intensity() const {
+		return bytes_external > 0 ? flops / bytes_external : 0.0;
+	}
+
+	std::string print() const {
+		std::stringstream ss;
+		ss << "ops: " << n_ops << ", flops/element: " << flops
+		   << ", loads/element: " << loads << ", stores/element: " << stores << "\n"
+		   << "bytes/element internal: " << bytes_internal << ", external: " << bytes_external
+		   << ", intensity [flop/B]: " << intensity() << "\n";
+		return ss.str();
+	}
+};
+
+
+/**
+ * Cost model of the expression with values of 'scalar_size' bytes, 'fast_math' as in ProcessorOptions.
+ */
+inline CostModel cost_model(details::ExpressionDAG &se, uint scalar_size, bool fast_math = false) {
+	using namespace details;
+	CostModel cm;
+	for(ScalarNodePtr node : se.sort_nodes()) {
+		switch (node->result_storage) {
+		case value:
+			cm.bytes_external += node->half_ ? sizeof(uint16_t) : scalar_size;
+			break;
+		case value_copy:
+			// source read, copy written and read by the operations
+			cm.bytes_external += scalar_size;
+			cm.bytes_internal += 2 * scalar_size;
+			break;
+		case expr_result:
+			// a bit per element of the packed boolean result
+			cm.bytes_external += (node->op_code_ == _pack_::op_code) ? 1.0 / 8 : scalar_size;
+			// fall through
+		case temporary: {
+			unsigned char code = node->op_code_;
+			if (fast_math) code = fast_op_code(code, scalar_size == sizeof(float));
+			cm.n_ops++;
+			// Horner's scheme, an FMA per coefficient
+			cm.flops += (code == _polyval_::op_code) ? 2.0 * (node->table_size_ - 1) : op_flops(code);
+			cm.loads += node->n_inputs_;
+			cm.stores += 1;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	cm.bytes_internal += (cm.loads + cm.stores) * scalar_size;
+	return cm;
+}
+
+
+/**
+ * Peak flops and memory bandwidth of the machine, for the roofline bound.
+ */
+struct MachineModel {
+	/// flop/s
+	double peak_flops = 0;
+	/// bytes/s
+	double peak_bandwidth = 0;
+
+	/**
+	 * Rough measurement of the peaks with the current build: independent FMA chains
+	 * on Vec4d for the flops, 'a = b + s * c' over 'n_values' doubles per array for the bandwidth.
+	 */
+	static MachineModel measure(uint n_values = 1 << 22) {
+		typedef std::chrono::high_resolution_clock Clock;
+		MachineModel m;
+		{
+			const uint n_iter = 1 << 22;
+			Vec4d acc[8];
+			for(uint k=0; k < 8; ++k) acc[k] = Vec4d(k);
+			Vec4d a(0.999999), b(1e-7);
+			// the volatile store keeps the chains before the end of the timing
+			volatile double sink;
+			auto start = Clock::now();
+			for(uint i=0; i < n_iter; ++i)
+				for(uint k=0; k < 8; ++k) acc[k] = mul_add(acc[k], a, b);
+			Vec4d sum = acc[0];
+			for(uint k=1; k < 8; ++k) sum += acc[k];
+			sink = horizontal_add(sum);
+			double t = std::chrono::duration<double>(Clock::now() - start).count();
+			m.peak_flops = (sink == sink) ? 2.0 * 4 * 8 * n_iter / t : 0.0;
+		}
+		{
+			std::vector<double> a(n_values), b(n_values, 1.0), c(n_values, 2.0);
+			double best = 0;
+			for(uint i_rep=0; i_rep < 5; ++i_rep) {
+				auto start = Clock::now();
+				for(uint i=0; i < n_values; ++i) a[i] = b[i] + 3.0 * c[i];
+				double t = std::chrono::duration<double>(Clock::now() - start).count();
+				best = std::max(best, 3.0 * sizeof(double) * n_values / t);
+			}
+			if (a[n_values / 2] != 7.0) best = -1;
+			m.peak_bandwidth = best;
+		}
+		return m;
+	}
+};
+
+
+/**
+ * Measured performance of the processor compared to the cost model.
+ */
+struct RooflineReport {
+	CostModel model;
+	MachineModel machine;
+	/// Evaluated elements per run() and time per run() in seconds.
+	double n_elements = 0;
+	double time = 0;
+
+	double achieved_flops() const {
+		return model.flops * n_elements / time;
+	}
+
+	double achieved_bandwidth() const {
+		return model.bytes_external * n_elements / time;
+	}
+
+	/// Roofline bound of the flops: min(peak flops, intensity * peak bandwidth).
+	double attainable_flops() const {
+		return std::min(machine.peak_flops, model.intensity() * machine.peak_bandwidth);
+	}
+
+	bool bandwidth_bound() const {
+		return model.intensity() * machine.peak_bandwidth < machine.peak_flops;
+	}
+
+	std::string print() const {
+		std::stringstream ss;
+		ss << model.print()
+		   << "machine peak GFLOP/s: " << 1e-9 * machine.peak_flops
+		   << ", peak GB/s: " << 1e-9 * machine.peak_bandwidth << "\n"
+		   << "bound: " << (bandwidth_bound() ? "bandwidth" : "compute")
+		   << ", attainable GFLOP/s: " << 1e-9 * attainable_flops() << "\n"
+		   << "achieved GFLOP/s: " << 1e-9 * achieved_flops()
+		   << ", achieved GB/s: " << 1e-9 * achieved_bandwidth()
+		   << ", fraction of attainable: " << (attainable_flops() > 0 ? achieved_flops() / attainable_flops() : 0.0) << "\n";
+		return ss.str();
+	}
+};
+
+
+} // namespace bparser
+
+#endif /* INCLUDE_COST_MODEL_HH_ */
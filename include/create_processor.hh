@@ -25,31 +25,60 @@ namespace bparser{
         }
     }
 
-    ProcessorBase * ProcessorBase::create_processor(ExpressionDAG &se, uint vector_size, uint simd_size, ArenaAllocPtr arena) {
+    /**
+     * Number of values in the SIMD block of a processor with given 'precision',
+     * for the instruction set given by 'simd_size' (as returned by get_simd_size()).
+     * Single precision processors use at least SSE2 (Vec4f).
+     */
+    uint get_simd_size(uint simd_size, Precision precision) {
         if (simd_size == 0) {
             simd_size = get_simd_size();
         }
+        if (precision == single_precision) {
+            return std::max(4u, 2 * simd_size);
+        }
+        return simd_size;
+    }
+
+    /**
+     * 'simd_size' is the SIMD block size in doubles, selects the instruction set for both precisions.
+     */
+    ProcessorBase * ProcessorBase::create_processor(ExpressionDAG &se, uint vector_size, uint simd_size, ArenaAllocPtr arena, ProcessorOptions options) {
+        if (simd_size == 0) {
+            simd_size = get_simd_size();
+        }
+
+        if (options.precision == single_precision) {
+            switch (simd_size) {
+                case 4:
+                    return create_processor_<Vec8f>(se, vector_size, 8, arena, options);
+                case 8:
+                    return create_processor_<Vec16f>(se, vector_size, 16, arena, options);
+                default:
+                    return create_processor_<Vec4f>(se, vector_size, 4, arena, options);
+            }
+        }
 
         switch (simd_size) {
             case 2:
             {
                 // std::cout << "** create processor with SSE4 --" << std::endl;
-                return create_processor_<Vec2d>(se, vector_size, simd_size, arena);
+                return create_processor_<Vec2d>(se, vector_size, simd_size, arena, options);
             } break;
             case 4:
             { 
                 // std::cout << "** create processor with AVX2 --" << std::endl;
-                return create_processor_<Vec4d>(se, vector_size, simd_size, arena);
+                return create_processor_<Vec4d>(se, vector_size, simd_size, arena, options);
             } break;
             case 8:
             {
                 // std::cout << "** create processor with AVX512 --" << std::endl;
-                return create_processor_<Vec8d>(se, vector_size, simd_size, arena);
+                return create_processor_<Vec8d>(se, vector_size, simd_size, arena, options);
             } break;
             default:
             {
                 // std::cout << "** create processor w/o vectorization --" << std::endl;
-                return create_processor_<double>(se, vector_size, 1, arena);
+                return create_processor_<double>(se, vector_size, 1, arena, options);
             } break;
         }
     }
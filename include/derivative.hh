@@ -0,0 +1,246 @@
+/*
+ * derivative.hh
+ *
+ * Forward mode automatic differentiation of the scalar nodes of the expression.
+ * The derivatives are new scalar nodes using the nodes of the expression, so that
+ * the values and the derivatives are compiled into a single processor sharing
+ * the subexpressions (see Parser::set_derivative).
+ */
+
+#ifndef INCLUDE_DERIVATIVE_HH_
+#define INCLUDE_DERIVATIVE_HH_
+
+#include <vector>
+#include <map>
+#include <set>
+#include <cmath>
+#include "config.hh"
+#include "assert.hh"
+#include "scalar_node.hh"
+
+namespace bparser {
+namespace details {
+
+
+/**
+ * Derivatives of the nodes with respect to the single node 'x' (tangents), null for the zero derivative.
+ * The piecewise constant operations (comparisons, logical operations, floor, ...) have zero derivative,
+ * the derivatives of abs, min, max and ifelse are taken from the selected branch.
+ */
+class ForwardDerivative {
+public:
+	ForwardDerivative(ScalarNodePtr x)
+	: x_(x), one_(ScalarNode::create_const(1.0))
+	{}
+
+	/// Derivative of 'node' with respect to 'x', the constant zero node for the zero derivative.
+	ScalarNodePtr derivative(ScalarNodePtr node) {
+		ScalarNodePtr d = tangent(node);
+		return (d == nullptr) ? ScalarNode::create_const(0.0) : d;
+	}
+
+private:
+	ScalarNodePtr tangent(ScalarNodePtr node) {
+		if (node == x_) return one_;
+		auto it = tangents_.find(node);
+		if (it != tangents_.end()) return it->second;
+		ScalarNodePtr d = (node->n_inputs_ == 0) ? nullptr : rule(node);
+		tangents_[node] = d;
+		return d;
+	}
+
+	ScalarNodePtr rule(ScalarNodePtr node) {
+		ScalarNodePtr a = node->inputs_[0];
+		ScalarNodePtr b = node->n_inputs_ > 1 ? node->inputs_[1] : nullptr;
+		ScalarNodePtr c = node->n_inputs_ > 2 ? node->inputs_[2] : nullptr;
+		ScalarNodePtr da = tangent(a);
+		ScalarNodePtr db = (b == nullptr) ? nullptr : tangent(b);
+		ScalarNodePtr dc = (c == nullptr) ? nullptr : tangent(c);
+		if (da == nullptr && db == nullptr && dc == nullptr) return nullptr;
+
+		switch (node->op_code_) {
+		case _copy_::op_code:
+		case _gather_::op_code:
+		case _load_fp16_::op_code:
+		case _load_bf16_::op_code:
+			return da;
+		case _minus_::op_code:
+			return neg(da);
+		case _add_::op_code:
+			return add(da, db);
+		case _sub_::op_code:
+			return sub(da, db);
+		case _mul_::op_code:
+			return add(mul(da, b), mul(a, db));
+		case _div_::op_code:
+			// (da - r * db) / b
+			return div(sub(da, mul(node, db)), b);
+		case _mod_::op_code: {
+			// a - b * trunc(a / b)
+			if (db == nullptr) return da;
+			ScalarNodePtr q = ScalarNode::create<_div_>(a, b);
+			ScalarNodePtr trunc_q = ScalarNode::create<_mul_>(
+					ScalarNode::create<_sgn_>(q),
+					ScalarNode::create<_floor_>(ScalarNode::create<_abs_>(q)));
+			return sub(da, mul(trunc_q, db));
+		}
+		case _pow_::op_code: {
+			// b * a**(b - 1) * da + r * log(a) * db
+			ScalarNodePtr d_base = nullptr, d_exp = nullptr;
+			if (da != nullptr) {
+				ScalarNodePtr b_1 = (b->result_storage == constant) ?
+						ScalarNode::create_const(b->value_ - 1) : ScalarNode::create<_sub_>(b, one_);
+				d_base = mul(ScalarNode::create<_mul_>(b, ScalarNode::create<_pow_>(a, b_1)), da);
+			}
+			if (db != nullptr)
+				d_exp = mul(ScalarNode::create<_mul_>(node, ScalarNode::create<_log_>(a)), db);
+			return add(d_base, d_exp);
+		}
+		case _atan2_::op_code: {
+			// atan2(a, b): (b * da - a * db) / (a * a + b * b)
+			ScalarNodePtr r2 = ScalarNode::create<_add_>(
+					ScalarNode::create<_mul_>(a, a), ScalarNode::create<_mul_>(b, b));
+			return div(sub(mul(b, da), mul(a, db)), r2);
+		}
+		case _max_::op_code:
+			// a if b < a else b
+			return select(ScalarNode::create<_lt_>(b, a), da, db);
+		case _min_::op_code:
+			return select(ScalarNode::create<_lt_>(b, a), db, da);
+		case _ifelse_::op_code:
+			// a if b else c
+			return select(b, da, dc);
+		case _abs_::op_code:
+			return mul(ScalarNode::create<_sgn_>(a), da);
+		case _sqrt_::op_code:
+			return div(da, ScalarNode::create<_add_>(node, node));
+		case _exp_::op_code:
+			return mul(node, da);
+		case _log_::op_code:
+			return div(da, a);
+		case _log10_::op_code:
+			return div(da, ScalarNode::create<_mul_>(a, ScalarNode::create_const(std::log(10.0))));
+		case _log2_::op_code:
+			return div(da, ScalarNode::create<_mul_>(a, ScalarNode::create_const(std::log(2.0))));
+		case _sin_::op_code:
+			return mul(ScalarNode::create<_cos_>(a), da);
+		case _cos_::op_code:
+			return neg(mul(ScalarNode::create<_sin_>(a), da));
+		case _tan_::op_code:
+			// 1 + r * r
+			return mul(ScalarNode::create<_add_>(one_, ScalarNode::create<_mul_>(node, node)), da);
+		case _sinh_::op_code:
+			return mul(ScalarNode::create<_cosh_>(a), da);
+		case _cosh_::op_code:
+			return mul(ScalarNode::create<_sinh_>(a), da);
+		case _tanh_::op_code:
+			// 1 - r * r
+			return mul(ScalarNode::create<_sub_>(one_, ScalarNode::create<_mul_>(node, node)), da);
+		case _asin_::op_code:
+		case _acos_::op_code: {
+			ScalarNodePtr d = div(da, ScalarNode::create<_sqrt_>(
+					ScalarNode::create<_sub_>(one_, ScalarNode::create<_mul_>(a, a))));
+			return (node->op_code_ == _asin_::op_code) ? d : neg(d);
+		}
+		case _atan_::op_code:
+			return div(da, ScalarNode::create<_add_>(one_, ScalarNode::create<_mul_>(a, a)));
+		case _polyval_::op_code: {
+			// coefficients of the derivative polynomial, highest power first
+			uint n = node->table_size_;
+			if (n < 2) return nullptr;
+			std::vector<double> dp(n - 1);
+			for(uint k=0; k < n - 1; ++k) dp[k] = node->table_[k] * (n - 1 - k);
+			const double * dp_ptr = NodePool::current().create_table(dp);
+			return mul(ScalarNode::create_polyval(a, dp_ptr, n - 1), da);
+		}
+		case _eq_::op_code:
+		case _ne_::op_code:
+		case _lt_::op_code:
+		case _le_::op_code:
+		case _neg_::op_code:
+		case _or_::op_code:
+		case _and_::op_code:
+		case _ceil_::op_code:
+		case _floor_::op_code:
+		case _sgn_::op_code:
+		case _isnan_::op_code:
+		case _isinf_::op_code:
+			return nullptr;
+		default:
+			Throw() << "Derivative of the operation '" << node->op_name_ << "' is not supported.\n";
+		}
+		return nullptr;
+	}
+
+	// Operations on the tangents, null is the zero.
+	ScalarNodePtr add(ScalarNodePtr a, ScalarNodePtr b) {
+		if (a == nullptr) return b;
+		if (b == nullptr) return a;
+		return ScalarNode::create<_add_>(a, b);
+	}
+
+	ScalarNodePtr sub(ScalarNodePtr a, ScalarNodePtr b) {
+		if (b == nullptr) return a;
+		if (a == nullptr) return neg(b);
+		return ScalarNode::create<_sub_>(a, b);
+	}
+
+	ScalarNodePtr neg(ScalarNodePtr a) {
+		return (a == nullptr) ? nullptr : ScalarNode::create<_minus_>(a);
+	}
+
+	ScalarNodePtr mul(ScalarNodePtr a, ScalarNodePtr b) {
+		if (a == nullptr || b == nullptr) return nullptr;
+		if (a == one_) return b;
+		if (b == one_) return a;
+		return ScalarNode::create<_mul_>(a, b);
+	}
+
+	ScalarNodePtr div(ScalarNodePtr a, ScalarNodePtr b) {
+		if (a == nullptr) return nullptr;
+		return ScalarNode::create<_div_>(a, b);
+	}
+
+	ScalarNodePtr select(ScalarNodePtr cond, ScalarNodePtr a, ScalarNodePtr b) {
+		if (a == nullptr && b == nullptr) return nullptr;
+		ScalarNodePtr zero = ScalarNode::create_const(0.0);
+		return ScalarNode::create_ifelse(a == nullptr ? zero : a, cond, b == nullptr ? zero : b);
+	}
+
+	ScalarNodePtr x_;
+	ScalarNodePtr one_;
+	std::map<ScalarNodePtr, ScalarNodePtr> tangents_;
+};
+
+
+/**
+ * Nodes of 'outputs' that can not be made the result nodes in place (see ScalarNode::create_result):
+ * the nodes repeated in the outputs and the nodes used as the operands of the other nodes.
+ */
+inline std::set<ScalarNodePtr> shared_outputs(const std::vector<ScalarNodePtr> &outputs) {
+	std::set<ScalarNodePtr> shared, seen, operands;
+	std::vector<ScalarNodePtr> stack;
+	for(ScalarNodePtr node : outputs) {
+		if (! seen.insert(node).second) shared.insert(node);
+		stack.push_back(node);
+	}
+	std::set<ScalarNodePtr> visited;
+	while (! stack.empty()) {
+		ScalarNodePtr node = stack.back();
+		stack.pop_back();
+		if (! visited.insert(node).second) continue;
+		for(uint i=0; i < node->n_inputs_; ++i) {
+			operands.insert(node->inputs_[i]);
+			stack.push_back(node->inputs_[i]);
+		}
+	}
+	for(ScalarNodePtr node : outputs)
+		if (operands.count(node)) shared.insert(node);
+	return shared;
+}
+
+
+} // namespace details
+} // namespace bparser
+
+#endif /* INCLUDE_DERIVATIVE_HH_ */
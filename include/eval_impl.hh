@@ -4,23 +4,32 @@ using namespace details;
 
 template <typename VecType>
 struct Vec {
-	double *values;
-	uint *subset;
+	typedef typename ScalarType<VecType>::type Scalar;
+
+	// Number of values in the SIMD block.
+	static const uint n_lanes = sizeof(VecType) / sizeof(Scalar);
+
+	Scalar *values;
+	// Indices of the SIMD blocks.
+	const uint *subset;
+	// Results are stored by the non-temporal stores, see ProcessorOptions::nt_stores.
+	bool nt_store;
 
 	typedef VecType MyVCLVec;
 
-	void set(double * v, uint * s) {
+	void set(Scalar * v, const uint * s) {
 		values = v;
 		subset = s;
+		nt_store = false;
 	}
 
-	inline double * value(uint i) {
+	inline Scalar * value(uint i) {
 		// std::cout << "self: " << this << std::endl;
 		// std::cout << "v: " << values << " s: " << subset << std::endl;
 		// std::cout << "i: " << i << std::endl;
 		// std::cout << " si: " << subset[i] << std::endl;
 
-		return &(values[subset[i]]);
+		return &(values[subset[i] * n_lanes]);
 	}
 
 
@@ -35,6 +44,34 @@ struct Vec {
 };
 
 
+/**
+ * Interpolation table of the _interp_ operation in the processor arena. Breakpoints 'xp', values 'fp'
+ * and slopes of the segments indexed by the segment. The search positions 'n_search' (power of 2) hold
+ * the breakpoints of the segments [0, n-2] followed by the infinity.
+ */
+template <typename Scalar>
+struct InterpTable {
+	uint n;
+	uint n_search;
+	Scalar *xp;
+	Scalar *fp;
+	Scalar *slope;
+	// first and last breakpoint, 'x' is clamped to [x_min, x_max]
+	Scalar x_min;
+	Scalar x_max;
+};
+
+
+/**
+ * Coefficients of the _polyval_ operation in the processor arena, highest power first.
+ */
+template <typename Scalar>
+struct PolyTable {
+	uint n;
+	Scalar *c;
+};
+
+
 /**
  * Processor's storage.
  */
@@ -45,9 +82,52 @@ struct Workspace {
 	// Array of vectors. Temporaries, input vectors and result vectors.
 	Vec<VecType> *vector;
 
+	uint n_vectors;
+
 	uint subset_size;
 	uint *const_subset;
-	uint *vec_subset;
+	// Active subset, either the 'subset_buffer' or caller owned indices.
+	const uint *vec_subset;
+	uint *subset_buffer;
+	// Identity 0, 1, ... for the temporaries, indexed by the position in the active subset.
+	uint *flat_subset;
+	// Capacity of the temporaries in SIMD blocks.
+	uint temp_n_blocks;
+	// Tables of the _interp_ operations.
+	InterpTable<typename ScalarType<VecType>::type> *interp_tables;
+	// Coefficients of the _polyval_ operations.
+	PolyTable<typename ScalarType<VecType>::type> *poly_tables;
+	// Boolean temporaries [packed_begin, packed_end) stored as the packed bits, see MaskBits.
+	uint packed_begin = 0;
+	uint packed_end = 0;
+
+	inline bool is_packed(uint idx) const {
+		return idx >= packed_begin && idx < packed_end;
+	}
+
+	// Any of the 'n_args' vectors of the operation is packed.
+	inline bool is_packed(const unsigned char *arg, uint n_args) const {
+		for(uint j=0; j < n_args; ++j)
+			if (is_packed(arg[j])) return true;
+		return false;
+	}
+
+	// Vector addressed without the subset indices, dense (flat_subset) or constant.
+	inline bool is_dense(const Vec<VecType> &v) const {
+		return v.subset == flat_subset || v.subset == const_subset;
+	}
+
+	// All 'n_args' vectors of the operation are dense.
+	inline bool is_dense(const unsigned char *arg, uint n_args) const {
+		for(uint j=0; j < n_args; ++j)
+			if (! is_dense(vector[arg[j]])) return false;
+		return true;
+	}
+
+	// Step between the blocks of the dense vector, zero for the constants.
+	inline uint dense_step(const Vec<VecType> &v) const {
+		return v.subset == const_subset ? 0 : Vec<VecType>::n_lanes;
+	}
 
 };
 
@@ -63,8 +143,263 @@ struct Operation {
 };
 
 
+/**
+ * Number of SIMD blocks evaluated in the single iteration of the vectorized EvalImpl::eval.
+ * Independent blocks hide the latency of the cheap operations. The elementary functions
+ * have enough independent instructions in their own bodies and 'ifelse' has four operands,
+ * more copies would only spill the registers (see test_unroll in test_speed.cc).
+ */
+constexpr uint unroll_factor(unsigned char op_code) {
+	switch (op_code) {
+	case _ifelse_::op_code:
+	case _exp_::op_code:
+	case _log_::op_code:
+	case _log10_::op_code:
+	case _log2_::op_code:
+	case _sin_::op_code:
+	case _sinh_::op_code:
+	case _asin_::op_code:
+	case _cos_::op_code:
+	case _cosh_::op_code:
+	case _acos_::op_code:
+	case _tan_::op_code:
+	case _tanh_::op_code:
+	case _atan_::op_code:
+	case _atan2_::op_code:
+	case _pow_::op_code:
+	case _fast_exp_::op_code:
+	case _fast_log_::op_code:
+	case _fast_log10_::op_code:
+	case _fast_log2_::op_code:
+	case _fast_sin_::op_code:
+	case _fast_cos_::op_code:
+	case _fast_tanh_::op_code:
+	case _fast_pow_::op_code:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+
+/**
+ * Store of the result block, non-temporal (bypassing the cache) if 'nt_store'.
+ * The non-temporal store needs 'p' aligned to the size of VecType.
+ */
+template <bool nt_store, typename VecType, typename Scalar>
+inline typename std::enable_if<! std::is_arithmetic<VecType>::value>::type
+store_block(const VecType &v, Scalar *p) {
+	if (nt_store)
+		v.store_nt(p);
+	else
+		v.store(p);
+}
+
+// Scalar processor, single value blocks.
+template <bool nt_store, typename VecType, typename Scalar>
+inline typename std::enable_if<std::is_arithmetic<VecType>::value>::type
+store_block(const VecType &v, Scalar *p) {
+	*p = v;
+}
+
+/**
+ * Load of the SIMD block from 'p'.
+ */
+template <typename VecType, typename Scalar>
+inline typename std::enable_if<! std::is_arithmetic<VecType>::value, VecType>::type
+load_block(const Scalar *p) {
+	VecType v;
+	v.load(p);
+	return v;
+}
+
+template <typename VecType, typename Scalar>
+inline typename std::enable_if<std::is_arithmetic<VecType>::value, VecType>::type
+load_block(const Scalar *p) {
+	return *p;
+}
+
+/**
+ * Copy of the SIMD block 'src' to 'dst', see store_block.
+ */
+template <bool nt_store, typename VecType, typename Scalar>
+inline void copy_block(const Scalar *src, Scalar *dst) {
+	store_block<nt_store>(load_block<VecType>(src), dst);
+}
+
+
 template<uint NParams, class T, typename VecType>
 struct EvalImpl;
+
+
+/**
+ * Evaluate the operation by the variant of Impl::eval_blocks: with the non-temporal
+ * stores of the result, with the dense addressing if all vectors of the operation are dense.
+ */
+template <class Impl, uint n_unroll, uint n_args, typename VecType>
+inline void eval_variant(Operation op, Workspace<VecType> &w) {
+	bool nt_store = w.vector[op.arg[0]].nt_store;
+	if (w.is_dense(op.arg, n_args)) {
+		if (nt_store)
+			Impl::template eval_blocks<n_unroll, true, true>(op, w);
+		else
+			Impl::template eval_blocks<n_unroll, false, true>(op, w);
+	} else {
+		if (nt_store)
+			Impl::template eval_blocks<n_unroll, true, false>(op, w);
+		else
+			Impl::template eval_blocks<n_unroll, false, false>(op, w);
+	}
+}
+
+
+/**
+ * Boolean block packed to a bit per element (movemask on AVX2, mask register on AVX-512),
+ * the packed boolean temporaries hold a single MaskBits per block instead of the full mask.
+ */
+template <typename VecType>
+struct MaskBits {
+	typedef decltype(to_bits(as_bool(VecType()))) type;
+};
+
+template <>
+struct MaskBits<double> {
+	typedef uint8_t type;
+};
+
+template <typename VecType>
+inline typename MaskBits<VecType>::type pack_block(const VecType &v) {
+	return to_bits(as_bool(v));
+}
+
+inline uint8_t pack_block(double v) {
+	return as_bool(v) != 0;
+}
+
+template <typename VecType>
+inline VecType unpack_block(typename MaskBits<VecType>::type bits) {
+	typename d_to_b<VecType>::bool_type b;
+	b.load_bits(bits);
+	return as_double(b);
+}
+
+/**
+ * Operation reading or writing a packed boolean temporary, 'packed' has the bit 'j' set for the packed
+ * vector arg[j]. The packed operands are unpacked to the masks in the registers, the result is packed.
+ */
+template <uint n_args, class T, typename VecType, uint packed>
+struct PackedEval {
+	typedef typename MaskBits<VecType>::type Bits;
+	typedef typename Vec<VecType>::Scalar Scalar;
+
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w) {
+		Vec<VecType> v[n_args];
+		uint s[n_args];
+		for(uint j=0; j < n_args; ++j) {
+			v[j] = w.vector[op.arg[j]];
+			s[j] = w.dense_step(v[j]);
+		}
+		uint i=0;
+		for(; i + n_unroll <= w.subset_size; i += n_unroll)
+			for(uint k=0; k < n_unroll; ++k)
+				eval_block<nt_store, dense>(v, s, i + k, std::make_index_sequence<n_args - 1>());
+		for(; i<w.subset_size; ++i)
+			eval_block<nt_store, dense>(v, s, i, std::make_index_sequence<n_args - 1>());
+	}
+
+	template <bool nt_store, bool dense, std::size_t... I>
+	inline static void eval_block(Vec<VecType> *v, const uint *s, uint i, std::index_sequence<I...>) {
+		VecType x[n_args];
+		for(uint j=1; j < n_args; ++j)
+			x[j] = ((packed >> j) & 1) ? unpack_block<VecType>(((Bits *)v[j].values)[i])
+					: load_block<VecType>(dense ? v[j].values + i * s[j] : v[j].value(i));
+		T::eval(x[0], x[I + 1]...);
+		if (packed & 1)
+			((Bits *)v[0].values)[i] = pack_block(x[0]);
+		else
+			store_block<nt_store>(x[0], dense ? v[0].values + i * s[0] : v[0].value(i));
+	}
+};
+
+// Vectors of the operation T that may be packed, see is_bool_op, is_bool_input.
+template <uint n_args, class T>
+constexpr uint packed_args() {
+	uint mask = is_bool_op(T::op_code) ? 1 : 0;
+	for(uint j=1; j < n_args; ++j)
+		if (is_bool_input(T::op_code, j - 1)) mask |= 1u << j;
+	return mask;
+}
+
+// Packed vector 'idx' or a constant (e.g. True of the comparison chains), see eval_bits.
+template <typename VecType>
+inline bool is_bits_operand(const Workspace<VecType> &w, uint idx) {
+	return w.is_packed(idx) || w.vector[idx].subset == w.const_subset;
+}
+
+/**
+ * Logical operation (and, or, not) of the packed result and the packed or constant inputs,
+ * directly on the bits of the blocks. The constant block is packed once, with the zero step.
+ */
+template <uint n_args, class T, typename VecType>
+inline void eval_bits(Operation op, Workspace<VecType> &w) {
+	typedef typename MaskBits<VecType>::type Bits;
+	const Bits lanes = Bits((uint64_t(1) << Vec<VecType>::n_lanes) - 1);
+	Bits *r = (Bits *)w.vector[op.arg[0]].values;
+	Bits c[2];
+	const Bits *in[2];
+	uint step[2];
+	for(uint j=0; j < 2; ++j) {
+		uint idx = op.arg[std::min(j + 1, n_args - 1)];
+		step[j] = w.is_packed(idx) ? 1 : 0;
+		if (step[j] == 0) c[j] = pack_block(load_block<VecType>(w.vector[idx].values));
+		in[j] = step[j] ? (const Bits *)w.vector[idx].values : &c[j];
+	}
+	const Bits *a = in[0], *b = in[1];
+	for(uint i=0; i<w.subset_size; ++i) {
+		switch (T::op_code) {
+		case _and_::op_code: r[i] = a[i * step[0]] & b[i * step[1]]; break;
+		case _or_::op_code: r[i] = a[i * step[0]] | b[i * step[1]]; break;
+		default: r[i] = ~a[i * step[0]] & lanes; break;
+		}
+	}
+}
+
+/**
+ * Dispatch of the operation with the packed vectors to eval_bits or to the PackedEval variant.
+ */
+template <uint n_args, class T, typename VecType>
+struct MaskEval {
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		uint packed = 0;
+		for(uint j=0; j < n_args; ++j)
+			if (w.is_packed(op.arg[j])) packed |= 1u << j;
+		if constexpr (T::op_code == _and_::op_code || T::op_code == _or_::op_code || T::op_code == _neg_::op_code) {
+			bool bits_operands = (packed & 1);
+			for(uint j=1; j < n_args; ++j)
+				bits_operands = bits_operands && is_bits_operand(w, op.arg[j]);
+			if (bits_operands) {
+				eval_bits<n_args, T>(op, w);
+				return;
+			}
+		}
+		dispatch<packed_args<n_args, T>()>(op, w, packed);
+	}
+
+	template <uint packed>
+	inline static void dispatch(Operation op, Workspace<VecType> &w, uint actual) {
+		if constexpr (packed > 0) {
+			// only the subsets of packed_args
+			if constexpr ((packed & packed_args<n_args, T>()) == packed) {
+				if (actual == packed) {
+					eval_variant<PackedEval<n_args, T, VecType, packed>, unroll_factor(T::op_code), n_args>(op, w);
+					return;
+				}
+			}
+			dispatch<packed - 1>(op, w, actual);
+		}
+	}
+};
 //{
 //	static inline void eval(Operation op, Workspace &w) {};
 //};
@@ -73,7 +408,11 @@ struct EvalImpl;
 // EvalmImpl with 1 operand
 template <class T, typename VecType>
 struct EvalImpl<1, T, VecType> {
-	inline static void eval(Operation op, Workspace<VecType> &w);
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		eval_variant<EvalImpl, unroll_factor(T::op_code), 1>(op, w);
+	}
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w);
 };
 
 template <class T>
@@ -82,13 +421,30 @@ struct EvalImpl<1, T, double> {
 };
 
 template <class T, typename VecType>
-inline void EvalImpl<1, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
+template <uint n_unroll, bool nt_store, bool dense>
+inline void EvalImpl<1, T, VecType>::eval_blocks(Operation op, Workspace<VecType> &w) {
+	typedef typename Vec<VecType>::Scalar Scalar;
 	Vec<VecType> v0 = w.vector[op.arg[0]];
+	// steps of the dense addressing
+	const uint s0 = w.dense_step(v0);
+
+	uint i=0;
+	// 'n_unroll' independent SIMD blocks per iteration
+	for(; i + n_unroll <= w.subset_size; i += n_unroll) {
+		VecType v0i[n_unroll];
+
+		for(uint k=0; k < n_unroll; ++k) {
+			v0i[k].load(dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+		}
+		for(uint k=0; k < n_unroll; ++k)
+			T::eval(v0i[k]);
+		for(uint k=0; k < n_unroll; ++k)
+			store_block<nt_store>(v0i[k], dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+	}
 
-	for(uint i=0; i<w.subset_size; ++i) {
-		//std::cout << "subset: " << i << std::endl;
-
-		double * v0id = v0.value(i);
+	// remaining blocks
+	for(; i<w.subset_size; ++i) {
+		Scalar * v0id = dense ? v0.values + i * s0 : v0.value(i);
 		VecType v0i;
 
 		// load value into vector
@@ -98,7 +454,7 @@ inline void EvalImpl<1, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
 		T::eval(v0i);
 
 		// store result into memory at v0id
-		v0i.store(v0id);
+		store_block<nt_store>(v0i, v0id);
 	}
 }
 
@@ -120,7 +476,17 @@ inline void EvalImpl<1, T, double>::eval(Operation op, Workspace<double> &w) {
 // EvalmImpl with 2 operands
 template <class T, typename VecType>
 struct EvalImpl<2, T, VecType> {
-	inline static void eval(Operation op, Workspace<VecType> &w);
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		if constexpr (is_bool_op(T::op_code) || T::op_code == _ifelse_::op_code) {
+			if (w.is_packed(op.arg, 2)) {
+				MaskEval<2, T, VecType>::eval(op, w);
+				return;
+			}
+		}
+		eval_variant<EvalImpl, unroll_factor(T::op_code), 2>(op, w);
+	}
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w);
 };
 
 template <class T>
@@ -129,15 +495,35 @@ struct EvalImpl<2, T, double> {
 };
 
 template <class T, typename VecType>
-inline void EvalImpl<2, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
+template <uint n_unroll, bool nt_store, bool dense>
+inline void EvalImpl<2, T, VecType>::eval_blocks(Operation op, Workspace<VecType> &w) {
+	typedef typename Vec<VecType>::Scalar Scalar;
 	Vec<VecType> v0 = w.vector[op.arg[0]];
 	Vec<VecType> v1 = w.vector[op.arg[1]];
+	// steps of the dense addressing
+	const uint s0 = w.dense_step(v0);
+	const uint s1 = w.dense_step(v1);
+
+	uint i=0;
+	// 'n_unroll' independent SIMD blocks per iteration
+	for(; i + n_unroll <= w.subset_size; i += n_unroll) {
+		VecType v0i[n_unroll];
+		VecType v1i[n_unroll];
+
+		for(uint k=0; k < n_unroll; ++k) {
+			v0i[k].load(dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+			v1i[k].load(dense ? v1.values + (i + k) * s1 : v1.value(i + k));
+		}
+		for(uint k=0; k < n_unroll; ++k)
+			T::eval(v0i[k], v1i[k]);
+		for(uint k=0; k < n_unroll; ++k)
+			store_block<nt_store>(v0i[k], dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+	}
 
-	for(uint i=0; i<w.subset_size; ++i) {
-		//std::cout << "subset: " << i << std::endl;
-
-		double * v0id = v0.value(i);
-		double * v1id = v1.value(i);
+	// remaining blocks
+	for(; i<w.subset_size; ++i) {
+		Scalar * v0id = dense ? v0.values + i * s0 : v0.value(i);
+		Scalar * v1id = dense ? v1.values + i * s1 : v1.value(i);
 		VecType v0i;
 		VecType v1i;
 
@@ -149,7 +535,7 @@ inline void EvalImpl<2, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
 		T::eval(v0i, v1i);
 
 		// store result into memory at v0id
-		v0i.store(v0id); 
+		store_block<nt_store>(v0i, v0id);
 	}
 }
 
@@ -173,7 +559,17 @@ inline void EvalImpl<2, T, double>::eval(Operation op, Workspace<double> &w) {
 // EvalmImpl with 3 operands
 template <class T, typename VecType>
 struct EvalImpl<3, T, VecType> {
-	inline static void eval(Operation op, Workspace<VecType> &w);
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		if constexpr (is_bool_op(T::op_code) || T::op_code == _ifelse_::op_code) {
+			if (w.is_packed(op.arg, 3)) {
+				MaskEval<3, T, VecType>::eval(op, w);
+				return;
+			}
+		}
+		eval_variant<EvalImpl, unroll_factor(T::op_code), 3>(op, w);
+	}
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w);
 };
 
 template <class T>
@@ -182,20 +578,40 @@ struct EvalImpl<3, T, double> {
 };
 
 template <class T, typename VecType>
-inline void EvalImpl<3, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
+template <uint n_unroll, bool nt_store, bool dense>
+inline void EvalImpl<3, T, VecType>::eval_blocks(Operation op, Workspace<VecType> &w) {
+	typedef typename Vec<VecType>::Scalar Scalar;
 	Vec<VecType> v0 = w.vector[op.arg[0]];
 	Vec<VecType> v1 = w.vector[op.arg[1]];
 	Vec<VecType> v2 = w.vector[op.arg[2]];
-		// std::cout << "iv0:" << uint(op.arg[0])
-		// 		<< "iv1:" << uint(op.arg[1])
-		// 		<< "iv2:" << uint(op.arg[2]) << std::endl;
-
-	for(uint i=0; i<w.subset_size; ++i) {
-		// std::cout << "subset: " << i << std::endl;
+	// steps of the dense addressing
+	const uint s0 = w.dense_step(v0);
+	const uint s1 = w.dense_step(v1);
+	const uint s2 = w.dense_step(v2);
+
+	uint i=0;
+	// 'n_unroll' independent SIMD blocks per iteration
+	for(; i + n_unroll <= w.subset_size; i += n_unroll) {
+		VecType v0i[n_unroll];
+		VecType v1i[n_unroll];
+		VecType v2i[n_unroll];
+
+		for(uint k=0; k < n_unroll; ++k) {
+			v0i[k].load(dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+			v1i[k].load(dense ? v1.values + (i + k) * s1 : v1.value(i + k));
+			v2i[k].load(dense ? v2.values + (i + k) * s2 : v2.value(i + k));
+		}
+		for(uint k=0; k < n_unroll; ++k)
+			T::eval(v0i[k], v1i[k], v2i[k]);
+		for(uint k=0; k < n_unroll; ++k)
+			store_block<nt_store>(v0i[k], dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+	}
 
-		double * v0id = v0.value(i);
-		double * v1id = v1.value(i);
-		double * v2id = v2.value(i);
+	// remaining blocks
+	for(; i<w.subset_size; ++i) {
+		Scalar * v0id = dense ? v0.values + i * s0 : v0.value(i);
+		Scalar * v1id = dense ? v1.values + i * s1 : v1.value(i);
+		Scalar * v2id = dense ? v2.values + i * s2 : v2.value(i);
 		VecType v0i;
 		VecType v1i;
 		VecType v2i;
@@ -209,7 +625,7 @@ inline void EvalImpl<3, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
 		T::eval(v0i, v1i, v2i);
 
 		// store result into memory at v0id
-		v0i.store(v0id);
+		store_block<nt_store>(v0i, v0id);
 	}
 }
 
@@ -235,7 +651,17 @@ inline void EvalImpl<3, T, double>::eval(Operation op, Workspace<double> &w) {
 // EvalmImpl with 4 operands
 template <class T, typename VecType>
 struct EvalImpl<4, T, VecType> {
-	inline static void eval(Operation op, Workspace<VecType> &w);
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		if constexpr (is_bool_op(T::op_code) || T::op_code == _ifelse_::op_code) {
+			if (w.is_packed(op.arg, 4)) {
+				MaskEval<4, T, VecType>::eval(op, w);
+				return;
+			}
+		}
+		eval_variant<EvalImpl, unroll_factor(T::op_code), 4>(op, w);
+	}
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w);
 };
 
 template <class T>
@@ -244,23 +670,45 @@ struct EvalImpl<4, T, double> {
 };
 
 template <class T, typename VecType>
-inline void EvalImpl<4, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
+template <uint n_unroll, bool nt_store, bool dense>
+inline void EvalImpl<4, T, VecType>::eval_blocks(Operation op, Workspace<VecType> &w) {
+	typedef typename Vec<VecType>::Scalar Scalar;
 	Vec<VecType> v0 = w.vector[op.arg[0]];
 	Vec<VecType> v1 = w.vector[op.arg[1]];
 	Vec<VecType> v2 = w.vector[op.arg[2]];
 	Vec<VecType> v3 = w.vector[op.arg[3]];
-		// std::cout << "iv0:" << uint(op.arg[0])
-		// 		<< "iv1:" << uint(op.arg[1])
-		// 		<< "iv2:" << uint(op.arg[2])
-		// 		<< "iv3:" << uint(op.arg[3]) << std::endl;
-
-	for(uint i=0; i<w.subset_size; ++i) {
-		//std::cout << "subset: " << i << std::endl;
+	// steps of the dense addressing
+	const uint s0 = w.dense_step(v0);
+	const uint s1 = w.dense_step(v1);
+	const uint s2 = w.dense_step(v2);
+	const uint s3 = w.dense_step(v3);
+
+	uint i=0;
+	// 'n_unroll' independent SIMD blocks per iteration
+	for(; i + n_unroll <= w.subset_size; i += n_unroll) {
+		VecType v0i[n_unroll];
+		VecType v1i[n_unroll];
+		VecType v2i[n_unroll];
+		VecType v3i[n_unroll];
+
+		for(uint k=0; k < n_unroll; ++k) {
+			v0i[k].load(dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+			v1i[k].load(dense ? v1.values + (i + k) * s1 : v1.value(i + k));
+			v2i[k].load(dense ? v2.values + (i + k) * s2 : v2.value(i + k));
+			v3i[k].load(dense ? v3.values + (i + k) * s3 : v3.value(i + k));
+		}
+		for(uint k=0; k < n_unroll; ++k)
+			T::eval(v0i[k], v1i[k], v2i[k], v3i[k]);
+		for(uint k=0; k < n_unroll; ++k)
+			store_block<nt_store>(v0i[k], dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+	}
 
-		double * v0id = v0.value(i);
-		double * v1id = v1.value(i);
-		double * v2id = v2.value(i);
-		double * v3id = v3.value(i);
+	// remaining blocks
+	for(; i<w.subset_size; ++i) {
+		Scalar * v0id = dense ? v0.values + i * s0 : v0.value(i);
+		Scalar * v1id = dense ? v1.values + i * s1 : v1.value(i);
+		Scalar * v2id = dense ? v2.values + i * s2 : v2.value(i);
+		Scalar * v3id = dense ? v3.values + i * s3 : v3.value(i);
 		VecType v0i;
 		VecType v1i;
 		VecType v2i;
@@ -276,7 +724,7 @@ inline void EvalImpl<4, T, VecType>::eval(Operation op, Workspace<VecType> &w) {
 		T::eval(v0i, v1i, v2i, v3i);
 
 		// store result into memory at v0id
-		v0i.store(v0id);
+		store_block<nt_store>(v0i, v0id);
 	}
 }
 
@@ -300,4 +748,438 @@ inline void EvalImpl<4, T, double>::eval(Operation op, Workspace<double> &w) {
 	}
 }
 
+
+/**
+ * Integer vector type of the element indices of the SIMD vector type VecType.
+ */
+template <typename VecType> struct IndexType;
+template <> struct IndexType<Vec2d> { typedef Vec2q type; };
+template <> struct IndexType<Vec4d> { typedef Vec4q type; };
+template <> struct IndexType<Vec8d> { typedef Vec8q type; };
+template <> struct IndexType<Vec4f> { typedef Vec4i type; };
+template <> struct IndexType<Vec8f> { typedef Vec8i type; };
+template <> struct IndexType<Vec16f> { typedef Vec16i type; };
+
+
+// Gather of strided values, arg[1] is the value vector with values of the element 'i' at 'values[i * stride]'.
+template <typename VecType>
+struct EvalImpl<2, _gather_, VecType> {
+	inline static void eval(Operation op, Workspace<VecType> &w);
+};
+
+template <>
+struct EvalImpl<2, _gather_, double> {
+	inline static void eval(Operation op, Workspace<double> &w);
+};
+
+template <typename VecType>
+inline void EvalImpl<2, _gather_, VecType>::eval(Operation op, Workspace<VecType> &w) {
+	typedef typename Vec<VecType>::Scalar Scalar;
+	typedef typename IndexType<VecType>::type IndexVec;
+	Vec<VecType> v0 = w.vector[op.arg[0]];
+	Vec<VecType> v1 = w.vector[op.arg[1]];
+	uint stride = op.arg[2];
+
+	// offsets of the block elements, the table size for the 'lookup' is a large power of 2
+	// so the indices are not limited
+	IndexVec index;
+	for(int k=0; k < VecType::size(); ++k) index.insert(k, k * stride);
+
+	for(uint i=0; i<w.subset_size; ++i) {
+		Scalar * v0id = v0.value(i);
+		const Scalar * v1id = v1.values + v1.subset[i] * Vec<VecType>::n_lanes * stride;
+		VecType v0i = lookup<(1 << 30)>(index, v1id);
+		v0i.store(v0id);
+	}
+}
+
+inline void EvalImpl<2, _gather_, double>::eval(Operation op, Workspace<double> &w) {
+	Vec<double> v0 = w.vector[op.arg[0]];
+	Vec<double> v1 = w.vector[op.arg[1]];
+	uint stride = op.arg[2];
+
+	for(uint i=0; i<w.subset_size; ++i) {
+		*v0.value(i) = v1.values[v1.subset[i] * stride];
+	}
+}
+
+
+/**
+ * 16-bit values of a block of VecType: 'load' zero extends them to the 32-bit lanes of Bits,
+ * 'to_vec' converts the floats of the same lanes to VecType.
+ */
+template <typename VecType> struct HalfBlock;
+
+template <> struct HalfBlock<Vec2d> {
+	typedef Vec4ui Bits;
+	typedef Vec4f Float;
+	static Bits load(const uint16_t *p) {
+		uint32_t x;
+		memcpy(&x, p, sizeof(x));
+		return extend_low(Vec8us(_mm_cvtsi32_si128(x)));
+	}
+	static Vec2d to_vec(Float f) { return extend_low(f); }
+};
+
+template <> struct HalfBlock<Vec4f> {
+	typedef Vec4ui Bits;
+	typedef Vec4f Float;
+	static Bits load(const uint16_t *p) { return extend_low(Vec8us(_mm_loadl_epi64((const __m128i *)p))); }
+	static Vec4f to_vec(Float f) { return f; }
+};
+
+template <> struct HalfBlock<Vec4d> : HalfBlock<Vec4f> {
+	static Vec4d to_vec(Float f) { return to_double(f); }
+};
+
+template <> struct HalfBlock<Vec8f> {
+	typedef Vec8ui Bits;
+	typedef Vec8f Float;
+	static Bits load(const uint16_t *p) { return extend(Vec8us().load(p)); }
+	static Vec8f to_vec(Float f) { return f; }
+};
+
+template <> struct HalfBlock<Vec8d> : HalfBlock<Vec8f> {
+	static Vec8d to_vec(Float f) { return to_double(f); }
+};
+
+template <> struct HalfBlock<Vec16f> {
+	typedef Vec16ui Bits;
+	typedef Vec16f Float;
+	static Bits load(const uint16_t *p) { return extend(Vec16us().load(p)); }
+	static Vec16f to_vec(Float f) { return f; }
+};
+
+
+/**
+ * Conversion of the 16-bit values in the 32-bit lanes to floats by the integer operations.
+ * (VCL vectorfp16.h is not used, it defines non-inline functions, so it can not be included
+ * by several translation units.)
+ */
+template <class T> struct HalfConvert;
+
+template <> struct HalfConvert<_load_fp16_> {
+	template <class Bits, class Float>
+	static Float to_float(Bits h) {
+		// exponent and mantissa shifted to the float position and rebiased, Inf and NaN keep the maximal exponent,
+		// subnormals are normalized by the float subtraction
+		Bits o = (h & 0x7fff) << 13;
+		Bits e = o & 0x0f800000;
+		o += (127 - 15) << 23;
+		o = select(e == 0x0f800000, o + ((128 - 16) << 23), o);
+		Bits sub = reinterpret_i(reinterpret_f(o + (1 << 23)) - Float(6.103515625e-05f));
+		o = select(e == 0, sub, o);
+		return reinterpret_f(o | ((h & 0x8000) << 16));
+	}
+};
+
+template <> struct HalfConvert<_load_bf16_> {
+	template <class Bits, class Float>
+	static Float to_float(Bits h) {
+		return reinterpret_f(h << 16);
+	}
+};
+
+
+// Load of the 16-bit values of arg[1] (see Array::half_value) converted to VecType, T is _load_fp16_ or _load_bf16_.
+template <class T, typename VecType>
+struct HalfLoadEval {
+	inline static VecType load(const Vec<VecType> &v, uint i) {
+		typedef HalfBlock<VecType> H;
+		const uint16_t * p = (const uint16_t *)v.values + v.subset[i] * Vec<VecType>::n_lanes;
+		return H::to_vec(HalfConvert<T>::template to_float<typename H::Bits, typename H::Float>(H::load(p)));
+	}
+
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		Vec<VecType> v0 = w.vector[op.arg[0]];
+		Vec<VecType> v1 = w.vector[op.arg[1]];
+		for(uint i=0; i<w.subset_size; ++i)
+			load(v1, i).store(v0.value(i));
+	}
+};
+
+template <class T>
+struct HalfLoadEval<T, double> {
+	inline static double load(const Vec<double> &v, uint i) {
+		Vec4f f = HalfConvert<T>::template to_float<Vec4ui, Vec4f>(Vec4ui(((const uint16_t *)v.values)[v.subset[i]]));
+		return f[0];
+	}
+
+	inline static void eval(Operation op, Workspace<double> &w) {
+		Vec<double> v0 = w.vector[op.arg[0]];
+		Vec<double> v1 = w.vector[op.arg[1]];
+		for(uint i=0; i<w.subset_size; ++i)
+			*v0.value(i) = load(v1, i);
+	}
+};
+
+template <typename VecType>
+struct EvalImpl<2, _load_fp16_, VecType> : HalfLoadEval<_load_fp16_, VecType> {};
+
+template <typename VecType>
+struct EvalImpl<2, _load_bf16_, VecType> : HalfLoadEval<_load_bf16_, VecType> {};
+
+template <>
+struct EvalImpl<2, _load_fp16_, double> : HalfLoadEval<_load_fp16_, double> {};
+
+template <>
+struct EvalImpl<2, _load_bf16_, double> : HalfLoadEval<_load_bf16_, double> {};
+
+
+
+/**
+ * Piecewise linear interpolation of the block 'x' in the 'table'. The segment is found by the linear
+ * search for short tables, by the binary search with the gathers of the breakpoints otherwise,
+ * the segment data are gathered and the value is computed by a single FMA.
+ */
+static const uint interp_linear_search = 8;
+
+template <typename VecType, typename Scalar>
+inline VecType interp_block(VecType x, const InterpTable<Scalar> &t) {
+	typedef typename IndexType<VecType>::type IndexVec;
+	VecType xc = min(max(x, VecType(t.x_min)), VecType(t.x_max));
+	// segment index as floating point, exact for the table sizes
+	VecType k(0);
+	if (t.n_search <= interp_linear_search) {
+		for(uint j=1; j < t.n_search; ++j)
+			k = if_add(VecType(t.xp[j]) <= xc, k, 1);
+	} else {
+		for(uint step = t.n_search / 2; step > 0; step /= 2) {
+			VecType c = k + Scalar(step);
+			k = select(lookup<(1 << 30)>(truncatei(c), t.xp) <= xc, c, k);
+		}
+	}
+	IndexVec i = truncatei(k);
+	VecType x0 = lookup<(1 << 30)>(i, t.xp);
+	VecType f0 = lookup<(1 << 30)>(i, t.fp);
+	VecType s = lookup<(1 << 30)>(i, t.slope);
+	return mul_add(s, xc - x0, f0);
+}
+
+template <typename Scalar>
+inline Scalar interp_block(Scalar x, const InterpTable<Scalar> &t) {
+	Scalar xc = std::min(std::max(x, t.x_min), t.x_max);
+	uint k = std::upper_bound(t.xp + 1, t.xp + t.n_search, xc) - t.xp - 1;
+	return t.slope[k] * (xc - t.xp[k]) + t.fp[k];
+}
+
+// Interpolation of arg[1] in the table arg[2] of the workspace, see interp_block.
+template <typename VecType>
+struct InterpEval {
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		eval_variant<InterpEval, 1, 2>(op, w);
+	}
+
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w) {
+		Vec<VecType> v0 = w.vector[op.arg[0]];
+		Vec<VecType> v1 = w.vector[op.arg[1]];
+		const uint s0 = w.dense_step(v0);
+		const uint s1 = w.dense_step(v1);
+		const auto &table = w.interp_tables[op.arg[2]];
+		for(uint i=0; i<w.subset_size; ++i) {
+			VecType x = load_block<VecType>(dense ? v1.values + i * s1 : v1.value(i));
+			store_block<nt_store>(interp_block(x, table), dense ? v0.values + i * s0 : v0.value(i));
+		}
+	}
+};
+
+template <typename VecType>
+struct EvalImpl<2, _interp_, VecType> : public InterpEval<VecType> {};
+
+template <>
+struct EvalImpl<2, _interp_, double> : public InterpEval<double> {};
+
+
+// The scalar processor counterpart of the VCL mul_add.
+inline double mul_add(double a, double b, double c) {
+	return a * b + c;
+}
+
+/**
+ * Polynomial of the block 'x' by the Horner's scheme, a single FMA per coefficient.
+ */
+template <typename VecType, typename Scalar>
+inline VecType polyval_block(VecType x, const PolyTable<Scalar> &t) {
+	VecType r(t.c[0]);
+	for(uint k=1; k < t.n; ++k)
+		r = mul_add(r, x, VecType(t.c[k]));
+	return r;
+}
+
+// Polynomial arg[2] of the workspace at arg[1], see polyval_block. The Horner's scheme is a chain
+// of dependent FMAs, the unrolled blocks are interleaved to hide their latency.
+template <typename VecType>
+struct PolyvalEval {
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		eval_variant<PolyvalEval, 4, 2>(op, w);
+	}
+
+	template <uint n_unroll, bool nt_store = false, bool dense = false>
+	inline static void eval_blocks(Operation op, Workspace<VecType> &w) {
+		Vec<VecType> v0 = w.vector[op.arg[0]];
+		Vec<VecType> v1 = w.vector[op.arg[1]];
+		const uint s0 = w.dense_step(v0);
+		const uint s1 = w.dense_step(v1);
+		const auto &t = w.poly_tables[op.arg[2]];
+		uint i=0;
+		for(; i + n_unroll <= w.subset_size; i += n_unroll) {
+			VecType x[n_unroll], r[n_unroll];
+			for(uint k=0; k < n_unroll; ++k) {
+				x[k] = load_block<VecType>(dense ? v1.values + (i + k) * s1 : v1.value(i + k));
+				r[k] = VecType(t.c[0]);
+			}
+			for(uint j=1; j < t.n; ++j) {
+				VecType c(t.c[j]);
+				for(uint k=0; k < n_unroll; ++k)
+					r[k] = mul_add(r[k], x[k], c);
+			}
+			for(uint k=0; k < n_unroll; ++k)
+				store_block<nt_store>(r[k], dense ? v0.values + (i + k) * s0 : v0.value(i + k));
+		}
+		for(; i<w.subset_size; ++i) {
+			VecType x = load_block<VecType>(dense ? v1.values + i * s1 : v1.value(i));
+			store_block<nt_store>(polyval_block(x, t), dense ? v0.values + i * s0 : v0.value(i));
+		}
+	}
+};
+
+template <typename VecType>
+struct EvalImpl<2, _polyval_, VecType> : public PolyvalEval<VecType> {};
+
+template <>
+struct EvalImpl<2, _polyval_, double> : public PolyvalEval<double> {};
+
+
+/**
+ * Store of the packed bits of the block 'block' into the bit array 'out', the element 'k'
+ * of the vector is the bit k % 8 of the byte k / 8. Narrow blocks share the bytes.
+ */
+template <uint n_lanes, typename Bits>
+inline void store_bits(uint8_t *out, uint block, Bits bits) {
+	if (n_lanes >= 8) {
+		memcpy(out + block * (n_lanes / 8), &bits, n_lanes / 8);
+	} else {
+		uint shift = (block * n_lanes) % 8;
+		uint8_t mask = ((1u << n_lanes) - 1) << shift;
+		uint8_t &byte = out[block * n_lanes / 8];
+		byte = (byte & ~mask) | ((uint(bits) << shift) & mask);
+	}
+}
+
+// Boolean arg[1] written as the packed bits into the result arg[0], see _pack_.
+template <typename VecType>
+struct PackEval {
+	inline static void eval(Operation op, Workspace<VecType> &w) {
+		typedef typename MaskBits<VecType>::type Bits;
+		Vec<VecType> v0 = w.vector[op.arg[0]];
+		Vec<VecType> v1 = w.vector[op.arg[1]];
+		bool packed = w.is_packed(op.arg[1]);
+		uint8_t *out = (uint8_t *)v0.values;
+		for(uint i=0; i<w.subset_size; ++i) {
+			Bits bits = packed ? ((Bits *)v1.values)[i] : pack_block(load_block<VecType>(v1.value(i)));
+			store_bits<Vec<VecType>::n_lanes>(out, v0.subset[i], bits);
+		}
+	}
+};
+
+template <typename VecType>
+struct EvalImpl<2, _pack_, VecType> : public PackEval<VecType> {};
+
+template <>
+struct EvalImpl<2, _pack_, double> : public PackEval<double> {};
+
+
+/**
+ * Evaluation of the operation for the single block in the register file 'reg' (element-major order),
+ * 'reg[k]' holds the block of the workspace vector 'k', 'i' is the position of the block in the subset.
+ */
+template<uint NParams, class T, typename VecType>
+struct RegisterEval;
+
+template <class T, typename VecType>
+struct RegisterEval<1, T, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &, uint) {
+		T::eval(reg[op.arg[0]]);
+	}
+};
+
+template <class T, typename VecType>
+struct RegisterEval<2, T, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &, uint) {
+		T::eval(reg[op.arg[0]], reg[op.arg[1]]);
+	}
+};
+
+template <class T, typename VecType>
+struct RegisterEval<3, T, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &, uint) {
+		T::eval(reg[op.arg[0]], reg[op.arg[1]], reg[op.arg[2]]);
+	}
+};
+
+template <class T, typename VecType>
+struct RegisterEval<4, T, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &, uint) {
+		T::eval(reg[op.arg[0]], reg[op.arg[1]], reg[op.arg[2]], reg[op.arg[3]]);
+	}
+};
+
+// Strided values are read from the memory, see EvalImpl<2, _gather_, VecType>.
+template <typename VecType>
+struct RegisterEval<2, _gather_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint i) {
+		typedef typename IndexType<VecType>::type IndexVec;
+		Vec<VecType> v1 = w.vector[op.arg[1]];
+		uint stride = op.arg[2];
+		IndexVec index;
+		for(int k=0; k < VecType::size(); ++k) index.insert(k, k * stride);
+		reg[op.arg[0]] = lookup<(1 << 30)>(index, v1.values + v1.subset[i] * Vec<VecType>::n_lanes * stride);
+	}
+};
+
+template <typename VecType>
+struct RegisterEval<2, _load_fp16_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint i) {
+		reg[op.arg[0]] = HalfLoadEval<_load_fp16_, VecType>::load(w.vector[op.arg[1]], i);
+	}
+};
+
+template <typename VecType>
+struct RegisterEval<2, _load_bf16_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint i) {
+		reg[op.arg[0]] = HalfLoadEval<_load_bf16_, VecType>::load(w.vector[op.arg[1]], i);
+	}
+};
+
+template <typename VecType>
+struct RegisterEval<2, _interp_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint) {
+		reg[op.arg[0]] = interp_block(reg[op.arg[1]], w.interp_tables[op.arg[2]]);
+	}
+};
+
+template <typename VecType>
+struct RegisterEval<2, _polyval_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint) {
+		reg[op.arg[0]] = polyval_block(reg[op.arg[1]], w.poly_tables[op.arg[2]]);
+	}
+};
+
+template <typename VecType>
+struct RegisterEval<2, _pack_, VecType> {
+	inline static void eval(Operation op, VecType *reg, Workspace<VecType> &w, uint i) {
+		Vec<VecType> v0 = w.vector[op.arg[0]];
+		store_bits<Vec<VecType>::n_lanes>((uint8_t *)v0.values, v0.subset[i], pack_block(reg[op.arg[1]]));
+	}
+};
+
+template <>
+struct RegisterEval<2, _gather_, double> {
+	inline static void eval(Operation op, double *reg, Workspace<double> &w, uint i) {
+		Vec<double> v1 = w.vector[op.arg[1]];
+		reg[op.arg[0]] = v1.values[v1.subset[i] * op.arg[2]];
+	}
+};
+
 } // bparser namespace
@@ -12,6 +12,7 @@
 #include <vector>
 #include <cmath>
 #include <map>
+#include <set>
 #include "config.hh"
 #include "scalar_node.hh"
 #include "assert.hh"
@@ -47,6 +48,10 @@ private:
 	 * TODO: use to reorder nodes in the topological sort to minimize number of temporaries
 	 */
 	std::vector<uint> storage;
+	/// Storage of the boolean temporaries, separate as they are stored packed.
+	std::vector<uint> bool_storage;
+	/// Boolean temporary nodes used only as the boolean inputs, see is_bool_input.
+	std::set<ScalarNodePtr> bool_nodes;
 
 public:
 	/**
@@ -62,6 +67,9 @@ public:
 	uint values_copy_end;
 	/// End index of the temporary vectors in storage.
 	uint temp_end;
+	/// End index of the boolean temporaries following the temporaries, stored as the packed bits
+	/// by the vector processors (see Workspace::is_packed).
+	uint bool_temp_end;
 
 
 	ExpressionDAG(std::vector<ScalarNodePtr > res)
@@ -70,7 +78,8 @@ public:
 		constants_end(0),
 		values_end(0),
 		values_copy_end(0),
-		temp_end(0)
+		temp_end(0),
+		bool_temp_end(0)
 	{
 		sort_nodes();
 	}
@@ -94,8 +103,12 @@ public:
 		BP_ASSERT(sorted.size() == 0);
 		_topological_sort();
 
+		_mark_bool_nodes();
 		_setup_result_storage();
 		temp_end += storage.size();
+		// boolean temporaries were numbered from zero
+		for(ScalarNodePtr node : bool_nodes) node->result_idx_ += temp_end;
+		bool_temp_end = temp_end + bool_storage.size();
 		return sorted;
 	}
 
@@ -224,6 +237,20 @@ private:
 
 	}
 
+	/**
+	 * Collect the temporaries of the boolean operations used only as the boolean inputs
+	 * of the other operations, so that they need not be stored as the full masks.
+	 */
+	void _mark_bool_nodes() {
+		for(ScalarNodePtr node : nodes)
+			if (node->result_storage == temporary && is_bool_op(node->op_code_))
+				bool_nodes.insert(node);
+		for(ScalarNodePtr node : nodes)
+			for(uint in=0; in < node->n_inputs_; ++in)
+				if (! is_bool_input(node->op_code_, in))
+					bool_nodes.erase(node->inputs_[in]);
+	}
+
 	/**
 	 * Assign result_idx_ to the temporary nodes, reusing
 	 * storage positions.
@@ -262,6 +289,10 @@ private:
 	 *
 	 */
 	void _allocate_storage(ScalarNodePtr node) {
+		if (node->result_storage == temporary && bool_nodes.count(node)) {
+			node->result_idx_ = _allocate_slot(bool_storage);
+			return;
+		}
 		if (node->result_storage == temporary) {
 			for(uint i=0; i<storage.size(); ++i)
 				if (storage[i] == 0) {
@@ -276,8 +307,22 @@ private:
 	}
 
 
+	// Free position in the 'slots', added if there is none.
+	static uint _allocate_slot(std::vector<uint> &slots) {
+		for(uint i=0; i<slots.size(); ++i)
+			if (slots[i] == 0) {
+				slots[i] = 1;
+				return i;
+			}
+		slots.push_back(1);
+		return slots.size() - 1;
+	}
+
+
 	void _deallocate_storage(ScalarNodePtr node) {
-		if (node->result_storage == temporary) {
+		if (node->result_storage == temporary && bool_nodes.count(node)) {
+			bool_storage[node->result_idx_] = 0;
+		} else if (node->result_storage == temporary) {
 			storage[node->result_idx_ - temp_end] = 0;
 		}
 	}
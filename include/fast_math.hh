@@ -0,0 +1,233 @@
+/*
+ * fast_math.hh
+ *
+ * Reduced precision approximations of the elementary functions.
+ * Used by the vectorized processors instead of the VCL vectormath
+ * functions if the fast math option is set (ProcessorOptions::fast_math).
+ *
+ * Target accuracy is relative error about 1e-7, i.e. full single precision
+ * and about half of the double precision digits. Out of range arguments,
+ * infinities and NaNs are handled as in the exact functions, but the arguments
+ * of sin and cos are reduced in three steps only, so the error grows
+ * for |x| > 1e6.
+ *
+ * The scalar (non-vectorized) processor evaluates the exact functions
+ * even in the fast math mode, so it serves as the reference.
+ */
+
+#ifndef INCLUDE_FAST_MATH_HH_
+#define INCLUDE_FAST_MATH_HH_
+
+#include <cmath>
+#include <limits>
+#include <type_traits>
+#include "scalar_node.hh"
+
+namespace bparser {
+namespace details {
+
+
+/**
+ * exp(x) (M1 = false) or exp(x) - 1 (M1 = true),
+ * x = r*ln(2) + y, Taylor polynomial of degree 7 for |y| < ln(2)/2.
+ */
+template <typename VecType, bool M1>
+inline VecType fast_exp_m1(VecType x) {
+	typedef typename ScalarType<VecType>::type Scalar;
+	const double max_x = std::is_same<Scalar, float>::value ? 87.3 : 708.39;
+
+	VecType r = round(x * VM_LOG2E);
+	// ln(2) split into two parts, first with exact product r * ln2_hi
+	VecType y = nmul_add(r, 0.693145751953125, x);
+	y = nmul_add(r, 1.42860682030941723212E-6, y);
+	// exp(y) - 1
+	VecType z = y * polynomial_6(y, 1.0, 1./2., 1./6., 1./24., 1./120., 1./720., 1./5040.);
+	VecType n2 = vm_pow2n(r);
+	z = mul_add(z, n2, M1 ? n2 - 1.0 : n2);
+
+	auto in_range = abs(x) < max_x;
+	if (horizontal_and(in_range))
+		return z;
+	// overflow, underflow, NaN
+	z = select(in_range, z, select(x > 0, infinite_vec<VecType>(), VecType(M1 ? -1.0 : 0.0)));
+	return select(is_nan(x), x, z);
+}
+
+template <typename VecType>
+inline VecType fast_exp(VecType x) {
+	return fast_exp_m1<VecType, false>(x);
+}
+
+/**
+ * log(x), x = m * 2^e, sqrt(2)/2 < m < sqrt(2),
+ * log(m) = 2 atanh(t), t = (m-1)/(m+1), |t| < 0.172, series up to t^9.
+ */
+template <typename VecType>
+inline VecType fast_log(VecType x) {
+	typedef typename ScalarType<VecType>::type Scalar;
+	const Scalar smallest_normal = std::numeric_limits<Scalar>::min();
+
+	VecType m = fraction_2(x);		// [0.5, 1)
+	VecType e = exponent_f(x);
+	auto blend = m > VM_SQRT2 * 0.5;
+	m = if_add(!blend, m, m);
+	e = if_add(blend, e, 1.0);
+	m -= 1.0;
+	VecType t = m / (m + 2.0);
+	VecType t2 = t * t;
+	VecType z = polynomial_4(t2, 2.0, 2./3., 2./5., 2./7., 2./9.);
+	z = mul_add(t, z, e * VM_LN2);
+
+	auto in_range = (x >= smallest_normal) & is_finite(x);
+	if (horizontal_and(in_range))
+		return z;
+	// zero, negative, denormal, INF, NaN
+	z = select(x == 0.0, -infinite_vec<VecType>(), z);
+	z = select(x < 0.0, nan_vec<VecType>(), z);
+	z = select(x == infinite_vec<VecType>(), x, z);
+	z = select(is_nan(x), x, z);
+	// denormals, scaled to normal numbers
+	auto denormal = (x > 0.0) & (x < smallest_normal);
+	if (horizontal_or(denormal)) {
+		const int n = std::numeric_limits<Scalar>::digits;
+		z = select(denormal, fast_log(x * std::ldexp(1.0, n)) - n * VM_LN2, z);
+	}
+	return z;
+}
+
+/**
+ * pow(a, b) = exp(b * log(|a|)), with the sign for negative 'a' and odd integer 'b'.
+ * The relative error grows with |b * log(a)|, about 1e-7 for results up to 1e100.
+ */
+template <typename VecType>
+inline VecType fast_pow(VecType a, VecType b) {
+	VecType z = fast_exp(b * fast_log(abs(a)));
+	auto b_int = round(b) == b;
+	auto b_odd = (b * 0.5) != round(b * 0.5);
+	auto negative = a < 0.0;
+	z = select(negative & b_int & b_odd, -z, z);
+	z = select(negative & !b_int & is_finite(a), nan_vec<VecType>(), z);
+	return select(b == 0.0, VecType(1.0), z);
+}
+
+/**
+ * Common implementation of sin (COS = false) and cos (COS = true).
+ * |x| = q * pi/2 + r, |r| <= pi/4, Taylor polynomials of degree 9 (sin) and 10 (cos).
+ */
+template <typename VecType, bool COS>
+inline VecType fast_sin_cos(VecType x) {
+	typedef typename ScalarType<VecType>::type Scalar;
+	VecType xa = abs(x);
+	VecType q = round(xa * (2. / VM_PI));
+	// pi/2 split into three parts, the first two with exact products with q
+	VecType r;
+	if (std::is_same<Scalar, float>::value) {
+		r = nmul_add(q, 0.78515625 * 2., xa);
+		r = nmul_add(q, 2.4187564849853515625E-4 * 2., r);
+		r = nmul_add(q, 3.77489497744594108E-8 * 2., r);
+	} else {
+		r = nmul_add(q, 7.853981554508209228515625E-1 * 2., xa);
+		r = nmul_add(q, 7.94662735614792836714E-9 * 2., r);
+		r = nmul_add(q, 3.06161699786838294307E-17 * 2., r);
+	}
+	VecType r2 = r * r;
+	VecType s = mul_add(r * r2, polynomial_3(r2, -1./6., 1./120., -1./5040., 1./362880.), r);
+	VecType c = mul_add(r2 * r2, polynomial_3(r2, 1./24., -1./720., 1./40320., -1./3628800.),
+			nmul_add(r2, 0.5, 1.0));
+
+	// quadrant of x, cos(x) = sin(x + pi/2), qm = q mod 4 in {-2, -1, 0, 1, 2}
+	if (COS) q += 1.0;
+	VecType qm = nmul_add(round(q * 0.25), 4.0, q);
+	VecType z = select(abs(qm) == 1.0, c, s);
+	z = select((qm < 0.0) | (qm > 1.5), -z, z);
+	if (!COS) z = sign_combine(z, x);
+	return z;
+}
+
+template <typename VecType>
+inline VecType fast_sin(VecType x) {
+	return fast_sin_cos<VecType, false>(x);
+}
+
+template <typename VecType>
+inline VecType fast_cos(VecType x) {
+	return fast_sin_cos<VecType, true>(x);
+}
+
+/**
+ * tanh(x) = (exp(2x) - 1) / (exp(2x) + 1), using exp(2x) - 1 without cancellation for small x.
+ */
+template <typename VecType>
+inline VecType fast_tanh(VecType x) {
+	VecType xa = abs(x);
+	VecType em = fast_exp_m1<VecType, true>(xa + xa);
+	VecType z = select(xa > 20.0, VecType(1.0), em / (em + 2.0));
+	return sign_combine(z, x);
+}
+
+/***
+ * Fast variants of the operations. Scalar specializations evaluate exact functions.
+ */
+
+#define FAST_UNARY_FN(NAME, OP_CODE, FN, EXACT_FN)						\
+	struct NAME {														\
+		static const char op_code = OP_CODE;							\
+		static const char n_eval_args = 2;								\
+		template <typename VecType>										\
+		inline static void eval(VecType &res, VecType a) {				\
+			res = FN(a);												\
+		}																\
+	};																	\
+	template<>															\
+	inline void NAME::eval<double>(double &res, double a) {			\
+		res = EXACT_FN(a);												\
+	}
+
+FAST_UNARY_FN(_fast_exp_,	61, fast_exp, std::exp)
+FAST_UNARY_FN(_fast_log_,	62, fast_log, std::log)
+FAST_UNARY_FN(_fast_log10_,	63, VM_LOG10E * fast_log, std::log10)
+FAST_UNARY_FN(_fast_log2_,	64, VM_LOG2E * fast_log, std::log2)
+FAST_UNARY_FN(_fast_sin_,	65, fast_sin, std::sin)
+FAST_UNARY_FN(_fast_cos_,	66, fast_cos, std::cos)
+FAST_UNARY_FN(_fast_tanh_,	67, fast_tanh, std::tanh)
+
+struct _fast_pow_ {
+	static const char op_code = 68;
+	static const char n_eval_args = 3;
+	template <typename VecType>
+	inline static void eval(VecType &res, VecType a, VecType b) {
+		res = fast_pow(a, b);
+	}
+};
+template<>
+inline void _fast_pow_::eval<double>(double &res, double a, double b) {
+	res = std::pow(a, b);
+}
+
+
+/**
+ * Op code of the fast variant of the operation 'op_code', or 'op_code' itself
+ * if there is no fast variant. Single precision VCL sin and cos are faster
+ * than the fast variants, so these are not replaced in the 'single' precision.
+ */
+inline unsigned char fast_op_code(unsigned char op_code, bool single) {
+	if (single && (op_code == _sin_::op_code || op_code == _cos_::op_code))
+		return op_code;
+	switch (op_code) {
+	case _exp_::op_code:	return _fast_exp_::op_code;
+	case _log_::op_code:	return _fast_log_::op_code;
+	case _log10_::op_code:	return _fast_log10_::op_code;
+	case _log2_::op_code:	return _fast_log2_::op_code;
+	case _sin_::op_code:	return _fast_sin_::op_code;
+	case _cos_::op_code:	return _fast_cos_::op_code;
+	case _tanh_::op_code:	return _fast_tanh_::op_code;
+	case _pow_::op_code:	return _fast_pow_::op_code;
+	default:				return op_code;
+	}
+}
+
+
+} // namespace details
+} // namespace bparser
+
+#endif /* INCLUDE_FAST_MATH_HH_ */
@@ -178,8 +178,18 @@ struct grammar : qi::grammar<Iterator, ast::operand(), ascii::space_type> {
             FN("power"  , binary_array<_pow_>())
 			FN("minimum", binary_array<_min_>())
 			FN("maximum", binary_array<_max_>())
+			FN("interp", &Array::interp)
+			FN("polyval", &Array::polyval)
             ;
 
+        // functions registered by the user, see register_function
+        for(const details::NativeFunction &fn : details::native_functions()) {
+            if (func.find(fn.name) != nullptr)
+                Throw() << "Registered function '" << fn.name << "' collides with a built-in function.\n";
+            NamedArrayFn native_fn = {fn.name, NativeFn{fn.op_code, fn.n_args, fn.name.c_str()}};
+            func.add(fn.name, native_fn);
+        }
+
         unary_op.add
             FN("+", &unary_plus)
             FN("-", unary_array<_minus_>())
@@ -0,0 +1,142 @@
+/*
+ * native_function.hh
+ *
+ * Functions registered by the user with their own VCL kernels, callable from the expressions
+ * as the built-in functions (see register_function). Included by processor.hh after eval_impl.hh.
+ */
+
+#ifndef INCLUDE_NATIVE_FUNCTION_HH_
+#define INCLUDE_NATIVE_FUNCTION_HH_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include "config.hh"
+#include "assert.hh"
+#include "scalar_node.hh"
+
+namespace bparser {
+namespace details {
+
+
+/**
+ * Op codes of the registered functions follow the built-in operations (all below 128),
+ * 0xff is reserved for the nodes without operation.
+ */
+static const unsigned char native_op_code_base = 128;
+static const uint max_native_functions = 0xff - native_op_code_base;
+
+
+/**
+ * Registered function: name in the expressions, number of arguments, op code.
+ */
+struct NativeFunction {
+	std::string name;
+	uint n_args;
+	unsigned char op_code;
+};
+
+/// Registered functions, the deque keeps the names in place for ScalarNode::op_name_.
+inline std::deque<NativeFunction> &native_functions() {
+	static std::deque<NativeFunction> functions;
+	return functions;
+}
+
+inline const NativeFunction * find_native_function(const std::string &name) {
+	for(const NativeFunction &fn : native_functions())
+		if (fn.name == name) return &fn;
+	return nullptr;
+}
+
+
+/**
+ * Kernels of the registered function for the processor on VecType, indexed by
+ * 'op_code - native_op_code_base'. Op-major and element-major (see RegisterEval) variant.
+ */
+template <typename VecType>
+struct NativeKernel {
+	void (*eval)(Operation op, Workspace<VecType> &w);
+	void (*register_eval)(Operation op, VecType *reg, Workspace<VecType> &w, uint i);
+};
+
+template <typename VecType>
+inline std::vector<NativeKernel<VecType>> &native_kernels() {
+	static std::vector<NativeKernel<VecType>> kernels;
+	return kernels;
+}
+
+
+/**
+ * Operation of the function F for the EvalImpl and RegisterEval templates.
+ * The op code is not used for the dispatch, it only selects the default unroll_factor.
+ */
+template <class F>
+struct NativeOp {
+	static const char op_code = -1;
+	static const char n_eval_args = F::n_eval_args;
+
+	template <typename... VecTypes>
+	inline static void eval(VecTypes&... args) {
+		F::eval(args...);
+	}
+};
+
+template <class F, typename VecType>
+inline void add_native_kernel() {
+	typedef NativeOp<F> Op;
+	native_kernels<VecType>().push_back({
+		&EvalImpl<Op::n_eval_args, Op, VecType>::eval,
+		&RegisterEval<Op::n_eval_args, Op, VecType>::eval});
+}
+
+
+} // namespace details
+
+
+/**
+ * Register the function 'name' evaluated by the kernel F. The function can be called from the expressions
+ * parsed after the registration, it is evaluated elementwise with the broadcasting of its arguments,
+ * as the built-in functions.
+ *
+ * F has the same form as the built-in operations (see _atan2_ in scalar_node.hh):
+ *
+ *     struct Mooney {
+ *         static const char n_eval_args = 3;    // result and two arguments
+ *         template <typename VecType>
+ *         inline static void eval(VecType &res, VecType a, VecType b) {
+ *             res = 2.0 * a + b * b;
+ *         }
+ *     };
+ *
+ * The kernel is instantiated for all processors: double, Vec2d, Vec4d, Vec8d, Vec4f, Vec8f, Vec16f,
+ * the VCL functions like 'select' or 'max' need an overload for double. At most three arguments
+ * and 127 functions. Not thread safe, register the functions before parsing the expressions.
+ * Returns the op code of the function.
+ */
+template <class F>
+unsigned char register_function(const std::string &name) {
+	using namespace details;
+	uint n_args = F::n_eval_args - 1;
+	if (n_args < 1 || n_args > 3)
+		Throw() << "Function '" << name << "' has " << n_args << " arguments, supported 1 to 3.\n";
+	if (find_native_function(name) != nullptr)
+		Throw() << "Function '" << name << "' is already registered.\n";
+	if (native_functions().size() >= max_native_functions)
+		Throw() << "Too many registered functions, at most " << max_native_functions << ".\n";
+
+	unsigned char op_code = native_op_code_base + native_functions().size();
+	native_functions().push_back({name, n_args, op_code});
+	add_native_kernel<F, double>();
+	add_native_kernel<F, Vec2d>();
+	add_native_kernel<F, Vec4d>();
+	add_native_kernel<F, Vec8d>();
+	add_native_kernel<F, Vec4f>();
+	add_native_kernel<F, Vec8f>();
+	add_native_kernel<F, Vec16f>();
+	return op_code;
+}
+
+
+} // namespace bparser
+
+#endif /* INCLUDE_NATIVE_FUNCTION_HH_ */
@@ -14,11 +14,16 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include <chrono>
+#include <sstream>
 #include "array.hh"
 #include "ast.hh"
 #include "processor.hh"
 #include "grammar.hh"
 #include "create_processor.hh"
+#include "cost_model.hh"
+#include "tuner.hh"
+#include "polynomial.hh"
 
 namespace bparser {
 
@@ -41,23 +46,105 @@ namespace bparser {
 
 
 
+/**
+ * Memory layout of the variable values. Value of the element 'i' of the array component 'k'
+ * (flat index in the variable shape) is at variable_space[i * elem_stride + k * comp_stride].
+ * The default (component-major) layout is {1, max_vec_size}, interleaved (AoS) 3d vectors
+ * have layout {3, 1}. Element stride is limited to _gather_::max_stride.
+ */
+struct Layout {
+	uint elem_stride;
+	uint comp_stride;
+};
+
+
+/**
+ * Statistics of the last Parser::compile().
+ */
+struct CompileStats {
+	/// Number of the scalar nodes of the expression DAG by the operation name.
+	std::map<std::string, uint> n_nodes;
+	uint n_nodes_total = 0;
+
+	/// Number of the workspace slots by the storage class, values include the results.
+	uint n_constants = 0;
+	uint n_values = 0;
+	uint n_value_copies = 0;
+	uint n_temporaries = 0;
+
+	/// Number of the processor operations.
+	uint program_length = 0;
+
+	/// Arena bytes used by the processor and its estimate.
+	std::size_t arena_used = 0;
+	std::size_t arena_estimate = 0;
+
+	/// Phase times in seconds: parse, expansion to the scalar nodes (make_array),
+	/// topological sort with the slot assignment, processor setup.
+	double parse_time = 0;
+	double make_array_time = 0;
+	double sort_time = 0;
+	double processor_time = 0;
+	/// Time of the strategy tuning, zero without tuning or with the decision from the calibration file.
+	double tuning_time = 0;
+
+	std::string print() const {
+		std::stringstream ss;
+		ss << "nodes: " << n_nodes_total << " (";
+		for(auto it = n_nodes.begin(); it != n_nodes.end(); ++it)
+			ss << (it == n_nodes.begin() ? "" : ", ") << it->first << ": " << it->second;
+		ss << ")\n";
+		ss << "slots: constants: " << n_constants << ", values: " << n_values
+		   << ", value copies: " << n_value_copies << ", temporaries: " << n_temporaries << "\n";
+		ss << "program length: " << program_length << "\n";
+		ss << "arena used: " << arena_used << " B, estimate: " << arena_estimate << " B\n";
+		ss << "time [ms]: parse: " << 1e3 * parse_time << ", make_array: " << 1e3 * make_array_time
+		   << ", sort: " << 1e3 * sort_time << ", processor: " << 1e3 * processor_time
+		   << ", tuning: " << 1e3 * tuning_time << "\n";
+		return ss.str();
+	}
+};
+
+
 class Parser {
 
 protected:
 	ast::operand ast;
 	uint max_vec_size;
     uint simd_size;
+    ProcessorOptions options_;
 	std::map<std::string, Array> symbols_;
 	Array result_array_;
 	ProcessorBase * processor;
+	/// Storage of the result if not set by the '_result_' variable, floats in the case of single precision.
 	std::vector<double> tmp_result;
+	/// Scalar nodes of all arrays of the parser (symbols and expression).
+	std::unique_ptr<details::NodePool> node_pool_;
+	/// Arena of the last processor created by the parser itself, reused by the next compile.
+	std::shared_ptr<ArenaAlloc> own_arena_;
+	CompileStats compile_stats_;
+	CostModel cost_model_;
+	/// Strategy tuning at compile(), see set_tuning.
+	bool tuning_;
+	std::string calibration_file_;
+	/// Options of the last compiled processor, including the tuned ones.
+	ProcessorOptions compiled_options_;
+	/// Replace the polynomials in the expression by the _polyval_ nodes, see set_fuse_polynomials.
+	bool fuse_polynomials_;
+	/// Pairs of the symbol and the variable of the derivative, see set_derivative.
+	std::vector<std::pair<std::string, std::string>> derivatives_;
+	/// Bits of the boolean result, see set_packed_result.
+	uint8_t *packed_result_;
 
 public:
     /** @brief Constructor
-     * max_vec_size - size of single array component in doubles
+     * max_vec_size - size of single array component in values
+     * precision - type of values of variables and results, double or float
      */
-    Parser(uint max_vec_size)
-	: max_vec_size(max_vec_size), simd_size(0), processor(nullptr), tmp_result()
+    Parser(uint max_vec_size, Precision precision = double_precision)
+	: max_vec_size(max_vec_size), simd_size(0), options_(precision), processor(nullptr), tmp_result(),
+	  node_pool_(new details::NodePool()), tuning_(false), compiled_options_(precision), fuse_polynomials_(true),
+	  packed_result_(nullptr)
 	{}
 
     /// @brief Destructor
@@ -78,7 +165,10 @@ public:
     ///
     /// @param[in] expr The expression given as a std::string
     void parse(std::string const &expr) {
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	auto start_time = std::chrono::high_resolution_clock::now();
     	parse_expr(expr, ast);
+    	compile_stats_.parse_time = seconds_since(start_time);
 
         //std::cout << "Parsing OK. : " << "\n";
         //std::cout << ast::print(ast) << "\n";
@@ -142,9 +232,51 @@ public:
      *
      */
     void set_variable(std::string name, std::vector<uint> shape, double *variable_space) {
+    	check_precision(double_precision, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
     	symbols_[name] = Array::value(variable_space, max_vec_size, shape);
     }
 
+    /// Single precision variant of the set_variable.
+    void set_variable(std::string name, std::vector<uint> shape, float *variable_space) {
+    	check_precision(single_precision, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	symbols_[name] = Array::value(variable_space, max_vec_size, shape);
+    }
+
+    /**
+     * Set variable with values in the given 'layout', e.g. interleaved components.
+     * Strided values are gathered into the SIMD blocks by the processor,
+     * the result variable must have the default layout.
+     */
+    void set_variable(std::string name, std::vector<uint> shape, double *variable_space, Layout layout) {
+    	check_precision(double_precision, name);
+    	check_layout(layout, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	symbols_[name] = Array::value(variable_space, layout.comp_stride, shape, layout.elem_stride);
+    }
+
+    /// Single precision variant of the set_variable with given layout.
+    void set_variable(std::string name, std::vector<uint> shape, float *variable_space, Layout layout) {
+    	check_precision(single_precision, name);
+    	check_layout(layout, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	symbols_[name] = Array::value(variable_space, layout.comp_stride, shape, layout.elem_stride);
+    }
+
+    /**
+     * Half precision variant of the set_variable: 16-bit values in the given 'format' (fp16 or bf16),
+     * default layout, for both precisions of the parser. The values are converted in the registers
+     * as they are loaded, so the variable is read with a quarter (double) or a half (single precision)
+     * of the bytes. The result variable can not be in the half precision.
+     */
+    void set_variable(std::string name, std::vector<uint> shape, uint16_t *variable_space, HalfFormat format) {
+    	if (name == "_result_")
+    		Throw() << "Half precision result variable is not supported.\n";
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	symbols_[name] = Array::half_value(variable_space, max_vec_size, shape, format);
+    }
+
     /**
      * Set given name to be a variable of given shape with values at
      * given address 'variable_space'.
@@ -153,44 +285,291 @@ public:
      *
      */
     void set_var_copy(std::string name, std::vector<uint> shape, double *variable_space) {
+    	check_precision(double_precision, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
     	symbols_[name] = Array::value_copy(variable_space, max_vec_size, shape);
     }
 
+    /// Single precision variant of the set_var_copy.
+    void set_var_copy(std::string name, std::vector<uint> shape, float *variable_space) {
+    	check_precision(single_precision, name);
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	symbols_[name] = Array::value_copy(variable_space, max_vec_size, shape);
+    }
+
+    Precision precision() const {
+    	return options_.precision;
+    }
+
+    /**
+     * Use approximations of exp, log, pow, sin, cos and tanh with relative error
+     * about 1e-7 (see fast_math.hh). Applied by the next compile().
+     */
+    void set_fast_math(bool fast_math) {
+    	options_.fast_math = fast_math;
+    }
+
+    /**
+     * Write large results by the non-temporal stores bypassing the cache
+     * (see ProcessorOptions::nt_stores). Applied by the next compile().
+     */
+    void set_nt_stores(bool nt_stores) {
+    	options_.nt_stores = nt_stores;
+    }
+
+    /**
+     * Limit the temporaries to 'n_blocks' SIMD blocks, e.g. the largest subset actually used,
+     * larger subsets are evaluated in several passes (see ProcessorOptions::max_temp_blocks).
+     * Zero for temporaries of the full vector. Applied by the next compile().
+     */
+    void set_max_temp_blocks(uint n_blocks) {
+    	options_.max_temp_blocks = n_blocks;
+    }
+
+    /**
+     * Evaluation of the subsets: through the subset indices, by the gather of the variables
+     * into dense buffers, or selected by the subset density and the program (default).
+     * See SubsetMode. Applied by the next compile().
+     */
+    void set_subset_mode(SubsetMode mode) {
+    	options_.subset_mode = mode;
+    }
+
+    /**
+     * Evaluation order: every operation over the whole subset (op_major) or the whole program
+     * for every SIMD block (element_major), selected by the vector size (default).
+     * See ProgramOrder. Applied by the next compile().
+     */
+    void set_program_order(ProgramOrder order) {
+    	options_.program_order = order;
+    }
+
+    /**
+     * Select the program order and the capacity of the temporaries at compile() by timing
+     * the candidate strategies over the full vector (see tuner.hh). The program is run over
+     * the current variables, the result is overwritten. If 'calibration_file' is given, the decisions
+     * are read from it and the new ones appended, keyed by the CPU model and the expression hash.
+     * Applied by the next compile().
+     */
+    void set_tuning(bool tuning, std::string calibration_file = "") {
+    	tuning_ = tuning;
+    	calibration_file_ = calibration_file;
+    }
+
+    /**
+     * Evaluate the polynomials of a single subexpression with the constant coefficients written
+     * in the expression, e.g. '1 + 2 * x + 3 * x**2' or '(x - 1) * (x + 1)', by the Horner's scheme
+     * as 'polyval' (default). The result can differ by rounding, as after reassociation. Applied by the next compile().
+     */
+    void set_fuse_polynomials(bool fuse) {
+    	fuse_polynomials_ = fuse;
+    }
+
+    /**
+     * Compute also the derivatives of the result with respect to the symbol 'symbol' (a variable or a constant)
+     * into the variable 'variable' of the shape: result shape + symbol shape, e.g. the Jacobian
+     * d result[i] / d symbol[j] at [i, j]. The variable has to be set as the other variables (set_variable).
+     * The values and all derivatives are evaluated by the single processor in the single pass,
+     * sharing the subexpressions (forward mode, see derivative.hh). The derivatives of the piecewise
+     * operations (abs, min, max, ifelse, comparisons) are taken from the selected branch, interp and
+     * the registered functions are not supported. Applied by the next compile().
+     */
+    void set_derivative(std::string symbol, std::string variable) {
+    	derivatives_.push_back({symbol, variable});
+    }
+
+    /**
+     * Store the boolean temporaries as a bit per element instead of the full masks
+     * (see ProcessorOptions::packed_masks, default). Applied by the next compile().
+     */
+    void set_packed_masks(bool packed) {
+    	options_.packed_masks = packed;
+    }
+
+    /**
+     * Write the boolean result (comparisons, logical operations) as the packed bits into 'bits'
+     * instead of the '_result_' variable: the element 'k' of the component 'i' is the bit k % 8
+     * of the byte 'bits[i * packed_result_bytes() + k / 8]'. Null for the default result.
+     * Applied by the next compile().
+     */
+    void set_packed_result(uint8_t *bits) {
+    	packed_result_ = bits;
+    }
+
+    /// Bytes of the single component of the packed result.
+    uint packed_result_bytes() const {
+    	return (max_vec_size + 7) / 8;
+    }
+
+    /// Remove all derivatives given by set_derivative.
+    void clear_derivatives() {
+    	derivatives_.clear();
+    }
+
+    /// Options of the last compiled processor, with the tuned program order and temporaries capacity.
+    const ProcessorOptions &compiled_options() const {
+    	return compiled_options_;
+    }
+
     /**
      * Set given name to be a constant of given shape with flatten values
      * given by the 'const_value' vector.
      *
      */
     void set_constant(std::string name, std::vector<uint> shape, std::vector<double> const_value) {
+    	details::NodePool::Scope pool_scope(*node_pool_);
     	symbols_[name] = Array::constant(const_value, shape);
     }
 
     /// @brief Create processor of the expression from the AST.
     ///
     /// All variable names have to be set before this call.
+    /// The processor is allocated in the given 'arena', or in an arena owned by the parser,
+    /// that is reset and reused by the subsequent compilations.
     /// TODO: set result variable
     void compile(std::shared_ptr<ArenaAlloc> arena = nullptr) {
     	destroy_processor();
+    	details::NodePool::Scope pool_scope(*node_pool_);
+    	if (arena == nullptr && own_arena_ != nullptr) {
+    		own_arena_->reset();
+    		arena = own_arena_;
+    	}
+
+    	double parse_time = compile_stats_.parse_time;
+    	compile_stats_ = CompileStats();
+    	compile_stats_.parse_time = parse_time;
+    	auto start_time = std::chrono::high_resolution_clock::now();
 
         ParserResult res_array = boost::apply_visitor(ast::make_array(symbols_), ast);
 
         Array array = get_array(res_array);
+        std::vector<Array> derivatives = make_derivatives(array);
 		Shape result_shape = array.shape();
 		auto res_it = symbols_.find("_result_");
-		if (res_it == symbols_.end()) {
+		if (packed_result_ != nullptr) {
+			result_array_ = array.make_packed_result(packed_result_, packed_result_bytes());
+		} else if (res_it == symbols_.end()) {
 			// TODO: replace by storing result in the temporary variable of the processor
 			// tmp_result = new double[shape_size(result_shape) * max_vec_size];
-			tmp_result.resize(shape_size(result_shape) * max_vec_size);
-			result_array_ = Array::value(&tmp_result[0], max_vec_size, result_shape);
+			uint n_values = shape_size(result_shape) * max_vec_size;
+			if (options_.precision == single_precision) {
+				tmp_result.resize((n_values + 1) / 2);
+				result_array_ = Array::value((float *)&tmp_result[0], max_vec_size, result_shape);
+			} else {
+				tmp_result.resize(n_values);
+				result_array_ = Array::value(&tmp_result[0], max_vec_size, result_shape);
+			}
 			result_array_ = array.make_result(result_array_);
 		} else {
 			result_array_ = array.make_result(res_it->second);
 		}
+		std::vector<ScalarNodePtr> results = result_array_.elements();
+		for(uint i=0; i < derivatives.size(); ++i) {
+			Array d_result = derivatives[i].make_result(symbols_.at(derivatives_[i].second));
+			results.insert(results.end(), d_result.elements().begin(), d_result.elements().end());
+		}
+		if (fuse_polynomials_)
+			details::PolynomialFuser().fuse(results);
+
+		compile_stats_.make_array_time = seconds_since(start_time);
 
-		details::ExpressionDAG se(result_array_.elements());
+		start_time = std::chrono::high_resolution_clock::now();
+		details::ExpressionDAG se(results);
+		compile_stats_.sort_time = seconds_since(start_time);
 
 		//se.print_in_dot();
-		processor = ProcessorBase::create_processor(se, max_vec_size, simd_size, arena);
+		start_time = std::chrono::high_resolution_clock::now();
+		compiled_options_ = tuning_ ? tuned_options(se) : options_;
+		start_time = std::chrono::high_resolution_clock::now();
+		std::size_t arena_used_before = (arena == nullptr) ? 0 : arena->used();
+		bool reuse_arena = (arena == nullptr || arena == own_arena_);
+		processor = ProcessorBase::create_processor(se, max_vec_size, simd_size, arena, compiled_options_);
+		if (reuse_arena)
+			own_arena_ = processor->get_arena();
+		compile_stats_.processor_time = seconds_since(start_time);
+
+		for(ScalarNodePtr node : se.sort_nodes())
+			compile_stats_.n_nodes[node->op_name_]++;
+		compile_stats_.n_nodes_total = se.sort_nodes().size();
+		compile_stats_.n_constants = se.constants_end;
+		compile_stats_.n_values = se.values_end - se.constants_end;
+		compile_stats_.n_value_copies = se.values_copy_end - se.values_end;
+		compile_stats_.n_temporaries = se.bool_temp_end - se.values_copy_end;
+		compile_stats_.program_length = processor->program_length();
+		compile_stats_.arena_used = processor->get_arena()->used() - arena_used_before;
+		compile_stats_.arena_estimate = processor->arena_estimate_;
+
+		uint scalar_size = (options_.precision == single_precision) ? sizeof(float) : sizeof(double);
+		cost_model_ = bparser::cost_model(se, scalar_size, options_.fast_math);
+    }
+
+    /**
+     * Derivatives of the expression 'array' given by set_derivative. The elements shared with
+     * the expression are copied, 'array' is updated.
+     */
+    std::vector<Array> make_derivatives(Array &array) {
+    	std::vector<Array> arrays = {array};
+    	for(const auto &d : derivatives_) {
+    		auto symbol_it = symbols_.find(d.first);
+    		if (symbol_it == symbols_.end())
+    			Throw() << "Undefined symbol '" << d.first << "' of the derivative.\n";
+    		auto variable_it = symbols_.find(d.second);
+    		if (variable_it == symbols_.end())
+    			Throw() << "Undefined variable '" << d.second << "' for the derivative with respect to '" << d.first << "'.\n";
+    		Array d_array = Array::derivative(array, symbol_it->second);
+    		if (d_array.shape() != variable_it->second.shape())
+    			Throw() << "Derivative with respect to '" << d.first << "' has shape " << print_shape(d_array.shape())
+    					<< ", variable '" << d.second << "' has shape " << print_shape(variable_it->second.shape()) << ".\n";
+    		arrays.push_back(d_array);
+    	}
+    	if (arrays.size() > 1) Array::separate_results(arrays);
+    	array = arrays[0];
+    	return std::vector<Array>(arrays.begin() + 1, arrays.end());
+    }
+
+    /// Options given by the calibration file or by the tuning, see set_tuning.
+    ProcessorOptions tuned_options(details::ExpressionDAG &se) {
+    	ProcessorOptions options = options_;
+    	uint64_t cpu_hash = hash_string(cpu_model());
+    	uint64_t expr_hash = expression_hash(se, max_vec_size, simd_block_size(), options_);
+    	if (! calibration_file_.empty() && CalibrationFile(calibration_file_).find(cpu_hash, expr_hash, options))
+    		return options;
+
+    	auto start_time = std::chrono::high_resolution_clock::now();
+    	double time;
+    	options = tune(se, max_vec_size, simd_size, max_vec_size / simd_block_size(), options_, time);
+    	compile_stats_.tuning_time = seconds_since(start_time);
+    	if (! calibration_file_.empty())
+    		CalibrationFile(calibration_file_).add(cpu_hash, expr_hash, options, time);
+    	return options;
+    }
+
+    /// Static cost model of the last compiled expression, see cost_model.hh.
+    const CostModel &cost_model() const {
+    	return cost_model_;
+    }
+
+    /**
+     * Run the processor 'n_repeats' times over the current subset and compare the achieved
+     * flops and bandwidth with the cost model and the 'machine' peaks (e.g. MachineModel::measure()).
+     */
+    RooflineReport roofline(uint n_repeats, const MachineModel &machine) {
+    	BP_ASSERT(processor != nullptr);
+    	BP_ASSERT(n_repeats > 0);
+    	processor->run();
+    	auto start_time = std::chrono::high_resolution_clock::now();
+    	for(uint i=0; i < n_repeats; ++i) processor->run();
+    	RooflineReport report;
+    	report.model = cost_model_;
+    	report.machine = machine;
+    	report.time = seconds_since(start_time) / n_repeats;
+    	report.n_elements = double(processor->subset_size()) * simd_block_size();
+    	return report;
+    }
+
+    /// Statistics of the last compile(), parse_time is of the last parse().
+    const CompileStats &compile_stats() const {
+    	return compile_stats_;
     }
 
     Array result_array() {
@@ -198,9 +577,20 @@ public:
     }
 
     double * tmp_result_ptr() {
+    	BP_ASSERT(options_.precision == double_precision);
     	return &tmp_result[0];
     }
 
+    float * tmp_result_float_ptr() {
+    	BP_ASSERT(options_.precision == single_precision);
+    	return (float *)&tmp_result[0];
+    }
+
+    /// Number of values in the SIMD block, the subset indices are in these blocks.
+    uint simd_block_size() const {
+    	return get_simd_size(simd_size, options_.precision);
+    }
+
     /// @brief Set new subset of the 'max_vec_size' vectors.
     /// Only this subset is evuluated by the processor.
     void set_subset(std::vector<uint> const &subset) {
@@ -208,10 +598,63 @@ public:
     	processor->set_subset(subset);
     }
 
+    /// @brief Set new subset given by the caller owned array of 'subset_size' block indices.
+    /// The indices are not copied, the array must be valid until the last run() with this subset.
+    void set_subset(const uint *subset, uint subset_size) {
+    	BP_ASSERT(processor != nullptr);
+    	processor->set_subset(subset, subset_size);
+    }
+
+    /// Processor owned buffer for the subset block indices (max_vec_size / simd_block_size() items),
+    /// to be filled in place and activated by set_subset(subset_buffer(), subset_size).
+    /// Valid until the next compile().
+    uint * subset_buffer() {
+    	BP_ASSERT(processor != nullptr);
+    	return processor->subset_buffer();
+    }
+
     void run() {
     	processor->run();
     }
 
+    /// Call counts and cycles of the program operations accumulated over the run() calls,
+    /// empty unless compiled with BP_PROFILE (see config.hh).
+    std::vector<OpProfile> profile() const {
+    	BP_ASSERT(processor != nullptr);
+    	return processor->profile();
+    }
+
+    void reset_profile() {
+    	BP_ASSERT(processor != nullptr);
+    	processor->reset_profile();
+    }
+
+    /// Program listing annotated by the profile().
+    std::string profile_listing() const {
+    	return bparser::profile_listing(profile());
+    }
+
+private:
+    static double seconds_since(std::chrono::high_resolution_clock::time_point start) {
+    	return std::chrono::duration_cast<std::chrono::duration<double>>(
+    			std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    void check_layout(Layout layout, const std::string &name) {
+    	if (layout.elem_stride == 0 || layout.elem_stride > details::_gather_::max_stride)
+    		Throw() << "Element stride " << layout.elem_stride << " of the variable '" << name
+				<< "' out of range [1, " << details::_gather_::max_stride << "].\n";
+    	if (name == "_result_" && layout.elem_stride != 1)
+    		Throw() << "Strided layout of the result variable is not supported.\n";
+    }
+
+    void check_precision(Precision var_precision, const std::string &name) {
+    	if (var_precision != options_.precision)
+    		Throw() << "Variable '" << name << "' of "
+				<< (var_precision == single_precision ? "single" : "double")
+				<< " precision passed to the parser of different precision.\n";
+    }
+
 
 };
 
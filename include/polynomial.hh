@@ -0,0 +1,168 @@
+/*
+ * polynomial.hh
+ *
+ * Recognition of the polynomials written by the user, e.g. 'c0 + c1 * x + c2 * x**2',
+ * in the scalar nodes of the expression. The polynomial subexpressions of a single node 'x'
+ * with constant coefficients are replaced by the _polyval_ nodes (see Parser::set_fuse_polynomials),
+ * so that they are evaluated by the Horner's scheme in a single operation.
+ */
+
+#ifndef INCLUDE_POLYNOMIAL_HH_
+#define INCLUDE_POLYNOMIAL_HH_
+
+#include <vector>
+#include <map>
+#include <set>
+#include <cmath>
+#include "config.hh"
+#include "scalar_node.hh"
+
+namespace bparser {
+namespace details {
+
+
+/**
+ * Polynomial in the node 'x' with the coefficients 'c', lowest power first.
+ * 'x' is null for the constant polynomial.
+ */
+struct Polynomial {
+	ScalarNodePtr x = nullptr;
+	std::vector<double> c;
+
+	uint degree() const {
+		return c.size() - 1;
+	}
+};
+
+
+class PolynomialFuser {
+public:
+	static constexpr uint max_degree = _polyval_::max_coeffs - 1;
+
+	/**
+	 * Replace the largest polynomial subexpressions of at least the second degree
+	 * reachable from the 'results' by the _polyval_ nodes. The nodes are changed in place,
+	 * as the polynomial has the same value, so the other users of the node are not affected.
+	 */
+	void fuse(const std::vector<ScalarNodePtr> &results) {
+		for(ScalarNodePtr node : results)
+			fuse_node(node);
+	}
+
+private:
+	void fuse_node(ScalarNodePtr node) {
+		if (! visited_.insert(node).second) return;
+		if (is_arithmetic(node)) {
+			Polynomial p = polynomial(node);
+			if (p.x != nullptr && p.degree() >= 2) {
+				std::vector<double> coeffs(p.c.rbegin(), p.c.rend());
+				node->op_code_ = _polyval_::op_code;
+				node->op_name_ = op_name<_polyval_>();
+				node->n_inputs_ = 0;
+				node->add_input(p.x);
+				node->table_ = NodePool::current().create_table(coeffs);
+				node->table_size_ = coeffs.size();
+			}
+		}
+		for(uint i=0; i < node->n_inputs_; ++i)
+			fuse_node(node->inputs_[i]);
+	}
+
+	static bool is_arithmetic(ScalarNodePtr node) {
+		if (node->result_storage != temporary && node->result_storage != expr_result) return false;
+		switch (node->op_code_) {
+		case _minus_::op_code:
+		case _add_::op_code:
+		case _sub_::op_code:
+		case _mul_::op_code:
+		case _div_::op_code:
+		case _pow_::op_code:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static bool constant_value(ScalarNodePtr node, double &value) {
+		if (node->result_storage != constant) return false;
+		value = node->value_;
+		return true;
+	}
+
+	/// Polynomial of the node, the node itself as the variable if it is not a polynomial.
+	const Polynomial &polynomial(ScalarNodePtr node) {
+		auto it = polynomials_.find(node);
+		if (it != polynomials_.end()) return it->second;
+
+		Polynomial p;
+		double value;
+		if (constant_value(node, value)) {
+			p.c = {value};
+		} else if (! is_arithmetic(node) || ! combine(node, p)) {
+			p.x = node;
+			p.c = {0.0, 1.0};
+		}
+		while (p.c.size() > 1 && p.c.back() == 0.0) p.c.pop_back();
+		return polynomials_[node] = p;
+	}
+
+	/// Polynomial 'p' of the arithmetic node from the polynomials of its inputs, false if it is not a polynomial.
+	bool combine(ScalarNodePtr node, Polynomial &p) {
+		const Polynomial &a = polynomial(node->inputs_[0]);
+		if (node->op_code_ == _minus_::op_code) {
+			p = a;
+			for(double &c : p.c) c = -c;
+			return true;
+		}
+		const Polynomial &b = polynomial(node->inputs_[1]);
+		if (a.x != nullptr && b.x != nullptr && a.x != b.x) return false;
+		p.x = (a.x != nullptr) ? a.x : b.x;
+		switch (node->op_code_) {
+		case _add_::op_code:
+		case _sub_::op_code: {
+			double sign = (node->op_code_ == _add_::op_code) ? 1.0 : -1.0;
+			p.c.assign(std::max(a.c.size(), b.c.size()), 0.0);
+			for(uint k=0; k < a.c.size(); ++k) p.c[k] += a.c[k];
+			for(uint k=0; k < b.c.size(); ++k) p.c[k] += sign * b.c[k];
+			return true;
+		}
+		case _mul_::op_code:
+			if (a.degree() + b.degree() > max_degree) return false;
+			p.c = multiply(a.c, b.c);
+			return true;
+		case _div_::op_code:
+			if (b.x != nullptr || b.c[0] == 0.0) return false;
+			p.c = a.c;
+			for(double &c : p.c) c /= b.c[0];
+			return true;
+		case _pow_::op_code: {
+			// small natural exponents
+			double e = b.c[0];
+			if (b.x != nullptr || e != std::floor(e) || e < 0 || e > max_degree || a.degree() * e > max_degree)
+				return false;
+			p.c = {1.0};
+			for(uint k=0; k < uint(e); ++k) p.c = multiply(p.c, a.c);
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	static std::vector<double> multiply(const std::vector<double> &a, const std::vector<double> &b) {
+		std::vector<double> c(a.size() + b.size() - 1, 0.0);
+		for(uint i=0; i < a.size(); ++i)
+			for(uint j=0; j < b.size(); ++j)
+				c[i + j] += a[i] * b[j];
+		return c;
+	}
+
+	std::map<ScalarNodePtr, Polynomial> polynomials_;
+	std::set<ScalarNodePtr> visited_;
+};
+
+
+} // namespace details
+} // namespace bparser
+
+#endif /* INCLUDE_POLYNOMIAL_HH_ */
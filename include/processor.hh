@@ -12,12 +12,26 @@
 #include <malloc.h>
 #include <string.h>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <utility>
+#ifdef BP_PROFILE
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 #include "config.hh"
 #include "assert.hh"
 #include "arena_alloc.hh"
 #include "expression_dag.hh"
 #include "scalar_node.hh"
+#include "fast_math.hh"
 #include "eval_impl.hh"
+#include "native_function.hh"
 
 namespace bparser {
 using namespace details;
@@ -129,11 +143,194 @@ using namespace details;
 typedef std::shared_ptr<ArenaAlloc> ArenaAllocPtr;
 
 
+// All operations of the processor program, CASE(OP_NAME) is the switch case of the operation.
+#define OPERATION_CASES(CASE) \
+	CASE(_minus_); \
+	CASE(_add_); \
+	CASE(_sub_); \
+	CASE(_mul_); \
+	CASE(_div_); \
+	CASE(_mod_); \
+	CASE(_eq_); \
+	CASE(_ne_); \
+	CASE(_lt_); \
+	CASE(_le_); \
+	CASE(_neg_); \
+	CASE(_or_); \
+	CASE(_and_); \
+	CASE(_abs_); \
+	CASE(_sqrt_); \
+	CASE(_exp_); \
+	CASE(_log_); \
+	CASE(_log10_); \
+	CASE(_sin_); \
+	CASE(_sinh_); \
+	CASE(_asin_); \
+	CASE(_cos_); \
+	CASE(_cosh_); \
+	CASE(_acos_); \
+	CASE(_tan_); \
+	CASE(_tanh_); \
+	CASE(_atan_); \
+	CASE(_ceil_); \
+	CASE(_floor_); \
+	CASE(_isnan_); \
+	CASE(_isinf_); \
+	CASE(_sgn_); \
+	CASE(_atan2_); \
+	CASE(_pow_); \
+	CASE(_max_); \
+	CASE(_min_); \
+	CASE(_copy_); \
+	CASE(_ifelse_); \
+	CASE(_log2_); \
+	CASE(_gather_); \
+	CASE(_interp_); \
+	CASE(_polyval_); \
+	CASE(_pack_); \
+	CASE(_load_fp16_); \
+	CASE(_load_bf16_); \
+	CASE(_fast_exp_); \
+	CASE(_fast_log_); \
+	CASE(_fast_log10_); \
+	CASE(_fast_log2_); \
+	CASE(_fast_sin_); \
+	CASE(_fast_cos_); \
+	CASE(_fast_tanh_); \
+	CASE(_fast_pow_)
+
 #define CODE(OP_NAME) \
 	case (OP_NAME::op_code): operation_eval<OP_NAME>(*op); break
 
+#define REGISTER_CODE(OP_NAME) \
+	case (OP_NAME::op_code): register_eval<OP_NAME>(*op, reg, i); break
+
 // Note: Internal operations are at most binary, N-ary operations are decomposed into simpler.
 
+/**
+ * Floating point type of the processor values: inputs, results and temporaries.
+ */
+enum Precision {
+	double_precision = 0,
+	single_precision = 1
+};
+
+/**
+ * Evaluation of the active subset, see ProcessorOptions::subset_mode.
+ */
+enum SubsetMode {
+	// gather_subset for sparse subsets and programs reading the variables repeatedly
+	auto_subset = 0,
+	// operations read the variables and write the results through the subset indices
+	direct_subset = 1,
+	// variables gathered into dense buffers, program evaluated densely, results scattered back
+	gather_subset = 2
+};
+
+/**
+ * Order of the evaluation, see ProcessorOptions::program_order.
+ */
+enum ProgramOrder {
+	// element_major for small vectors
+	auto_order = 0,
+	// every operation over all blocks of the subset, temporaries in the workspace
+	op_major = 1,
+	// whole program for every block of the subset, all vectors of the block in the register file on the stack
+	element_major = 2
+};
+
+/**
+ * Options of the processor compilation.
+ */
+struct ProcessorOptions {
+	ProcessorOptions(Precision precision = double_precision)
+	: precision(precision), fast_math(false), nt_stores(false), max_temp_blocks(0), subset_mode(auto_subset),
+	  program_order(auto_order), packed_masks(true)
+	{}
+
+	Precision precision;
+	// Use approximations of the elementary functions with relative error about 1e-7, see fast_math.hh.
+	bool fast_math;
+	// Write the results by the non-temporal (streaming) stores, bypassing the cache, so that
+	// the results do not evict the inputs. Applies to the aligned results of at least 'nt_store_min_bytes'
+	// per component, run() ends with a store fence.
+	bool nt_stores;
+
+	static constexpr std::size_t nt_store_min_bytes = 256 * 1024;
+
+	// Capacity of the temporaries in SIMD blocks, 0 for the full vector. Larger subsets
+	// are evaluated in passes of at most 'max_temp_blocks' blocks.
+	uint max_temp_blocks;
+
+	uint temp_n_blocks(uint vec_n_blocks) const {
+		return (max_temp_blocks > 0 && max_temp_blocks < vec_n_blocks) ? max_temp_blocks : vec_n_blocks;
+	}
+
+	SubsetMode subset_mode;
+
+	// Element-major order applies to the programs with at most 'max_registers' workspace vectors,
+	// the auto order selects it for at most 'element_major_max_blocks' SIMD blocks.
+	ProgramOrder program_order;
+
+	static constexpr uint max_registers = 128;
+	static constexpr uint element_major_max_blocks = 2;
+
+	// Store the boolean temporaries as a bit per element (see ExpressionDAG::bool_temp_end),
+	// the vector processors in the op-major order only.
+	bool packed_masks;
+};
+
+/**
+ * Profile of the single operation of the processor program, see BP_PROFILE in config.hh.
+ */
+struct OpProfile {
+	const char * op_name;
+	Operation op;
+	// number of the operation arguments, including the result
+	uint n_args;
+	uint64_t n_calls;
+	uint64_t cycles;
+};
+
+#ifdef BP_PROFILE
+/// Time stamp counter, or nanoseconds on the other architectures.
+inline uint64_t profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+#endif
+
+/**
+ * Program listing annotated by the profile: op names, result and argument slots,
+ * calls, cycles per call and fraction of the total cycles.
+ */
+inline std::string profile_listing(const std::vector<OpProfile> &profile) {
+	uint64_t total = 0;
+	for(const OpProfile &p : profile) total += p.cycles;
+	std::stringstream ss;
+	ss << std::setw(4) << "#" << " " << std::setw(14) << std::left << "op" << std::right
+	   << std::setw(5) << "code" << "  " << std::setw(18) << std::left << "slots" << std::right
+	   << std::setw(10) << "calls" << std::setw(14) << "cycles" << std::setw(12) << "cycles/call"
+	   << std::setw(8) << "%" << "\n";
+	for(uint i=0; i < profile.size(); ++i) {
+		const OpProfile &p = profile[i];
+		std::stringstream slots;
+		slots << (int)p.op.arg[0] << " <-";
+		for(uint j=1; j < p.n_args; ++j) slots << " " << (int)p.op.arg[j];
+		ss << std::setw(4) << i << " " << std::setw(14) << std::left << p.op_name << std::right
+		   << std::setw(5) << (int)p.op.code << "  " << std::setw(18) << std::left << slots.str() << std::right
+		   << std::setw(10) << p.n_calls << std::setw(14) << p.cycles
+		   << std::setw(12) << std::fixed << std::setprecision(1) << (p.n_calls ? double(p.cycles) / p.n_calls : 0.0)
+		   << std::setw(8) << (total ? 100.0 * p.cycles / total : 0.0) << "\n";
+	}
+	ss << "total cycles: " << total << "\n";
+	return ss.str();
+}
+
 struct ProcessorSetup {
 	uint vec_n_blocks;
 	uint n_operations;
@@ -145,9 +342,18 @@ struct ProcessorSetup {
 struct ProcessorBase {
 	virtual void run() = 0;
 	virtual void set_subset(std::vector<uint> const &subset) = 0;
+	virtual void set_subset(const uint *subset, uint subset_size) = 0;
+	virtual uint * subset_buffer() = 0;
+	// Empty without BP_PROFILE.
+	virtual std::vector<OpProfile> profile() const = 0;
+	virtual void reset_profile() = 0;
+	// Number of operations of the program.
+	virtual uint program_length() const = 0;
+	// Number of SIMD blocks in the current subset.
+	virtual uint subset_size() const = 0;
 
 	ProcessorBase(ArenaAllocPtr arena)
-	: arena_(arena) {
+	: arena_(arena), arena_estimate_(0) {
 		
 	}
 
@@ -158,9 +364,12 @@ struct ProcessorBase {
 		return arena_;
 	}
 	
-	inline static ProcessorBase *create_processor(ExpressionDAG &se, uint vec_n_blocks, uint simd_size = 0, ArenaAllocPtr arena = nullptr);
+	inline static ProcessorBase *create_processor(ExpressionDAG &se, uint vec_n_blocks, uint simd_size = 0, ArenaAllocPtr arena = nullptr,
+			ProcessorOptions options = ProcessorOptions());
 
 	ArenaAllocPtr arena_;
+	// Arena size estimated for the processor.
+	std::size_t arena_estimate_;
 };
 
 
@@ -173,7 +382,7 @@ template <typename VecType>
 struct Processor : public ProcessorBase {
 	/**
 	 *hh
-	 * vector_size: maximum vector size in doubles
+	 * vector_size: maximum vector size in values (doubles or floats)
 	 *
 	 * TODO: reimplement full__ns to perform topological sort of nodes
 	 * TODO: enclose global expression manipulations into a class ScalarExpression
@@ -186,7 +395,8 @@ struct Processor : public ProcessorBase {
 	 * - create processor
 	 */
 	typedef typename VecType::MyVCLVec VCLVec;
-	static const uint simd_size = sizeof(VCLVec) / sizeof(double);
+	typedef typename VecType::Scalar Scalar;
+	static const uint simd_size = sizeof(VCLVec) / sizeof(Scalar);
 
 
 
@@ -201,16 +411,23 @@ struct Processor : public ProcessorBase {
 	/**
 	 * Do not create processor directly, use the static 'create' method
 	 *
-	 * vec_n_blocks : number of simd blocks (double4).
+	 * vec_n_blocks : number of simd blocks (e.g. double4 or float8).
 	 */
-	Processor(ArenaAllocPtr arena, ExpressionDAG &se, uint vec_n_blocks)
-	: ProcessorBase(arena)
+	Processor(ArenaAllocPtr arena, ExpressionDAG &se, uint vec_n_blocks, ProcessorOptions options)
+	: ProcessorBase(arena),
+	  options_(options)
 	{
 		workspace_.vec_n_blocks = vec_n_blocks;
 		workspace_.subset_size = 0;
 		workspace_.const_subset = arena_->create_array<uint>(vec_n_blocks);
 		for(uint i=0; i<vec_n_blocks;++i) workspace_.const_subset[i] = 0;
-		workspace_.vec_subset = (uint *) arena_->allocate(sizeof(uint) * vec_n_blocks);
+		workspace_.subset_buffer = (uint *) arena_->allocate(sizeof(uint) * vec_n_blocks);
+		workspace_.vec_subset = workspace_.subset_buffer;
+		// temporaries are dense, independent of the subset
+		uint temp_n_blocks = options_.temp_n_blocks(vec_n_blocks);
+		workspace_.temp_n_blocks = temp_n_blocks;
+		workspace_.flat_subset = arena_->create_array<uint>(temp_n_blocks);
+		for(uint i=0; i<temp_n_blocks;++i) workspace_.flat_subset[i] = i;
 		
 		// std::cout << "&vec_subset: " << &(workspace_.vec_subset) << "\n";
 		// std::cout << "aloc vec_subset: " << workspace_.vec_subset << " size: " << vec_n_blocks << "\n";
@@ -220,20 +437,36 @@ struct Processor : public ProcessorBase {
 		// std::cout << "se.temp_end: " << se.temp_end << "\nse.values_end: " << se.values_end << "\nse.constants_end: " << se.constants_end << std::endl;
 
 
-		workspace_.vector = (Vec<VCLVec> *) arena_->allocate(sizeof(Vec<VCLVec>) * se.temp_end);
-		double * temp_base = (double *) arena_->allocate(
-				sizeof(double) * vec_n_blocks * simd_size * (se.temp_end - se.values_end));
-		double * const_base = (double *) arena_->allocate(
-				sizeof(double) * simd_size * se.constants_end);
+		// value copies are followed by the vectors of their sources
+		uint n_value_copies = se.values_copy_end - se.values_end;
+		workspace_.n_vectors = se.bool_temp_end + n_value_copies;
+		workspace_.vector = (Vec<VCLVec> *) arena_->allocate(sizeof(Vec<VCLVec>) * workspace_.n_vectors);
+		// boolean temporaries of the scalar processor or without the packed_masks are the full masks
+		uint n_bool_temps = se.bool_temp_end - se.temp_end;
+		bool packed = options_.packed_masks && ! std::is_arithmetic<VCLVec>::value && n_bool_temps > 0;
+		workspace_.packed_begin = se.temp_end;
+		workspace_.packed_end = packed ? se.bool_temp_end : se.temp_end;
+		Scalar * temp_base = (Scalar *) arena_->allocate(
+				sizeof(Scalar) * temp_n_blocks * simd_size * (se.temp_end - se.values_end + (packed ? 0 : n_bool_temps)));
+		Scalar * const_base = (Scalar *) arena_->allocate(
+				sizeof(Scalar) * simd_size * se.constants_end);
 		for(uint i=0; i< se.constants_end; ++i)
 			vec_set(i, const_base + i * simd_size, workspace_.const_subset);
 
 		uint i_tmp = 0;
 		for(uint i=se.values_end; i< se.values_copy_end; ++i, ++i_tmp)
-			vec_set(i, temp_base + i_tmp*vec_n_blocks*simd_size, workspace_.vec_subset);
+			vec_set(i, temp_base + i_tmp*temp_n_blocks*simd_size, workspace_.flat_subset);
 
 		for(uint i=se.values_copy_end; i< se.temp_end; ++i, ++i_tmp)
-			vec_set(i, temp_base + i_tmp*vec_n_blocks*simd_size, workspace_.vec_subset);
+			vec_set(i, temp_base + i_tmp*temp_n_blocks*simd_size, workspace_.flat_subset);
+
+		typedef typename MaskBits<VCLVec>::type Bits;
+		Bits * bits_base = packed ? arena_->create_array<Bits>(temp_n_blocks * n_bool_temps) : nullptr;
+		for(uint i=se.temp_end; i< se.bool_temp_end; ++i)
+			if (packed)
+				vec_set(i, (Scalar *)(bits_base + (i - se.temp_end) * temp_n_blocks), workspace_.flat_subset);
+			else
+				vec_set(i, temp_base + (i_tmp++)*temp_n_blocks*simd_size, workspace_.flat_subset);
 
 		// value vectors ... setup when processing the nodes, every value node processed exactly once
 		// we need the values pointer from these nodes.
@@ -243,8 +476,24 @@ struct Processor : public ProcessorBase {
 		// actually we need only 2 temporary vectors
 		// need a mean to visualize 'se' graph.
 	    auto sorted_nodes = se.sort_nodes();
-		uint n_operations = sorted_nodes.size();
+		// value copy nodes make copy operations, one more for the terminal operation
+		uint n_operations = sorted_nodes.size() + 1;
+		// tables are indexed by the Operation::arg[2]
+		uint n_interp = 0, n_poly = 0;
+		for(ScalarNodePtr node : sorted_nodes) {
+			if (node->op_code_ == _interp_::op_code) n_interp++;
+			if (node->op_code_ == _polyval_::op_code) n_poly++;
+		}
+		if (n_interp > 256)
+			Throw() << "Too many interp calls: " << n_interp << ", at most 256 in the expression.\n";
+		if (n_poly > 256)
+			Throw() << "Too many polynomials: " << n_poly << ", at most 256 in the expression.\n";
+		workspace_.interp_tables = arena_->create_array<InterpTable<Scalar>>(n_interp);
+		workspace_.poly_tables = arena_->create_array<PolyTable<Scalar>>(n_poly);
 		program_ = (Operation *) arena_->allocate(sizeof(Operation) * n_operations);
+#ifdef BP_PROFILE
+		profile_ = arena_->create_array<OpProfile>(n_operations);
+#endif
 
 		/**
 		 * TODO separate setup of workspace - no dependence on the order
@@ -258,8 +507,8 @@ struct Processor : public ProcessorBase {
 			ScalarNodePtr  node = *it;
 			switch (node->result_storage) {
 			case constant: {
-				double c_val = *node->get_value();
-				double * c_ptr = workspace_.vector[node->result_idx_].values;
+				Scalar c_val = node->value_;
+				Scalar * c_ptr = workspace_.vector[node->result_idx_].values;
 				// std::cout << "node->result_idx_ = " << node->result_idx_ << std::endl;
 				// std::cout << "c_ptr = " << c_ptr << std::endl;
 				
@@ -270,9 +519,9 @@ struct Processor : public ProcessorBase {
 
 			case constant_bool:
 			{
-				double c_val = *node->get_value();
-				double * c_ptr = workspace_.vector[node->result_idx_].values;
-				Vec<double> v;
+				double c_val = node->value_;
+				Scalar * c_ptr = workspace_.vector[node->result_idx_].values;
+				Vec<Scalar> v;
 
 				if (c_val == 0.0) {
 					for(uint j=0; j<simd_size; ++j)
@@ -286,22 +535,21 @@ struct Processor : public ProcessorBase {
 			}
 			case value:
 				// for (uint i=0; i < simd_size; i++)
-					vec_set(node->result_idx_, (double *)node->get_value(), workspace_.vec_subset);
+					vec_set(node->result_idx_, (Scalar *)node->get_value(), workspace_.vec_subset);
+				// strided and half precision values are read by the gather and load operations only
+				if (is_direct_value(node))
+					gather_slots_.push_back({(uint)node->result_idx_, nullptr, nullptr, false});
 				break;
 			case value_copy:
-			{
-				auto val_copy_ptr = ( std::dynamic_pointer_cast<ValueCopyNode> (node) );
-				if (val_copy_ptr->values_ == nullptr) {
-					val_copy_ptr->values_ = arena_->create_array<double>(vec_n_blocks);
-					// for (uint i=0; i < simd_size; i++)
-						vec_set(node->result_idx_, (double *)node->get_value(), workspace_.vec_subset);
-				}
-				val_copy_nodes_.push_back(val_copy_ptr);
+				// copied into its temporary slot by the operation made before the first use
+				vec_set(source_idx(se, node), (Scalar *)node->source_ptr_, workspace_.vec_subset);
+				element_loads_.push_back(source_idx(se, node));
 				break;
-			}
 			case temporary:
+				op = make_value_copies(se, node, op);
 				*op = make_operation(node);
 				++op;
+				if (is_indexed(node)) n_indexed_ops_++;
 				break;
 			case none:
 				BP_ASSERT(false);
@@ -309,11 +557,26 @@ struct Processor : public ProcessorBase {
 				// ++op;
 				break;
 			case expr_result:
+				if (node->op_code_ == _pack_::op_code) {
+					// the bits are written by the operation itself, also in the element-major and gather modes
+					vec_set(node->result_idx_, (Scalar *)node->get_value(), workspace_.vec_subset);
+					*op = make_operation(node);
+					++op;
+					n_indexed_ops_++;
+					break;
+				}
 				// for (uint i=0; i < simd_size; i++)
-					vec_set(node->result_idx_, (double *)node->get_value(), workspace_.vec_subset);
+					vec_set(node->result_idx_, (Scalar *)node->get_value(), workspace_.vec_subset);
+				if (use_nt_store((Scalar *)node->get_value())) {
+					workspace_.vector[node->result_idx_].nt_store = true;
+					nt_stores_ = true;
+				}
 
+				op = make_value_copies(se, node, op);
 				*op = make_operation(node);
 				++op;
+				scatter_slots_.push_back({(uint)node->result_idx_, nullptr, nullptr, false});
+				n_indexed_ops_++;
 
 				// ASSERT(node->n_inputs_ == 1);
 				// ScalarNodePtr  prev_node = node->inputs_[0];
@@ -327,11 +590,77 @@ struct Processor : public ProcessorBase {
 			BP_ASSERT(op < program_ + n_operations);
 		}
 		op->code = ScalarNode::terminate_op_code;
+		n_operations_ = op - program_;
+
+		n_constants_ = se.constants_end;
+		for(const GatherSlot &g : gather_slots_) element_loads_.push_back(g.idx);
+		element_major_ = use_element_major();
+
 
+	}
+
+	bool use_element_major() const {
+		if (workspace_.n_vectors > ProcessorOptions::max_registers) return false;
+		switch (options_.program_order) {
+		case op_major: return false;
+		case element_major: return true;
+		default: break;
+		}
+#ifdef BP_PROFILE
+		// operations are profiled in the op-major order
+		return false;
+#else
+		return workspace_.vec_n_blocks <= ProcessorOptions::element_major_max_blocks;
+#endif
+	}
+
+	// Operation of the 'node' reads a variable or writes a result through the subset indices.
+	static bool is_indexed(ScalarNodePtr node) {
+		if (node->result_storage == expr_result) return true;
+		for(uint j=0; j < node->n_inputs_; ++j)
+			if (node->inputs_[j]->result_storage == value && is_direct_value(node->inputs_[j])) return true;
+		return false;
+	}
+
+	// Value 'node' read by the operations directly as the blocks of the processor precision.
+	static bool is_direct_value(ScalarNodePtr node) {
+		return node->stride_ == 1 && ! node->half_;
+	}
+
+	// Workspace index of the source vector of the value copy 'node'.
+	static uint source_idx(ExpressionDAG &se, ScalarNodePtr node) {
+		return se.bool_temp_end + node->result_idx_ - se.values_end;
+	}
+
+	/**
+	 * Make copy operations of the value copy inputs of the 'node' not copied yet.
+	 * The copies are made just before their first use and only for the active subset,
+	 * so the copied blocks are still in the cache when read by the 'node'.
+	 */
+	Operation * make_value_copies(ExpressionDAG &se, ScalarNodePtr node, Operation * op) {
+		for(uint j=0; j<node->n_inputs_; ++j) {
+			ScalarNodePtr in = node->inputs_[j];
+			if (in->result_storage != value_copy ||
+					std::find(copied_nodes_.begin(), copied_nodes_.end(), in) != copied_nodes_.end())
+				continue;
+			copied_nodes_.push_back(in);
+			*op = {(unsigned char)_copy_::op_code, {(unsigned char)in->result_idx_, (unsigned char)source_idx(se, in), 0, 0}};
+#ifdef BP_PROFILE
+			profile_[n_profiled_++] = {in->op_name_, *op, 2, 0, 0};
+#endif
+			++op;
+		}
+		return op;
+	}
 
+	// Non-temporal stores of the result 'values', see ProcessorOptions::nt_stores.
+	bool use_nt_store(const Scalar * values) const {
+		return options_.nt_stores
+				&& workspace_.vec_n_blocks * sizeof(VCLVec) >= ProcessorOptions::nt_store_min_bytes
+				&& (uintptr_t)values % sizeof(VCLVec) == 0;
 	}
 
-	void vec_set(uint ivec, double * v, uint * s) {
+	void vec_set(uint ivec, Scalar * v, const uint * s) {
 		// std::cout << "Set vec: " << ivec << " ptr: " << &(workspace_.vector[ivec]) << " v: " << v  << " &v: " << *v  << " s: " << s << " &s: " << *s <<std::endl;
 		workspace_.vector[ivec].set(v, s);
 	}
@@ -341,20 +670,30 @@ struct Processor : public ProcessorBase {
 	}
 
 	~Processor() {
-		for (auto node : val_copy_nodes_) {
-			node->values_ = nullptr;
-		}
 		// arena_->destroy();
 	}
 
 	Operation make_operation(ScalarNodePtr  node) {
 		Operation op = {(unsigned char)0xff, {0,0,0,0}}  ;
 		op.code = node->op_code_;
+		if (options_.fast_math)
+			op.code = fast_op_code(op.code, std::is_same<Scalar, float>::value);
 		uint i_arg = 0;
 		//if (node->result_storage == temporary)
 		op.arg[i_arg++] = node->result_idx_;
 		for(uint j=0; j<node->n_inputs_; ++j)
 			op.arg[i_arg++] = node->inputs_[j]->result_idx_;
+		if (op.code == _gather_::op_code)
+			op.arg[i_arg++] = node->inputs_[0]->stride_;
+		if (op.code == _interp_::op_code)
+			op.arg[i_arg++] = make_interp_table(node);
+		if (op.code == _polyval_::op_code)
+			op.arg[i_arg++] = make_poly_table(node);
+#ifdef BP_PROFILE
+		// operations are made in the program order
+		uint i_op = n_profiled_++;
+		profile_[i_op] = {node->op_name_, op, i_arg, 0, 0};
+#endif
 
 		// std::cout << "Created new op: " << (int)(op.code)
 		// 	<< " ia0: " << (int)(op.arg[0])
@@ -369,13 +708,190 @@ struct Processor : public ProcessorBase {
 	}
 
 
+	/**
+	 * Table of the _interp_ node in the arena, in the precision of the processor, see InterpTable.
+	 * Returns its index passed in the Operation::arg[2].
+	 */
+	uint make_interp_table(ScalarNodePtr node) {
+		uint n = node->table_size_ / 2;
+		const double * xp = node->table_;
+		const double * fp = node->table_ + n;
+		uint n_segments = std::max(n, 2u) - 1;
+		uint n_search = 1;
+		while (n_search < n_segments) n_search *= 2;
+
+		InterpTable<Scalar> &t = workspace_.interp_tables[n_interp_tables_];
+		t.n = n;
+		t.n_search = n_search;
+		t.xp = arena_->create_array<Scalar>(n_search);
+		t.fp = arena_->create_array<Scalar>(n_search);
+		t.slope = arena_->create_array<Scalar>(n_search);
+		for(uint k=0; k < n_search; ++k) {
+			if (k < n_segments) {
+				double dx = (k + 1 < n) ? xp[k + 1] - xp[k] : 0.0;
+				t.xp[k] = xp[k];
+				t.fp[k] = fp[k];
+				t.slope[k] = (dx > 0) ? (fp[k + 1] - fp[k]) / dx : 0.0;
+			} else {
+				t.xp[k] = std::numeric_limits<Scalar>::infinity();
+				t.fp[k] = t.slope[k] = 0;
+			}
+		}
+		t.x_min = xp[0];
+		t.x_max = xp[n - 1];
+		return n_interp_tables_++;
+	}
+
+	/// Coefficients of the _polyval_ node in the arena, returns the index passed in the Operation::arg[2].
+	uint make_poly_table(ScalarNodePtr node) {
+		PolyTable<Scalar> &t = workspace_.poly_tables[n_poly_tables_];
+		t.n = node->table_size_;
+		t.c = arena_->create_array<Scalar>(t.n);
+		for(uint k=0; k < t.n; ++k) t.c[k] = node->table_[k];
+		return n_poly_tables_++;
+	}
+
 	template<class T>
 	inline void operation_eval(Operation op) {
 		EvalImpl<T::n_eval_args, T, VCLVec>::eval(op, workspace_);
 	}
 
+	template<class T>
+	inline void register_eval(Operation op, VCLVec *reg, uint i) {
+		RegisterEval<T::n_eval_args, T, VCLVec>::eval(op, reg, workspace_, i);
+	}
+
 	void run() {
-		this->copy_inputs();
+		if (element_major_) {
+			run_elements();
+			return;
+		}
+		uint size = workspace_.subset_size;
+		if (size <= workspace_.temp_n_blocks) {
+			run_subset();
+			return;
+		}
+		// passes over parts of the subset fitting into the temporaries
+		const uint * subset = workspace_.vec_subset;
+		for(uint begin=0; begin < size; begin += workspace_.temp_n_blocks) {
+			set_subset(subset + begin, std::min(workspace_.temp_n_blocks, size - begin));
+			run_subset();
+		}
+		set_subset(subset, size);
+	}
+
+	void run_subset() {
+		if (use_gather())
+			run_gathered();
+		else
+			run_program();
+	}
+
+	/**
+	 * Gather mode can pay off only for sparse subsets, where the indexed blocks are scattered
+	 * over many cache lines and pages, and when the operations reading the variables (or writing
+	 * the results) clearly outnumber the gathered and scattered vectors. The extra copies make it
+	 * slower otherwise, see test_subset_mode in test_speed.cc.
+	 */
+	bool use_gather() const {
+		switch (options_.subset_mode) {
+		case direct_subset: return false;
+		case gather_subset: return true;
+		default: break;
+		}
+		uint n_gathered = gather_slots_.size() + scatter_slots_.size();
+		return workspace_.subset_size * gather_max_density < workspace_.vec_n_blocks
+				&& n_indexed_ops_ >= gather_min_ops_ratio * n_gathered;
+	}
+
+	/**
+	 * Copy the subset blocks of the variables into dense buffers, evaluate the program
+	 * on the dense vectors, copy the results back to the subset blocks.
+	 */
+	void run_gathered() {
+		const uint * subset = workspace_.vec_subset;
+		uint size = workspace_.subset_size;
+		if (! gather_allocated_)
+			allocate_gather_buffers();
+
+		for(GatherSlot &g : gather_slots_) {
+			Vec<VCLVec> &v = workspace_.vector[g.idx];
+			for(uint i=0; i < size; ++i)
+				copy_block<false, VCLVec>(v.values + subset[i] * simd_size, g.dense + i * simd_size);
+			g.values = v.values;
+			v.values = g.dense;
+			v.subset = workspace_.flat_subset;
+		}
+		for(GatherSlot &g : scatter_slots_) {
+			Vec<VCLVec> &v = workspace_.vector[g.idx];
+			g.values = v.values;
+			v.values = g.dense;
+			v.subset = workspace_.flat_subset;
+			g.nt_store = v.nt_store;
+			v.nt_store = false;
+		}
+
+		run_program();
+
+		for(GatherSlot &g : scatter_slots_) {
+			Vec<VCLVec> &v = workspace_.vector[g.idx];
+			v.values = g.values;
+			v.subset = subset;
+			v.nt_store = g.nt_store;
+			if (g.nt_store)
+				for(uint i=0; i < size; ++i)
+					copy_block<true, VCLVec>(g.dense + i * simd_size, v.values + subset[i] * simd_size);
+			else
+				for(uint i=0; i < size; ++i)
+					copy_block<false, VCLVec>(g.dense + i * simd_size, v.values + subset[i] * simd_size);
+		}
+		if (nt_stores_) _mm_sfence();
+		for(GatherSlot &g : gather_slots_) {
+			Vec<VCLVec> &v = workspace_.vector[g.idx];
+			v.values = g.values;
+			v.subset = subset;
+		}
+	}
+
+	void allocate_gather_buffers() {
+		uint n_values = workspace_.temp_n_blocks * simd_size;
+		for(GatherSlot &g : gather_slots_) g.dense = arena_->create_array<Scalar>(n_values);
+		for(GatherSlot &g : scatter_slots_) g.dense = arena_->create_array<Scalar>(n_values);
+		gather_allocated_ = true;
+	}
+
+	/**
+	 * Element-major evaluation for small vectors: the whole program for every block of the subset
+	 * with all vectors of the block in the register file. Pays the dispatch per operation and block,
+	 * but no loops over the subset and no temporaries in the memory.
+	 */
+	void run_elements() {
+		VCLVec reg[ProcessorOptions::max_registers];
+		for(uint i_const=0; i_const < n_constants_; ++i_const)
+			reg[i_const] = load_block<VCLVec>(workspace_.vector[i_const].values);
+		const Operation * program_end = program_ + n_operations_;
+		for(uint i=0; i < workspace_.subset_size; ++i) {
+			for(uint idx : element_loads_)
+				reg[idx] = load_block<VCLVec>(workspace_.vector[idx].value(i));
+			for(const Operation * op = program_; op < program_end; ++op) {
+				switch (op->code) {
+				OPERATION_CASES(REGISTER_CODE);
+				default: // registered functions
+					native_kernels<VCLVec>()[op->code - native_op_code_base].register_eval(*op, reg, workspace_, i);
+				}
+			}
+			for(const GatherSlot &g : scatter_slots_) {
+				Vec<VCLVec> &v = workspace_.vector[g.idx];
+				if (v.nt_store)
+					store_block<true>(reg[g.idx], v.value(i));
+				else
+					store_block<false>(reg[g.idx], v.value(i));
+			}
+		}
+		if (nt_stores_) _mm_sfence();
+	}
+
+	void run_program() {
 		for(Operation * op = program_;;++op) {
 			// std::cout << "op points at:" << op << std::endl;
 
@@ -389,121 +905,161 @@ struct Processor : public ProcessorBase {
 			// 		<< " ia3: " << (int)(op->arg[3])
 			// 		<< " a3: " << workspace_.vector[op->arg[3]].values << "\n";
 
+#ifdef BP_PROFILE
+			uint64_t t_start = profile_clock();
+#endif
 			switch (op->code) {
-			CODE(_minus_);
-			CODE(_add_);
-			CODE(_sub_);
-			CODE(_mul_);
-			CODE(_div_);
-			CODE(_mod_);
-			CODE(_eq_);
-			CODE(_ne_);
-			CODE(_lt_);
-			CODE(_le_);
-			CODE(_neg_);
-			CODE(_or_);
-			CODE(_and_);
-			CODE(_abs_);
-			CODE(_sqrt_);
-			CODE(_exp_);
-			CODE(_log_);
-			CODE(_log10_);
-			CODE(_sin_);
-			CODE(_sinh_);
-			CODE(_asin_);
-			CODE(_cos_);
-			CODE(_cosh_);
-			CODE(_acos_);
-			CODE(_tan_);
-			CODE(_tanh_);
-			CODE(_atan_);
-			CODE(_ceil_);
-			CODE(_floor_);
-			CODE(_isnan_);
-			CODE(_isinf_);
-			CODE(_sgn_);
-			CODE(_atan2_);
-			CODE(_pow_);
-			CODE(_max_);
-			CODE(_min_);
-			CODE(_copy_);
-			CODE(_ifelse_);
-			CODE(_log2_);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-//			CODE(__);
-			case (ScalarNode::terminate_op_code): return; // terminal operation
+			OPERATION_CASES(CODE);
+			case (ScalarNode::terminate_op_code): // terminal operation
+				// make the non-temporal stores visible before the caller reads the results
+				if (nt_stores_) _mm_sfence();
+				return;
+			default: // registered functions
+				native_kernels<VCLVec>()[op->code - native_op_code_base].eval(*op, workspace_);
 			}
+#ifdef BP_PROFILE
+			OpProfile &prof = profile_[op - program_];
+			prof.cycles += profile_clock() - t_start;
+			prof.n_calls++;
+#endif
 		}
 	}
 
-	// Set subset indices of active double4 blocks.
-	// TODO: Provide getter for pointer to the workspace subset in order to
-	// fill it (some where), can be passed together with fixed size as std::span
+	std::vector<OpProfile> profile() const {
+#ifdef BP_PROFILE
+		return std::vector<OpProfile>(profile_, profile_ + n_operations_);
+#else
+		return {};
+#endif
+	}
+
+	uint program_length() const {
+		return n_operations_;
+	}
+
+	uint subset_size() const {
+		return workspace_.subset_size;
+	}
+
+	void reset_profile() {
+#ifdef BP_PROFILE
+		for(uint i=0; i < n_operations_; ++i)
+			profile_[i].n_calls = profile_[i].cycles = 0;
+#endif
+	}
+
+	// Set subset indices of active SIMD blocks (e.g. double4).
+	// The indices are copied into the subset_buffer().
 	void set_subset(std::vector<uint> const &subset)
 	{
 		BP_ASSERT( (subset.size() <= workspace_.vec_n_blocks) );
-		workspace_.subset_size = subset.size();
-		// std::cout << "vec_subset: " << workspace_.vec_subset << "\n";
-		for(uint i=0; i<workspace_.subset_size; ++i) {
-			// std::cout << "subset_i: " << subset[i] << " i=" << i << "\n";
-			workspace_.vec_subset[i] = subset[i] * simd_size;
-			// std::cout << "subsetvec_i: " << workspace_.vec_subset[i]<< " i=" << i << "\n";
-		}
-		// std::cout << "subset: " << workspace_.vec_subset << std::endl;
+		std::copy(subset.begin(), subset.end(), workspace_.subset_buffer);
+		set_subset(workspace_.subset_buffer, subset.size());
 	}
 
-	// Copy data of ValueCopyNode objects to arena_
-	void copy_inputs()
+	// Set subset indices of active SIMD blocks without copy.
+	// The caller owned 'subset' array must be valid until the last run() with this subset.
+	// Only pointers of the vector operands are updated, so the cost does not depend on the subset size.
+	void set_subset(const uint *subset, uint subset_size)
 	{
+		BP_ASSERT( (subset_size <= workspace_.vec_n_blocks) );
+		workspace_.subset_size = subset_size;
+		if (subset == workspace_.vec_subset) return;
+		for(uint i=0; i<workspace_.n_vectors; ++i)
+			if (workspace_.vector[i].subset == workspace_.vec_subset)
+				workspace_.vector[i].subset = subset;
+		workspace_.vec_subset = subset;
+	}
 
-		for (auto node : val_copy_nodes_) {
-			memcpy(node->values_, node->source_ptr_, workspace_.vec_n_blocks * sizeof *node->values_);
-		}
+	// Processor owned array for 'vec_n_blocks' subset indices.
+	// Can be filled in place and then activated by set_subset(subset_buffer(), size).
+	uint * subset_buffer()
+	{
+		return workspace_.subset_buffer;
 	}
 
 	// ArenaAlloc arena_;
+	ProcessorOptions options_;
+	// Some results are stored by the non-temporal stores.
+	bool nt_stores_ = false;
 	Workspace<VCLVec> workspace_;
 	Operation * program_;
-	std::vector< std::shared_ptr<ValueCopyNode> > val_copy_nodes_;
+	// number of operations without the terminal one
+	uint n_operations_;
+	// Value copy nodes with the copy operation, used during the construction only.
+	std::vector<ScalarNodePtr> copied_nodes_;
+
+	// Variable or result vector with its dense buffer of the gather mode.
+	struct GatherSlot {
+		uint idx;
+		// dense buffer of 'temp_n_blocks' blocks, allocated by the first gathered run
+		Scalar * dense;
+		// values of the vector saved during the gathered run
+		Scalar * values;
+		bool nt_store;
+	};
+	std::vector<GatherSlot> gather_slots_;
+	std::vector<GatherSlot> scatter_slots_;
+	// Number of operations with a gathered or scattered vector.
+	uint n_indexed_ops_ = 0;
+	bool gather_allocated_ = false;
+
+	// Auto gather mode for subsets of less than 1 / gather_max_density of the vector
+	// and at least gather_min_ops_ratio indexed operations per gathered vector.
+	static constexpr uint gather_max_density = 32;
+	static constexpr uint gather_min_ops_ratio = 4;
+
+	// Evaluation by run_elements.
+	bool element_major_ = false;
+	uint n_constants_ = 0;
+	// Vectors loaded into the register file for every block: variables and value copy sources.
+	std::vector<uint> element_loads_;
+	// Tables of the _interp_ and _polyval_ operations made so far.
+	uint n_interp_tables_ = 0;
+	uint n_poly_tables_ = 0;
+#ifdef BP_PROFILE
+	OpProfile * profile_ = nullptr;
+	uint n_profiled_ = 0;
+#endif
 };
 
 
 template <class VCLVec> 
-ProcessorBase * create_processor_(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena)
+ProcessorBase * create_processor_(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options)
 {
-    uint simd_bytes = sizeof(double) * simd_size;
+    uint simd_bytes = sizeof(typename Vec<VCLVec>::Scalar) * simd_size;
     ExpressionDAG::NodeVec & sorted_nodes = se.sort_nodes();
     uint simd_bytes1 = sizeof(VCLVec);
     // std::cout << simd_bytes1 << "!=" << simd_bytes << "\n";
     BP_ASSERT(simd_bytes1 == simd_bytes);
     uint vec_n_blocks = (vector_size / simd_size);
+    uint temp_n_blocks = options.temp_n_blocks(vec_n_blocks);
     uint est = 
             align_size(simd_bytes, sizeof(Processor<Vec<VCLVec>>)) +
             align_size(simd_bytes, sizeof(uint) * vector_size) +
-            align_size(simd_bytes, se.temp_end * sizeof(Vec<VCLVec>)) +
-            align_size(simd_bytes, sizeof(VCLVec) * vec_n_blocks * (se.temp_end - se.values_copy_end)) +  // vec_copy, same as temporaries
-            align_size(simd_bytes, sizeof(VCLVec) * vec_n_blocks * (se.values_copy_end - se.values_end)) + // vector values (probably not neccessary to allocate)
+            align_size(simd_bytes, sizeof(uint) * temp_n_blocks) +
+            align_size(simd_bytes, (se.bool_temp_end + se.values_copy_end - se.values_end) * sizeof(Vec<VCLVec>)) +
+            align_size(simd_bytes, sizeof(VCLVec) * temp_n_blocks * (se.bool_temp_end - se.values_copy_end)) +  // vec_copy, same as temporaries
+            align_size(simd_bytes, sizeof(VCLVec) * temp_n_blocks * (se.values_copy_end - se.values_end)) + // value copies
             align_size(simd_bytes, sizeof(VCLVec) * se.constants_end ) +
             align_size(simd_bytes, sizeof(Operation) * (sorted_nodes.size() + 64) );
+    // tables of the _interp_ (three arrays padded to at most twice the table) and _polyval_ nodes
+    for(ScalarNodePtr node : sorted_nodes)
+        if (node->table_size_ > 0)
+            est += align_size(simd_bytes, sizeof(InterpTable<double>) + sizeof(PolyTable<double>)) +
+                   3 * align_size(simd_bytes, sizeof(double) * node->table_size_);
+#ifdef BP_PROFILE
+    est += align_size(simd_bytes, sizeof(OpProfile) * (sorted_nodes.size() + 1));
+#endif
 
 	// std::cout << "Estimated memory in processor: " << est << std::endl;
 
+    // The arena grows if the estimate is not sufficient.
     if (arena == nullptr)
-        arena = std::make_shared<ArenaAlloc>(simd_bytes, est);
-    else
-        BP_ASSERT(arena->size_ >= est);
-    return arena->create<Processor<Vec<VCLVec>>>(arena, se, vec_n_blocks);
+        arena = std::make_shared<ArenaAlloc>(simd_bytes, est, est >= ArenaAlloc::huge_page_size);
+    auto processor = arena->create<Processor<Vec<VCLVec>>>(arena, se, vec_n_blocks, options);
+    processor->arena_estimate_ = est;
+    return processor;
 }
 
 
@@ -38,5 +38,8 @@
 namespace bparser{
 
     template<>
-    ProcessorBase * create_processor_<Vec8d>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena);
+    ProcessorBase * create_processor_<Vec8d>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options);
+
+    template<>
+    ProcessorBase * create_processor_<Vec16f>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options);
 }
@@ -38,6 +38,9 @@
 namespace bparser{
 
     template<>
-    ProcessorBase * create_processor_<Vec2d>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena);
+    ProcessorBase * create_processor_<Vec2d>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options);
+
+    template<>
+    ProcessorBase * create_processor_<Vec4f>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options);
  }
  
\ No newline at end of file
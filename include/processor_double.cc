@@ -3,5 +3,5 @@
 namespace bparser{
 
     template<>
-    ProcessorBase * create_processor_<double>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena);
+    ProcessorBase * create_processor_<double>(ExpressionDAG &se, uint vector_size,  uint simd_size, ArenaAllocPtr arena, ProcessorOptions options);
 }
@@ -13,6 +13,7 @@
 #include <map>
 #include <typeinfo>
 #include <memory>
+#include <deque>
 #include "config.hh"
 #include "assert.hh"
 #include "VCL_v2_math.hh"
@@ -21,6 +22,17 @@
 
 
 namespace bparser {
+
+/**
+ * Storage of the half precision variables, see Parser::set_variable.
+ */
+enum HalfFormat {
+	// IEEE 754 binary16
+	fp16 = 0,
+	// bfloat16, the upper half of the float
+	bf16 = 1
+};
+
 namespace details {
 
 
@@ -35,7 +47,24 @@ enum ResultStorage {
 };
 
 struct ScalarNode;
-typedef std::shared_ptr<ScalarNode> ScalarNodePtr;
+typedef ScalarNode * ScalarNodePtr;
+
+
+/**
+ * Interned name of the operation T, derived from its type name, e.g. '_add_' -> 'add'.
+ * Computed once per operation type, nodes only keep the pointer.
+ */
+inline std::string strip_op_name(std::string str) {
+	uint a = str.find_first_of('_')+1;
+	uint b = str.find_last_of('_');
+	return str.substr(a, b-a);
+}
+
+template <class T>
+const char * op_name() {
+	static const std::string name = strip_op_name(typeid(T).name());
+	return name.c_str();
+}
 
 
 /**
@@ -45,6 +74,9 @@ typedef std::shared_ptr<ScalarNode> ScalarNodePtr;
  *
  * ScalarNodes are not meant to be directly used.
  * Use Array class to construct general vector expressions.
+ *
+ * All kinds of nodes share the same plain structure, so that they can be allocated
+ * in the NodePool and released without destructor calls.
  */
 
 struct ScalarNode {
@@ -58,11 +90,26 @@ struct ScalarNode {
 	uint n_dep_nodes_;
 	// index of the result in workspace, can be reused
 	int result_idx_;
+	// index of the node in its NodePool
+	uint node_idx_;
 
 	unsigned char op_code_;
-	std::string op_name_;
+	const char * op_name_;
 	// Pointer to (user provided) vector of values.
-	double * values_;
+	// Values are double or float according to the precision of the processor.
+	void * values_;
+	// Value of the constant nodes, values_ points here.
+	double value_;
+	// Pointer to data passed to the value copy node, copied to values_ by the Processor.
+	void * source_ptr_;
+	// Distance of consecutive values of the value nodes, see _gather_.
+	uint stride_;
+	// Value nodes of the 16-bit values, read by the _load_fp16_ or _load_bf16_ operation only.
+	bool half_;
+	// Constant table of 'table_size_' values: the interpolation breakpoints followed by the values (_interp_),
+	// the polynomial coefficients (_polyval_).
+	const double * table_;
+	uint table_size_;
 
 	/**
 	 * Factory functions fro special nodes.
@@ -70,11 +117,16 @@ struct ScalarNode {
 	inline static ScalarNodePtr create_zero();
 	inline static ScalarNodePtr create_one();
 	inline static ScalarNodePtr create_const(double a);
+	inline static ScalarNodePtr create_shared_const(double a);
 	inline static ScalarNodePtr create_const_bool(double a);
-	inline static ScalarNodePtr create_value(double *a);
-	inline static ScalarNodePtr create_val_copy(double *a);
-	inline static ScalarNodePtr create_result(ScalarNodePtr result, double *a);
+	inline static ScalarNodePtr create_value(void *a);
+	inline static ScalarNodePtr create_val_copy(void *a);
+	inline static ScalarNodePtr create_result(ScalarNodePtr result, void *a);
+	inline static ScalarNodePtr create_packed_result(ScalarNodePtr result, void *bits);
 	inline static ScalarNodePtr create_ifelse(ScalarNodePtr a, ScalarNodePtr b, ScalarNodePtr c);
+	inline static ScalarNodePtr create_interp(ScalarNodePtr x, const double *table, uint table_size);
+	inline static ScalarNodePtr create_polyval(ScalarNodePtr x, const double *coeffs, uint n_coeffs);
+	inline static ScalarNodePtr create_native(unsigned char op_code, const char *op_name, uint n_inputs, const ScalarNodePtr *inputs);
 
 	/**
 	 * Generic factory functions for operation nodes.
@@ -91,16 +143,21 @@ struct ScalarNode {
 	ScalarNode()
 	: result_storage(temporary),
 	  n_inputs_(0),
+	  inputs_{nullptr, nullptr, nullptr},
 	  n_dep_nodes_(0),
 	  result_idx_(-1),
+	  node_idx_(0),
 	  op_code_((unsigned char)0xff),
 	  op_name_("none"),
-	  values_(nullptr)
+	  values_(nullptr),
+	  value_(0.0),
+	  source_ptr_(nullptr),
+	  stride_(1),
+	  half_(false),
+	  table_(nullptr),
+	  table_size_(0)
 	{}
 
-	virtual ~ScalarNode() {
-	}
-
 	void add_input(ScalarNodePtr  in)
 	{
 		BP_ASSERT(n_inputs_ < 3);
@@ -108,98 +165,102 @@ struct ScalarNode {
 		n_inputs_+=1;
 	}
 
-	double * get_value() {
+	void * get_value() {
 		BP_ASSERT(values_ != nullptr);
 		return values_;
 	}
 
-	void set_name(std::string str) {
-		uint a = str.find_first_of('_')+1;
-		uint b = str.find_last_of('_');
-		op_name_ = str.substr(a, b-a);
-	}
-
-
 };
 
 
+/**
+ * Storage of the ScalarNodes.
+ *
+ * Nodes are allocated in fixed size chunks, so their addresses are stable and each node
+ * is also identified by its index in the pool (ScalarNode::node_idx_). There is no reference
+ * counting, all nodes are released together with the pool.
+ *
+ * The nodes are created in the current pool of the thread. That is the global pool
+ * unless a NodePool::Scope is active, the Parser use it to keep nodes of
+ * its expression in its own pool.
+ */
+class NodePool {
+public:
+	static const uint chunk_size = 1024;
+
+	/// Makes 'pool' the current pool of the thread until the end of the scope.
+	struct Scope {
+		Scope(NodePool &pool)
+		: previous_(current_ptr())
+		{
+			current_ptr() = &pool;
+		}
+
+		~Scope() {
+			current_ptr() = previous_;
+		}
+
+		NodePool * previous_;
+	};
+
+	NodePool()
+	: size_(0)
+	{}
 
+	NodePool(const NodePool &) = delete;
+	NodePool &operator=(const NodePool &) = delete;
 
-struct ConstantNode : public ScalarNode {
-	ConstantNode(double v)
-	: value_(v)
-	{
-		op_name_ = "Const";
-		values_ = &value_;
-		result_storage = constant;
+	~NodePool() {
+		for(ScalarNode * chunk : chunks_)
+			::operator delete(chunk);
 	}
 
-	~ConstantNode() override {
+	/// Pool for the nodes shared by all expressions, never released.
+	static NodePool &global() {
+		static NodePool pool;
+		return pool;
 	}
 
-	double value_;
-};
-
-
-
-struct ConstantBoolNode : public ScalarNode {
-	ConstantBoolNode(double v)
-	: value_(v)
-	{
-		op_name_ = "ConstBool";
-		values_ = &value_;
-		result_storage = constant_bool;
+	static NodePool &current() {
+		NodePool * pool = current_ptr();
+		return (pool == nullptr) ? global() : *pool;
 	}
 
-	~ConstantBoolNode() override {
+	ScalarNodePtr create() {
+		if (size_ == chunks_.size() * chunk_size)
+			chunks_.push_back( (ScalarNode *) ::operator new(sizeof(ScalarNode) * chunk_size) );
+		ScalarNodePtr node = new (chunks_.back() + size_ % chunk_size) ScalarNode();
+		node->node_idx_ = size_++;
+		return node;
 	}
 
-	double value_;
-};
-
-
-struct ValueNode : public ScalarNode {
-	ValueNode(double *ptr)
-	{
-		op_name_ = "Value";
-		values_ = ptr;
-		result_storage = value;
+	ScalarNode &operator[](uint i) {
+		BP_ASSERT(i < size_);
+		return chunks_[i / chunk_size][i % chunk_size];
 	}
 
-	~ValueNode() override {
+	uint size() const {
+		return size_;
 	}
 
-};
-
-
-struct ValueCopyNode : public ScalarNode {
-	ValueCopyNode(double *ptr)
-	{
-		op_name_ = "ValueCopy";
-		source_ptr_ = ptr;
-		result_storage = value_copy;
-		values_ = nullptr;
+	/// Copy of 'values' owned by the pool, e.g. the table of the _interp_ node.
+	const double * create_table(const std::vector<double> &values) {
+		tables_.push_back(values);
+		return tables_.back().data();
 	}
 
-	~ValueCopyNode() override {
+private:
+	static NodePool *&current_ptr() {
+		static thread_local NodePool * pool = nullptr;
+		return pool;
 	}
 
-	double * source_ptr_;               ///< Pointer to data passed in constructor
+	std::vector<ScalarNode *> chunks_;
+	uint size_;
+	std::deque<std::vector<double>> tables_;
 };
 
 
-struct ResultNode : public ScalarNode {
-	ResultNode(ScalarNodePtr result_node, double *storage)
-	{
-		op_name_ = "Result";
-		values_ = storage;
-		ScalarNode::add_input(result_node);
-		result_storage = expr_result; // use slot of the result of value, i.e. inputs[0]
-	}
-};
-
-
-
 
 /***********************
  * Operation Nodes.
@@ -227,6 +288,26 @@ struct b_to_d<Vec8db> {
     typedef Vec8d double_type;
 };
 
+template<>
+struct b_to_d<int32_t> {
+    typedef float double_type;
+};
+
+template<>
+struct b_to_d<Vec4fb> {
+    typedef Vec4f double_type;
+};
+
+template<>
+struct b_to_d<Vec8fb> {
+    typedef Vec8f double_type;
+};
+
+template<>
+struct b_to_d<Vec16fb> {
+    typedef Vec16f double_type;
+};
+
 template<typename bool_type> union b_to_d_mask;
 
 template<>
@@ -253,6 +334,30 @@ union b_to_d_mask<Vec8db> {
 	Vec8d  value;
 };
 
+template<>
+union b_to_d_mask<int32_t> {
+	int32_t	mask;
+	float  value;
+};
+
+template<>
+union b_to_d_mask<Vec4fb> {
+	Vec4fb	mask;
+	Vec4f  value;
+};
+
+template<>
+union b_to_d_mask<Vec8fb> {
+	Vec8fb	mask;
+	Vec8f  value;
+};
+
+template<>
+union b_to_d_mask<Vec16fb> {
+	Vec16fb	mask;
+	Vec16f  value;
+};
+
 
 template<typename bool_type>
 inline typename b_to_d<bool_type>::double_type as_double(bool_type in) {
@@ -283,6 +388,26 @@ struct d_to_b<Vec8d> {
     typedef Vec8db bool_type;
 };
 
+template<>
+struct d_to_b<float> {
+    typedef int32_t bool_type;
+};
+
+template<>
+struct d_to_b<Vec4f> {
+    typedef Vec4fb bool_type;
+};
+
+template<>
+struct d_to_b<Vec8f> {
+    typedef Vec8fb bool_type;
+};
+
+template<>
+struct d_to_b<Vec16f> {
+    typedef Vec16fb bool_type;
+};
+
 template<typename double_type> union d_to_b_mask;
 
 template<>
@@ -309,6 +434,30 @@ union d_to_b_mask<Vec8d> {
 	Vec8db	mask;
 };
 
+template<>
+union d_to_b_mask<float> {
+	float  value;
+	int32_t	mask;
+};
+
+template<>
+union d_to_b_mask<Vec4f> {
+	Vec4f  value;
+	Vec4fb	mask;
+};
+
+template<>
+union d_to_b_mask<Vec8f> {
+	Vec8f  value;
+	Vec8fb	mask;
+};
+
+template<>
+union d_to_b_mask<Vec16f> {
+	Vec16f  value;
+	Vec16fb	mask;
+};
+
 
 template<typename double_type>
 inline typename d_to_b<double_type>::bool_type as_bool(double_type in) {
@@ -316,6 +465,20 @@ inline typename d_to_b<double_type>::bool_type as_bool(double_type in) {
     return x.mask;
 }
 
+
+/**
+ * Type of the single element of the SIMD vector type VecType.
+ */
+template <typename VecType>
+struct ScalarType {
+	typedef double type;
+};
+
+template <> struct ScalarType<float> { typedef float type; };
+template <> struct ScalarType<Vec4f> { typedef float type; };
+template <> struct ScalarType<Vec8f> { typedef float type; };
+template <> struct ScalarType<Vec16f> { typedef float type; };
+
 // previous functions
 
 // union MaskDouble {
@@ -400,6 +563,11 @@ double get_true_value<double>()
 {
 	return double_true();
 }
+template<>
+float get_true_value<float>()
+{
+	return as_double(-int32_t(true));
+}
 
 
 template<typename T>
@@ -415,6 +583,11 @@ double get_false_value<double>()
 {
 	return double_false();
 }
+template<>
+float get_false_value<float>()
+{
+	return as_double(int32_t(false));
+}
 
 
 /***
@@ -728,42 +901,149 @@ inline void _ifelse_::eval<double>(double &res, double a, double b, double c) {
 }
 UNARY_FN(_log2_, 	52, log2);
 
+// Load of the strided (e.g. interleaved) values of the input value node into the temporary.
+// The element stride of the input is passed in the Operation::arg[2], see EvalImpl<2, _gather_, VecType>.
+struct _gather_ : public ScalarNode {
+	static const char op_code = 53;
+	static const char n_eval_args = 2;
+	static constexpr uint max_stride = 255;
+};
+
+// Piecewise linear interpolation in the constant table of the node, see Array::interp.
+// The index of the processor table is passed in the Operation::arg[2], see EvalImpl<2, _interp_, VecType>.
+struct _interp_ : public ScalarNode {
+	static const char op_code = 54;
+	static const char n_eval_args = 2;
+};
+
+// Polynomial with the constant coefficients of the node, highest power first, see Array::polyval.
+// The index of the processor coefficients is passed in the Operation::arg[2], see EvalImpl<2, _polyval_, VecType>.
+struct _polyval_ : public ScalarNode {
+	static const char op_code = 55;
+	static const char n_eval_args = 2;
+	// Longest polynomial, also the largest degree recognized in the expressions, see fuse_polynomials.
+	static constexpr uint max_coeffs = 17;
+};
+
+// Boolean result written as the packed bits, one per element, see Parser::set_packed_result.
+// Evaluated by EvalImpl<2, _pack_, VecType>.
+struct _pack_ : public ScalarNode {
+	static const char op_code = 56;
+	static const char n_eval_args = 2;
+};
+
+// Load of the IEEE binary16 values of the input value node into the temporary, converted to the processor
+// precision in the registers, see Array::half_value and EvalImpl<2, _load_fp16_, VecType>.
+struct _load_fp16_ : public ScalarNode {
+	static const char op_code = 57;
+	static const char n_eval_args = 2;
+};
+
+// Load of the bfloat16 values of the input value node, see _load_fp16_.
+struct _load_bf16_ : public ScalarNode {
+	static const char op_code = 58;
+	static const char n_eval_args = 2;
+};
+
+
+/**
+ * The operation results in the boolean mask: comparisons, logical operations, isnan and isinf.
+ */
+constexpr bool is_bool_op(unsigned char op_code) {
+	switch (op_code) {
+	case _eq_::op_code:
+	case _ne_::op_code:
+	case _lt_::op_code:
+	case _le_::op_code:
+	case _neg_::op_code:
+	case _or_::op_code:
+	case _and_::op_code:
+	case _isnan_::op_code:
+	case _isinf_::op_code:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * The input 'i' of the operation is used only as the boolean mask, so it can be read
+ * from the packed boolean temporary (see ExpressionDAG::bool_temp_end).
+ */
+constexpr bool is_bool_input(unsigned char op_code, uint i) {
+	switch (op_code) {
+	case _neg_::op_code:
+	case _or_::op_code:
+	case _and_::op_code:
+	case _pack_::op_code:
+		return true;
+	case _ifelse_::op_code:
+		return i == 1;
+	default:
+		return false;
+	}
+}
+
 
 /***********************
  * Construction Nodes.
  */
 
 ScalarNodePtr ScalarNode::create_zero() {
-	static ScalarNodePtr zero = std::make_shared<ConstantNode>(0.0);
+	static ScalarNodePtr zero = create_shared_const(0.0);
 	return zero;
 }
 
 ScalarNodePtr ScalarNode::create_one() {
-	static ScalarNodePtr one = std::make_shared<ConstantNode>(1.0);
+	static ScalarNodePtr one = create_shared_const(1.0);
 	return one;
 }
 
+// Constant node in the global pool, can be kept in static variables.
+inline ScalarNodePtr ScalarNode::create_shared_const(double a) {
+	NodePool::Scope global_scope(NodePool::global());
+	return create_const(a);
+}
+
 
 inline ScalarNodePtr ScalarNode::create_const(double a) {
-	return std::make_shared<ConstantNode>(a);
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_name_ = "Const";
+	node_ptr->value_ = a;
+	node_ptr->values_ = &node_ptr->value_;
+	node_ptr->result_storage = constant;
+	return node_ptr;
 }
 
 inline ScalarNodePtr ScalarNode::create_const_bool(double a) {
-	return std::make_shared<ConstantBoolNode>(a);
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_name_ = "ConstBool";
+	node_ptr->value_ = a;
+	node_ptr->values_ = &node_ptr->value_;
+	node_ptr->result_storage = constant_bool;
+	return node_ptr;
 }
 
 // create value node
-inline ScalarNodePtr ScalarNode::create_value(double *a)  {
-	return std::make_shared<ValueNode>(a);
+inline ScalarNodePtr ScalarNode::create_value(void *a)  {
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_name_ = "Value";
+	node_ptr->values_ = a;
+	node_ptr->result_storage = value;
+	return node_ptr;
 }
 
 // create value node
-inline ScalarNodePtr ScalarNode::create_val_copy(double *a)  {
-	return std::make_shared<ValueCopyNode>(a);
+inline ScalarNodePtr ScalarNode::create_val_copy(void *a)  {
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_name_ = "ValueCopy";
+	node_ptr->source_ptr_ = a;
+	node_ptr->result_storage = value_copy;
+	return node_ptr;
 }
 
 // create result node
-inline ScalarNodePtr ScalarNode::create_result(ScalarNodePtr result, double *a)  {
+inline ScalarNodePtr ScalarNode::create_result(ScalarNodePtr result, void *a)  {
 	BP_ASSERT(result->result_storage != none);
 	if (result->result_storage != temporary) {
 		result = ScalarNode::create<_copy_>(result);
@@ -773,11 +1053,23 @@ inline ScalarNodePtr ScalarNode::create_result(ScalarNodePtr result, double *a)
 	return result;
 }
 
+// create the packed boolean result node, see _pack_
+inline ScalarNodePtr ScalarNode::create_packed_result(ScalarNodePtr result, void *bits)  {
+	BP_ASSERT(result->result_storage != none);
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_code_ = _pack_::op_code;
+	node_ptr->op_name_ = op_name<_pack_>();
+	node_ptr->add_input(result);
+	node_ptr->values_ = bits;
+	node_ptr->result_storage = expr_result;
+	return node_ptr;
+}
+
 template <class T>
 ScalarNodePtr ScalarNode::create(ScalarNodePtr a) {
-	std::shared_ptr<T> node_ptr = std::make_shared<T>();
+	ScalarNodePtr node_ptr = NodePool::current().create();
 	node_ptr->op_code_ = T::op_code;
-	node_ptr->set_name(typeid(T).name());
+	node_ptr->op_name_ = op_name<T>();
 	node_ptr->add_input(a);
 	if (T::n_eval_args == 1) {
 		// Note: in place operations are not supported
@@ -792,9 +1084,9 @@ ScalarNodePtr ScalarNode::create(ScalarNodePtr a) {
 
 template <class T>
 ScalarNodePtr ScalarNode::create(ScalarNodePtr a, ScalarNodePtr b) {
-	std::shared_ptr<T> node_ptr = std::make_shared<T>();
+	ScalarNodePtr node_ptr = NodePool::current().create();
 	node_ptr->op_code_ = T::op_code;
-	node_ptr->set_name(typeid(T).name());
+	node_ptr->op_name_ = op_name<T>();
 	node_ptr->add_input(a);
 	node_ptr->add_input(b);
 	if (T::n_eval_args == 2) {
@@ -809,9 +1101,9 @@ ScalarNodePtr ScalarNode::create(ScalarNodePtr a, ScalarNodePtr b) {
 }
 
 inline ScalarNodePtr  ScalarNode::create_ifelse(ScalarNodePtr a, ScalarNodePtr b, ScalarNodePtr c)  {
-	std::shared_ptr<_ifelse_> node_ptr = std::make_shared<_ifelse_>();
+	ScalarNodePtr node_ptr = NodePool::current().create();
 	node_ptr->op_code_ = _ifelse_::op_code;
-	node_ptr->set_name(typeid(_ifelse_).name());
+	node_ptr->op_name_ = op_name<_ifelse_>();
 	node_ptr->add_input(a);
 	node_ptr->add_input(b);
 	node_ptr->add_input(c);
@@ -821,6 +1113,44 @@ inline ScalarNodePtr  ScalarNode::create_ifelse(ScalarNodePtr a, ScalarNodePtr b
 	return node_ptr;
 }
 
+inline ScalarNodePtr  ScalarNode::create_interp(ScalarNodePtr x, const double *table, uint table_size)  {
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_code_ = _interp_::op_code;
+	node_ptr->op_name_ = op_name<_interp_>();
+	node_ptr->add_input(x);
+	node_ptr->table_ = table;
+	node_ptr->table_size_ = table_size;
+	node_ptr->result_storage = temporary;
+
+	return node_ptr;
+}
+
+inline ScalarNodePtr  ScalarNode::create_polyval(ScalarNodePtr x, const double *coeffs, uint n_coeffs)  {
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_code_ = _polyval_::op_code;
+	node_ptr->op_name_ = op_name<_polyval_>();
+	node_ptr->add_input(x);
+	node_ptr->table_ = coeffs;
+	node_ptr->table_size_ = n_coeffs;
+	node_ptr->result_storage = temporary;
+
+	return node_ptr;
+}
+
+/**
+ * Node of the registered function, see register_function.
+ */
+inline ScalarNodePtr  ScalarNode::create_native(unsigned char op_code, const char *op_name, uint n_inputs, const ScalarNodePtr *inputs)  {
+	ScalarNodePtr node_ptr = NodePool::current().create();
+	node_ptr->op_code_ = op_code;
+	node_ptr->op_name_ = op_name;
+	for(uint i=0; i < n_inputs; ++i)
+		node_ptr->add_input(inputs[i]);
+	node_ptr->result_storage = temporary;
+
+	return node_ptr;
+}
+
 
 
 } // namespace details
@@ -0,0 +1,272 @@
+/*
+ * stream.hh
+ *
+ * Evaluation of an expression over datasets larger than the parser vector size.
+ * Inputs are pulled chunk by chunk from the source callbacks (or binary files),
+ * results are pushed to the sink callback.
+ */
+
+#ifndef INCLUDE_STREAM_HH_
+#define INCLUDE_STREAM_HH_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include "config.hh"
+#include "assert.hh"
+#include "arena_alloc.hh"
+#include "parser.hh"
+
+namespace bparser {
+
+
+/**
+ * Values of the elements [begin, begin + n) of a streamed variable,
+ * component 'k' of the element 'begin + i' is data[k * stride + i].
+ */
+template <class T>
+struct StreamChunk {
+	std::size_t begin;
+	uint n;
+	uint n_comp;
+	T * data;
+	uint stride;
+};
+
+
+struct StreamStats {
+	std::size_t n_values;
+	std::size_t n_chunks;
+	// Bytes read from the sources and written to the sink.
+	std::size_t bytes_read;
+	std::size_t bytes_written;
+	// Evaluation time, without compilation.
+	double time;
+
+	double bandwidth() const {
+		return (bytes_read + bytes_written) / time;
+	}
+};
+
+
+/**
+ * Streaming evaluation of an expression, T is double or float.
+ *
+ * Two processors are compiled for two sets of chunk buffers. While the chunk
+ * in one set is evaluated, a worker thread writes the results of the previous chunk
+ * from the other set to the sink and fills the other set by the next chunk.
+ *
+ *     Stream<double> s("a * b + 1", 1 << 16);
+ *     s.set_source("a", {}, Stream<double>::array_source(a, n));
+ *     s.set_source("b", {3}, Stream<double>::file_source("b.bin", n));
+ *     s.set_sink({3}, Stream<double>::array_sink(res, n));
+ *     StreamStats stats = s.run(n);
+ */
+template <class T>
+class Stream {
+public:
+	typedef std::function<void(const StreamChunk<T> &)> Source;
+	typedef std::function<void(const StreamChunk<const T> &)> Sink;
+
+	static constexpr Precision precision = std::is_same<T, float>::value ? single_precision : double_precision;
+
+	/**
+	 * 'chunk_size' number of elements evaluated at once, rounded up to the SIMD block size.
+	 * Single buffering (no worker thread) if 'double_buffer' is false, default on single core machines.
+	 */
+	Stream(std::string expr, uint chunk_size, bool double_buffer = (std::thread::hardware_concurrency() > 1))
+	: expr_(expr),
+	  chunk_size_(align_size(get_simd_size(get_simd_size(), precision), chunk_size)),
+	  double_buffer_(double_buffer),
+	  fast_math_(false)
+	{}
+
+	void set_source(std::string name, Shape shape, Source source) {
+		sources_.push_back({name, shape, shape_size(shape), source});
+	}
+
+	void set_sink(Shape shape, Sink sink) {
+		sink_ = {"_result_", shape, shape_size(shape), nullptr};
+		result_sink_ = sink;
+	}
+
+	/// See Parser::set_fast_math.
+	void set_fast_math(bool fast_math) {
+		fast_math_ = fast_math;
+	}
+
+	/// Evaluate the first 'n_total' elements.
+	StreamStats run(std::size_t n_total) {
+		if (! result_sink_)
+			Throw() << "Stream: no sink set.\n";
+		uint n_slots = double_buffer_ ? 2 : 1;
+		for(uint i=0; i < n_slots; ++i) slots_[i] = create_slot();
+		auto start_time = std::chrono::high_resolution_clock::now();
+
+		std::size_t n_chunks = (n_total + chunk_size_ - 1) / chunk_size_;
+		StreamStats stats = {n_total, n_chunks, 0, 0, 0.0};
+		for(const Column &src : sources_) stats.bytes_read += n_total * src.n_comp * sizeof(T);
+		stats.bytes_written = n_total * sink_.n_comp * sizeof(T);
+
+		if (n_chunks > 0) load(*slots_[0], 0, n_total);
+		std::future<void> pending;
+		for(std::size_t i_chunk=0; i_chunk < n_chunks; ++i_chunk) {
+			Slot &slot = *slots_[i_chunk % n_slots];
+			if (pending.valid()) pending.get();
+			if (double_buffer_) {
+				Slot &other = *slots_[(i_chunk + 1) % n_slots];
+				pending = std::async(std::launch::async, [this, &other, i_chunk, n_chunks, n_total]() {
+					if (i_chunk > 0) store(other, i_chunk - 1, n_total);
+					if (i_chunk + 1 < n_chunks) load(other, i_chunk + 1, n_total);
+				});
+			}
+			slot.parser->set_subset(&(block_subset_[0]), slot.n_blocks);
+			slot.parser->run();
+			if (! double_buffer_) {
+				store(slot, i_chunk, n_total);
+				if (i_chunk + 1 < n_chunks) load(slot, i_chunk + 1, n_total);
+			}
+		}
+		if (pending.valid()) pending.get();
+		if (double_buffer_ && n_chunks > 0) store(*slots_[(n_chunks - 1) % n_slots], n_chunks - 1, n_total);
+
+		auto end_time = std::chrono::high_resolution_clock::now();
+		stats.time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+		return stats;
+	}
+
+	uint chunk_size() const {
+		return chunk_size_;
+	}
+
+	/// Source of the component-major array: component 'k' of the element 'i' is data[k * n_total + i].
+	static Source array_source(const T *data, std::size_t n_total) {
+		return [data, n_total](const StreamChunk<T> &chunk) {
+			for(uint k=0; k < chunk.n_comp; ++k)
+				std::copy(data + k * n_total + chunk.begin, data + k * n_total + chunk.begin + chunk.n,
+						chunk.data + k * chunk.stride);
+		};
+	}
+
+	/// Sink to the component-major array, see array_source.
+	static Sink array_sink(T *data, std::size_t n_total) {
+		return [data, n_total](const StreamChunk<const T> &chunk) {
+			for(uint k=0; k < chunk.n_comp; ++k)
+				std::copy(chunk.data + k * chunk.stride, chunk.data + k * chunk.stride + chunk.n,
+						data + k * n_total + chunk.begin);
+		};
+	}
+
+	/// Source of the raw binary file with component-major array, see array_source.
+	static Source file_source(std::string path, std::size_t n_total) {
+		auto fd = open_file(path, O_RDONLY);
+		return [fd, path, n_total](const StreamChunk<T> &chunk) {
+			for(uint k=0; k < chunk.n_comp; ++k) {
+				std::size_t bytes = chunk.n * sizeof(T);
+				off_t offset = (k * n_total + chunk.begin) * sizeof(T);
+				if (pread(*fd, chunk.data + k * chunk.stride, bytes, offset) != ssize_t(bytes))
+					Throw() << "Stream: can not read " << bytes << " bytes at " << offset << " from '" << path << "'.\n";
+			}
+		};
+	}
+
+	/// Sink to the raw binary file with component-major array, see array_source.
+	static Sink file_sink(std::string path, std::size_t n_total) {
+		auto fd = open_file(path, O_WRONLY | O_CREAT | O_TRUNC);
+		return [fd, path, n_total](const StreamChunk<const T> &chunk) {
+			for(uint k=0; k < chunk.n_comp; ++k) {
+				std::size_t bytes = chunk.n * sizeof(T);
+				off_t offset = (k * n_total + chunk.begin) * sizeof(T);
+				if (pwrite(*fd, chunk.data + k * chunk.stride, bytes, offset) != ssize_t(bytes))
+					Throw() << "Stream: can not write " << bytes << " bytes at " << offset << " to '" << path << "'.\n";
+			}
+		};
+	}
+
+private:
+	struct Column {
+		std::string name;
+		Shape shape;
+		uint n_comp;
+		Source source;
+	};
+
+	/// Compiled parser with its chunk buffers.
+	struct Slot {
+		std::shared_ptr<ArenaAlloc> arena;
+		std::shared_ptr<Parser> parser;
+		std::vector<T *> buffers;
+		T * result;
+		uint n_blocks;
+	};
+
+	static std::shared_ptr<int> open_file(const std::string &path, int flags) {
+		int fd = open(path.c_str(), flags, 0644);
+		if (fd < 0)
+			Throw() << "Stream: can not open file '" << path << "'.\n";
+		return std::shared_ptr<int>(new int(fd), [](int *p) { close(*p); delete p; });
+	}
+
+	std::shared_ptr<Slot> create_slot() {
+		auto slot = std::make_shared<Slot>();
+		uint n_buffer_values = sink_.n_comp;
+		for(const Column &src : sources_) n_buffer_values += src.n_comp;
+		slot->arena = std::make_shared<ArenaAlloc>(64, sizeof(T) * chunk_size_ * n_buffer_values);
+		slot->parser = std::make_shared<Parser>(chunk_size_, precision);
+		slot->parser->parse(expr_);
+		for(const Column &src : sources_) {
+			T * buffer = slot->arena->template create_array<T>(chunk_size_ * src.n_comp);
+			std::fill(buffer, buffer + chunk_size_ * src.n_comp, T(0));
+			slot->buffers.push_back(buffer);
+			slot->parser->set_variable(src.name, src.shape, buffer);
+		}
+		slot->result = slot->arena->template create_array<T>(chunk_size_ * sink_.n_comp);
+		slot->parser->set_variable("_result_", sink_.shape, slot->result);
+		slot->parser->set_fast_math(fast_math_);
+		slot->parser->compile();
+		slot->n_blocks = 0;
+
+		uint max_blocks = chunk_size_ / slot->parser->simd_block_size();
+		block_subset_.resize(max_blocks);
+		for(uint i=0; i < max_blocks; ++i) block_subset_[i] = i;
+		return slot;
+	}
+
+	void load(Slot &slot, std::size_t i_chunk, std::size_t n_total) {
+		std::size_t begin = i_chunk * chunk_size_;
+		uint n = std::min(std::size_t(chunk_size_), n_total - begin);
+		for(uint i=0; i < sources_.size(); ++i) {
+			const Column &src = sources_[i];
+			src.source({begin, n, src.n_comp, slot.buffers[i], chunk_size_});
+		}
+		uint block = slot.parser->simd_block_size();
+		slot.n_blocks = (n + block - 1) / block;
+	}
+
+	void store(Slot &slot, std::size_t i_chunk, std::size_t n_total) {
+		std::size_t begin = i_chunk * chunk_size_;
+		uint n = std::min(std::size_t(chunk_size_), n_total - begin);
+		result_sink_({begin, n, sink_.n_comp, slot.result, chunk_size_});
+	}
+
+	std::string expr_;
+	uint chunk_size_;
+	bool double_buffer_;
+	bool fast_math_;
+	std::vector<Column> sources_;
+	Column sink_;
+	Sink result_sink_;
+	std::shared_ptr<Slot> slots_[2];
+	std::vector<uint> block_subset_;
+};
+
+
+} // namespace bparser
+
+#endif /* INCLUDE_STREAM_HH_ */
@@ -11,6 +11,8 @@
 
 #include "assert.hh"
 #include <vector>
+#include <cstring>
+#include <cstdint>
 
 
 #define ASSERT_THROW(expression, msg) {				            \
@@ -87,6 +89,46 @@ std::string print_vector(std::vector<T> x) {
 }
 
 
+/**
+ * Expression of the piecewise linear interpolation of 'x' in the table 'xp', 'fp' by the chain of ifelse,
+ * equivalent to 'interp(x, xp, fp)'.
+ */
+inline std::string interp_chain(std::string x, const std::vector<double> &xp, const std::vector<double> &fp) {
+	std::stringstream s;
+	s.precision(17);
+	uint n = xp.size();
+	s << "(" << fp[0] << ") if " << x << " < (" << xp[0] << ") else (";
+	for(uint k=0; k + 1 < n; ++k) {
+		double slope = (fp[k + 1] - fp[k]) / (xp[k + 1] - xp[k]);
+		s << "(" << fp[k] << ") + (" << slope << ") * (" << x << " - (" << xp[k] << ")) if "
+		  << x << " < (" << xp[k + 1] << ") else (";
+	}
+	s << "(" << fp[n - 1] << ")";
+	for(uint k=0; k < n; ++k) s << ")";
+	return s.str();
+}
+
+
+/**
+ * Bits of 'x' in the IEEE binary16 format, 'x' must be zero or a normal half precision number
+ * (the mantissa is truncated).
+ */
+inline uint16_t to_fp16(float x) {
+	uint32_t b;
+	memcpy(&b, &x, sizeof(b));
+	uint16_t sign = (b >> 16) & 0x8000;
+	if ((b & 0x7fffffff) == 0) return sign;
+	return sign | ((((b >> 23) & 0xff) - 112) << 10) | ((b >> 13) & 0x3ff);
+}
+
+/// Bits of 'x' in the bfloat16 format, the mantissa is truncated.
+inline uint16_t to_bf16(float x) {
+	uint32_t b;
+	memcpy(&b, &x, sizeof(b));
+	return b >> 16;
+}
+
+
 template<typename VecType>
 static void print_VCL_vector(const VecType & v, const char * prefix);
 
@@ -0,0 +1,188 @@
+/*
+ * tuner.hh
+ *
+ * Selection of the processor strategy by timing the candidates on the compiled expression
+ * (see Parser::set_tuning). Decisions are stored in a text calibration file keyed by the CPU model
+ * and the expression hash, so the later compilations skip the timing.
+ */
+
+#ifndef INCLUDE_TUNER_HH_
+#define INCLUDE_TUNER_HH_
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include "config.hh"
+#include "assert.hh"
+#include "processor.hh"
+#include "expression_dag.hh"
+
+namespace bparser {
+
+
+/// FNV-1a hash of the string.
+inline uint64_t hash_string(const std::string &str) {
+	uint64_t h = 14695981039346656037ull;
+	for(char c : str) {
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+
+/// CPU model name from /proc/cpuinfo, "unknown" if not available.
+inline std::string cpu_model() {
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(cpuinfo, line)) {
+		if (line.compare(0, 10, "model name") == 0) {
+			std::size_t colon = line.find(':');
+			if (colon != std::string::npos)
+				return line.substr(std::min(line.size(), colon + 2));
+		}
+	}
+	return "unknown";
+}
+
+
+/**
+ * Hash of the compiled program: the sorted nodes with their storage and layout,
+ * the vector size, SIMD size and the options not subject to the tuning.
+ */
+inline uint64_t expression_hash(details::ExpressionDAG &se, uint vector_size, uint simd_size, const ProcessorOptions &options) {
+	std::stringstream ss;
+	ss << vector_size << " " << simd_size << " " << options.precision << " " << options.fast_math
+	   << " " << options.nt_stores << " " << options.packed_masks << ";";
+	for(ScalarNodePtr node : se.sort_nodes()) {
+		ss << node->op_name_ << " " << (int)node->result_storage << " " << node->result_idx_ << " " << node->stride_;
+		for(uint j=0; j < node->n_inputs_; ++j) ss << " " << node->inputs_[j]->result_idx_;
+		if (node->result_storage == details::constant) ss << " " << node->value_;
+		for(uint j=0; j < node->table_size_; ++j) ss << " " << node->table_[j];
+		ss << ";";
+	}
+	return hash_string(ss.str());
+}
+
+
+/**
+ * Text file of the tuning decisions, one line per decision:
+ *
+ *     cpu_hash expression_hash program_order max_temp_blocks ns_per_run
+ *
+ * Hashes in hexadecimal. The last line of the given key wins, new decisions are appended.
+ */
+class CalibrationFile {
+public:
+	CalibrationFile(std::string path)
+	: path_(path)
+	{}
+
+	/// Set the tuned fields of 'options' by the stored decision, false if there is none.
+	bool find(uint64_t cpu_hash, uint64_t expr_hash, ProcessorOptions &options) const {
+		std::ifstream in(path_);
+		std::string line;
+		bool found = false;
+		while (std::getline(in, line)) {
+			std::istringstream is(line);
+			uint64_t cpu, expr;
+			int order;
+			uint max_temp_blocks;
+			if (! (is >> std::hex >> cpu >> expr >> std::dec >> order >> max_temp_blocks)) continue;
+			if (cpu != cpu_hash || expr != expr_hash) continue;
+			options.program_order = ProgramOrder(order);
+			options.max_temp_blocks = max_temp_blocks;
+			found = true;
+		}
+		return found;
+	}
+
+	void add(uint64_t cpu_hash, uint64_t expr_hash, const ProcessorOptions &options, double time) {
+		std::ofstream out(path_, std::ios::app);
+		if (! out)
+			Throw() << "Can not write the calibration file '" << path_ << "'.\n";
+		out << std::hex << cpu_hash << " " << expr_hash << std::dec << " " << int(options.program_order)
+			<< " " << options.max_temp_blocks << " " << 1e9 * time << "\n";
+	}
+
+private:
+	std::string path_;
+};
+
+
+/**
+ * Candidate strategies: op-major order with the full and tiled temporaries (tile sizes
+ * 'tile_blocks' smaller than the vector), element-major order. Other options are taken from 'base',
+ * the subset mode is left to the run time, as it depends on the subset.
+ */
+inline std::vector<ProcessorOptions> tuning_candidates(const ProcessorOptions &base, uint vec_n_blocks) {
+	std::vector<ProcessorOptions> candidates;
+	const uint tile_blocks[] = {0, 16, 64, 256};
+	for(uint max_temp_blocks : tile_blocks) {
+		if (max_temp_blocks >= vec_n_blocks) continue;
+		ProcessorOptions options = base;
+		options.program_order = op_major;
+		options.max_temp_blocks = max_temp_blocks;
+		candidates.push_back(options);
+	}
+	ProcessorOptions options = base;
+	options.program_order = element_major;
+	options.max_temp_blocks = 0;
+	candidates.push_back(options);
+	return candidates;
+}
+
+
+/**
+ * Time per run() of the processor with 'options' over the full vector of 'n_blocks' SIMD blocks,
+ * minimum of three batches of about 'n_block_ops' block operations. The program is run over
+ * the actual variables, the results are overwritten.
+ */
+inline double time_candidate(details::ExpressionDAG &se, uint vector_size, uint simd_size, uint n_blocks,
+		const ProcessorOptions &options, uint n_block_ops = 1 << 16) {
+	typedef std::chrono::high_resolution_clock Clock;
+	ProcessorBase * processor = ProcessorBase::create_processor(se, vector_size, simd_size, nullptr, options);
+	// keeps the memory of the processor until its destruction
+	ArenaAllocPtr arena = processor->get_arena();
+	uint * subset = processor->subset_buffer();
+	for(uint i=0; i < n_blocks; ++i) subset[i] = i;
+	processor->set_subset(subset, n_blocks);
+	processor->run();
+
+	uint n_runs = std::max(1u, n_block_ops / (n_blocks * std::max(1u, processor->program_length())));
+	double best = 0;
+	for(uint i_batch=0; i_batch < 3; ++i_batch) {
+		auto start = Clock::now();
+		for(uint i=0; i < n_runs; ++i) processor->run();
+		double t = std::chrono::duration<double>(Clock::now() - start).count() / n_runs;
+		if (i_batch == 0 || t < best) best = t;
+	}
+	processor->~ProcessorBase();
+	return best;
+}
+
+
+/**
+ * Fastest of the tuning_candidates for the vector of 'n_blocks' SIMD blocks, 'time' set to its time per run().
+ */
+inline ProcessorOptions tune(details::ExpressionDAG &se, uint vector_size, uint simd_size, uint n_blocks,
+		const ProcessorOptions &base, double &time) {
+	ProcessorOptions best_options = base;
+	time = 0;
+	for(const ProcessorOptions &options : tuning_candidates(base, n_blocks)) {
+		double t = time_candidate(se, vector_size, simd_size, n_blocks, options);
+		if (time == 0 || t < time) {
+			time = t;
+			best_options = options;
+		}
+	}
+	return best_options;
+}
+
+
+} // namespace bparser
+
+#endif /* INCLUDE_TUNER_HH_ */
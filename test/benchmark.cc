@@ -0,0 +1,300 @@
+/*
+ * benchmark.cc
+ *
+ * Benchmark suite of the parser: compile and evaluation times over the expression corpus,
+ * vector sizes, subset densities, SIMD widths, precisions and thread counts.
+ * Every case is measured after warm-up runs in several repetitions, median, min, max
+ * and relative standard deviation are reported in JSON (default) or CSV.
+ *
+ *     benchmark_bin [options]
+ *       -e EXPR       add expression to the corpus (replaces the default corpus)
+ *       -n SIZES      vector sizes, e.g. 64,1024
+ *       -d DENSITIES  subset densities (fraction of the SIMD blocks), e.g. 1,0.1
+ *       -s SIMD       SIMD widths in doubles, 0 = detected, 1 = no vectorization, e.g. 0,1,2,4
+ *       -p PREC       precisions: double,float
+ *       -t THREADS    thread counts, e.g. 1,4
+ *       -r REPS       repetitions, default 11
+ *       -w WARMUP     warm-up runs, default 3
+ *       -f FORMAT     json or csv
+ *       -o FILE       output file, default stdout
+ *
+ * Expressions can use the variables v1, v2, v3, v4 of shape {3} and the scalar cs1,
+ * the result has the shape {3}.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "parser.hh"
+
+using namespace bparser;
+
+
+class ParserSimd
+: public Parser {
+public:
+	ParserSimd(uint max_vec_size, uint simd_size_, Precision precision)
+	: Parser(max_vec_size, precision)
+	{
+		simd_size = simd_size_;
+	}
+};
+
+
+struct Config {
+	std::vector<std::string> corpus = {
+			"v1 + v2 + v3 + v4",
+			"3 * v1 + cs1 * v2 + v3 + 2.5 * v4",
+			"[v2, v2, v2] @ v1 + v3",
+			"sin(v1) * exp(v2 / 400) + sqrt(v1)",
+			"v1 if v1 > v2 else v2 ** 2",
+	};
+	std::vector<uint> vec_sizes = {64, 1024};
+	std::vector<double> densities = {1.0, 0.25};
+	std::vector<uint> simd_sizes = {0};
+	std::vector<Precision> precisions = {double_precision, single_precision};
+	std::vector<uint> threads = {1};
+	uint n_reps = 11;
+	uint n_warmup = 3;
+	std::string format = "json";
+	std::string output;
+};
+
+
+struct Stats {
+	double median, min, max, rel_std;
+};
+
+Stats statistics(std::vector<double> samples) {
+	std::sort(samples.begin(), samples.end());
+	uint n = samples.size();
+	double mean = 0, var = 0;
+	for(double s : samples) mean += s / n;
+	for(double s : samples) var += (s - mean) * (s - mean) / n;
+	double median = (n % 2) ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+	return {median, samples[0], samples[n - 1], mean > 0 ? std::sqrt(var) / mean : 0.0};
+}
+
+
+struct Result {
+	std::string expr;
+	uint vec_size;
+	double density;
+	uint simd_size;
+	Precision precision;
+	uint n_threads;
+	uint subset_size;
+	// seconds per compilation
+	Stats compile;
+	// wall time nanoseconds per evaluated value, values of all threads
+	Stats run;
+};
+
+
+/// Data and compiled parser of the single benchmark thread.
+template <class T>
+struct Instance {
+	Instance(const std::string &expr, uint vec_size, uint simd_size, Precision precision)
+	: v(4, std::vector<T>(3 * vec_size)), res(3 * vec_size), cs1(4)
+	{
+		for(uint k=0; k < 4; ++k)
+			for(uint i=0; i < 3 * vec_size; ++i) v[k][i] = 100 * (k + 1) + i % 100;
+		parser = std::make_shared<ParserSimd>(vec_size, simd_size, precision);
+		parser->parse(expr);
+		for(std::string name : parser->free_symbols()) {
+			if (name == "cs1") parser->set_constant("cs1", {}, {cs1});
+			else if (name.size() == 2 && name[0] == 'v' && name[1] >= '1' && name[1] <= '4')
+				parser->set_variable(name, {3}, &(v[name[1] - '1'][0]));
+			else
+				Throw() << "Unknown variable '" << name << "' in the benchmark expression.\n";
+		}
+		parser->set_variable("_result_", {3}, &(res[0]));
+		parser->compile();
+	}
+
+	std::vector<std::vector<T>> v;
+	std::vector<T> res;
+	double cs1;
+	std::shared_ptr<ParserSimd> parser;
+};
+
+
+/// Evenly spread subset of the 'density' fraction of the blocks.
+std::vector<uint> make_subset(uint n_blocks, double density) {
+	uint n = std::max(1u, uint(std::lround(density * n_blocks)));
+	std::vector<uint> subset(n);
+	for(uint i=0; i < n; ++i) subset[i] = uint(double(i) * n_blocks / n);
+	return subset;
+}
+
+
+template <class T>
+Result bench_case(const Config &cfg, const std::string &expr, uint vec_size, double density,
+		uint simd_size, Precision precision, uint n_threads) {
+	typedef std::chrono::high_resolution_clock Clock;
+	Result r = {expr, vec_size, density, simd_size, precision, n_threads, 0, {}, {}};
+
+	std::vector<double> compile_times;
+	for(uint i_rep=0; i_rep < cfg.n_warmup + cfg.n_reps; ++i_rep) {
+		auto start = Clock::now();
+		Instance<T> inst(expr, vec_size, simd_size, precision);
+		double t = std::chrono::duration<double>(Clock::now() - start).count();
+		if (i_rep >= cfg.n_warmup) compile_times.push_back(t);
+	}
+	r.compile = statistics(compile_times);
+
+	std::vector<std::shared_ptr<Instance<T>>> instances;
+	for(uint i=0; i < n_threads; ++i)
+		instances.push_back(std::make_shared<Instance<T>>(expr, vec_size, simd_size, precision));
+	uint block = instances[0]->parser->simd_block_size();
+	std::vector<uint> subset = make_subset(vec_size / block, density);
+	r.subset_size = subset.size();
+	for(auto &inst : instances) inst->parser->set_subset(subset);
+
+	// inner repetitions of about 1e6 values per sample
+	uint n_values = 3 * subset.size() * block;
+	uint n_inner = std::max(1u, 1000000 / n_values);
+	std::vector<double> run_times;
+	for(uint i_rep=0; i_rep < cfg.n_warmup + cfg.n_reps; ++i_rep) {
+		auto start = Clock::now();
+		std::vector<std::thread> threads;
+		for(auto &inst : instances) {
+			Parser * p = inst->parser.get();
+			threads.emplace_back([p, n_inner]() {
+				for(uint i=0; i < n_inner; ++i) p->run();
+			});
+		}
+		for(std::thread &th : threads) th.join();
+		double t = std::chrono::duration<double>(Clock::now() - start).count();
+		if (i_rep >= cfg.n_warmup) run_times.push_back(1e9 * t / n_inner / n_values / n_threads);
+	}
+	r.run = statistics(run_times);
+	return r;
+}
+
+
+std::string precision_name(Precision p) {
+	return p == single_precision ? "float" : "double";
+}
+
+std::string json_escape(const std::string &s) {
+	std::string out;
+	for(char c : s) {
+		if (c == '"' || c == '\\') out += '\\';
+		out += c;
+	}
+	return out;
+}
+
+void write_json(std::ostream &out, const std::vector<Result> &results) {
+	out << "{\n  \"host_simd_size\": " << get_simd_size() << ",\n  \"results\": [\n";
+	for(uint i=0; i < results.size(); ++i) {
+		const Result &r = results[i];
+		auto stats = [&out](const char *name, const Stats &s) {
+			out << "\"" << name << "\": {\"median\": " << s.median << ", \"min\": " << s.min
+				<< ", \"max\": " << s.max << ", \"rel_std\": " << s.rel_std << "}";
+		};
+		out << "    {\"expr\": \"" << json_escape(r.expr) << "\", \"vec_size\": " << r.vec_size
+			<< ", \"density\": " << r.density << ", \"subset_size\": " << r.subset_size
+			<< ", \"simd_size\": " << r.simd_size << ", \"precision\": \"" << precision_name(r.precision)
+			<< "\", \"threads\": " << r.n_threads << ", ";
+		stats("compile_s", r.compile);
+		out << ", ";
+		stats("run_ns_per_value", r.run);
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+void write_csv(std::ostream &out, const std::vector<Result> &results) {
+	out << "expr,vec_size,density,subset_size,simd_size,precision,threads,"
+		<< "compile_s_median,compile_s_min,compile_s_max,compile_rel_std,"
+		<< "run_ns_median,run_ns_min,run_ns_max,run_rel_std\n";
+	for(const Result &r : results) {
+		out << "\"" << r.expr << "\"," << r.vec_size << "," << r.density << "," << r.subset_size << ","
+			<< r.simd_size << "," << precision_name(r.precision) << "," << r.n_threads << ","
+			<< r.compile.median << "," << r.compile.min << "," << r.compile.max << "," << r.compile.rel_std << ","
+			<< r.run.median << "," << r.run.min << "," << r.run.max << "," << r.run.rel_std << "\n";
+	}
+}
+
+
+template <class T>
+std::vector<T> parse_list(const std::string &str) {
+	std::vector<T> list;
+	std::stringstream ss(str);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		std::stringstream is(item);
+		T value;
+		is >> value;
+		list.push_back(value);
+	}
+	return list;
+}
+
+
+int main(int argc, char **argv) {
+	Config cfg;
+	std::vector<std::string> exprs;
+	try {
+		for(int i=1; i < argc; ++i) {
+			std::string arg = argv[i];
+			if (i + 1 >= argc)
+				Throw() << "Missing value of the option " << arg << ".\n";
+			std::string val = argv[++i];
+			if (arg == "-e") exprs.push_back(val);
+			else if (arg == "-n") cfg.vec_sizes = parse_list<uint>(val);
+			else if (arg == "-d") cfg.densities = parse_list<double>(val);
+			else if (arg == "-s") cfg.simd_sizes = parse_list<uint>(val);
+			else if (arg == "-t") cfg.threads = parse_list<uint>(val);
+			else if (arg == "-r") cfg.n_reps = std::stoul(val);
+			else if (arg == "-w") cfg.n_warmup = std::stoul(val);
+			else if (arg == "-f") cfg.format = val;
+			else if (arg == "-o") cfg.output = val;
+			else if (arg == "-p") {
+				cfg.precisions.clear();
+				for(std::string p : parse_list<std::string>(val))
+					cfg.precisions.push_back(p == "float" ? single_precision : double_precision);
+			}
+			else Throw() << "Unknown option " << arg << ".\n";
+		}
+		if (! exprs.empty()) cfg.corpus = exprs;
+		if (cfg.n_reps == 0)
+			Throw() << "At least one repetition needed.\n";
+
+		std::vector<Result> results;
+		for(const std::string &expr : cfg.corpus)
+			for(uint vec_size : cfg.vec_sizes)
+				for(double density : cfg.densities)
+					for(uint simd_size : cfg.simd_sizes)
+						for(Precision precision : cfg.precisions)
+							for(uint n_threads : cfg.threads) {
+								std::cerr << "bench: " << expr << " n: " << vec_size << " d: " << density
+										<< " simd: " << simd_size << " " << precision_name(precision)
+										<< " threads: " << n_threads << "\n";
+								if (precision == single_precision)
+									results.push_back(bench_case<float>(cfg, expr, vec_size, density, simd_size, precision, n_threads));
+								else
+									results.push_back(bench_case<double>(cfg, expr, vec_size, density, simd_size, precision, n_threads));
+							}
+
+		std::ofstream file;
+		if (! cfg.output.empty()) file.open(cfg.output);
+		std::ostream &out = cfg.output.empty() ? std::cout : file;
+		if (cfg.format == "csv")
+			write_csv(out, results);
+		else
+			write_json(out, results);
+	} catch (std::exception &e) {
+		std::cerr << "benchmark: " << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}
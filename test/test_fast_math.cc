@@ -0,0 +1,160 @@
+/*
+ * test_fast_math.cc
+ *
+ * Accuracy report of the fast math approximations (fast_math.hh).
+ * Results of the vectorized processors with the fast math option are compared
+ * to the exact scalar path (processor with simd_size = 1, no vectorization).
+ */
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <iomanip>
+
+#include "test_tools.hh"
+#include "assert.hh"
+#include "parser.hh"
+
+using namespace bparser;
+
+class ParserSimd
+: public Parser {
+public:
+	ParserSimd(uint max_vec_size, uint simd_size_, Precision precision)
+	: Parser(max_vec_size, precision)
+	{
+		simd_size = simd_size_;
+	}
+};
+
+constexpr uint n_points = 4096;
+
+/**
+ * Evaluate 'expr' of the variable 'x' for all values of 'x'.
+ */
+template <class T>
+std::vector<double> eval_expr(std::string expr, const std::vector<T> &x, uint simd_size, Precision precision, bool fast_math) {
+	std::vector<T> xv(x), res(x.size());
+	ParserSimd p(x.size(), simd_size, precision);
+	p.parse(expr);
+	p.set_variable("x", {}, &(xv[0]));
+	p.set_variable("_result_", {}, &(res[0]));
+	p.set_fast_math(fast_math);
+	p.compile();
+	std::vector<uint> ss(x.size() / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+	return std::vector<double>(res.begin(), res.end());
+}
+
+struct Case {
+	std::string expr;
+	double x_min;
+	double x_max;
+	// logarithmic distribution of x (for x_min > 0)
+	bool log_scale;
+	// max. relative error of the single precision results
+	double float_tol = 5e-7;
+};
+
+std::vector<double> sample(const Case &c) {
+	std::vector<double> x(n_points);
+	for(uint i=0; i < n_points; i++) {
+		double t = double(i) / (n_points - 1);
+		x[i] = c.log_scale ? c.x_min * std::pow(c.x_max / c.x_min, t) : c.x_min + t * (c.x_max - c.x_min);
+	}
+	return x;
+}
+
+/**
+ * Max. relative error and max. error in ULPs (of the type T) of the fast math results.
+ * Returns the max. relative error.
+ */
+template <class T>
+double report(const Case &c, Precision precision) {
+	std::vector<double> xd = sample(c);
+	std::vector<T> x(xd.begin(), xd.end());
+	// reference for exactly the same inputs
+	std::vector<double> x_ref(x.begin(), x.end());
+	auto ref = eval_expr<double>(c.expr, x_ref, 1, double_precision, false);
+	auto res = eval_expr<T>(c.expr, x, get_simd_size(), precision, true);
+
+	double max_rel = 0, max_ulp = 0, x_max_rel = 0;
+	for(uint i=0; i < n_points; i++) {
+		if (std::isnan(ref[i]) || std::isinf(ref[i])) {
+			if (! (std::isnan(ref[i]) ? std::isnan(res[i]) : ref[i] == res[i]))
+				max_rel = max_ulp = std::numeric_limits<double>::infinity();
+			continue;
+		}
+		T ref_t = T(ref[i]);
+		double ulp = std::nextafter(std::fabs(ref_t), std::numeric_limits<T>::infinity()) - std::fabs(ref_t);
+		double err = std::fabs(res[i] - ref[i]);
+		double rel = err / std::max(std::fabs(ref[i]), double(std::numeric_limits<T>::min()));
+		max_ulp = std::max(max_ulp, err / ulp);
+		if (rel > max_rel) {
+			max_rel = rel;
+			x_max_rel = x[i];
+		}
+	}
+	std::cout << std::setw(24) << std::left << c.expr
+			<< std::setw(8) << (precision == single_precision ? "float" : "double")
+			<< " max rel: " << std::setw(12) << max_rel
+			<< " max ULP: " << std::setw(12) << max_ulp
+			<< " at x: " << x_max_rel << "\n";
+	return max_rel;
+}
+
+
+void test_accuracy() {
+	std::cout << "\n" << "** fast math accuracy, vectorized fast vs. exact scalar" << "\n";
+	std::vector<Case> cases = {
+			{"exp(x)", -80, 80, false},
+			{"exp(x)", -1, 1, false},
+			{"log(x)", 1e-30, 1e30, true},
+			{"log(x)", 0.5, 2, false},
+			{"log2(x)", 1e-30, 1e30, true},
+			{"log10(x)", 1e-30, 1e30, true},
+			// error of the float pow grows with |b * log(a)|
+			{"x ** 1.7", 1e-3, 1e3, true, 2e-6},
+			{"x ** -3", -10, 10, false, 1e-6},
+			{"sin(x)", -100, 100, false},
+			{"cos(x)", -100, 100, false},
+			{"sin(x)", -1, 1, false},
+			{"tanh(x)", -10, 10, false},
+			{"tanh(x)", -0.5, 0.5, false},
+	};
+	for(const Case &c : cases) {
+		EXPECT(report<double>(c, double_precision) < 1e-7);
+		EXPECT(report<float>(c, single_precision) < c.float_tol);
+	}
+}
+
+
+void test_special_values() {
+	std::cout << "\n" << "** fast math special values" << "\n";
+	const double inf = std::numeric_limits<double>::infinity();
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	std::vector<double> x(16, 1.0);
+	x[0] = 0.0; x[1] = -1.0; x[2] = inf; x[3] = -inf; x[4] = nan; x[5] = 1000; x[6] = -1000; x[7] = 1e-310;
+	for(std::string expr : {"exp(x)", "log(x)", "sin(x)", "cos(x)", "tanh(x)", "x ** 2", "x ** 0.5", "x ** 0"}) {
+		auto ref = eval_expr<double>(expr, x, 1, double_precision, false);
+		auto res = eval_expr<double>(expr, x, get_simd_size(), double_precision, true);
+		for(uint i=0; i < 8; i++) {
+			bool same = (std::isnan(ref[i]) && std::isnan(res[i]))
+					|| ref[i] == res[i]
+					|| std::fabs(res[i] - ref[i]) <= 1e-7 * std::fabs(ref[i]);
+			if (! same)
+				std::cout << "  " << expr << " x: " << x[i] << " ref: " << ref[i] << " res: " << res[i] << "\n";
+			EXPECT(same);
+		}
+	}
+}
+
+
+int main()
+{
+	test_accuracy();
+	test_special_values();
+}
@@ -6,19 +6,25 @@
  */
 
 #include <string>
+#include <cstdio>
 
 #include "test_tools.hh"
 #include "assert.hh"
 #include "parser.hh"
+#include "stream.hh"
 
 class ParserTest
 : public bparser::Parser {
 public:
-	ParserTest(uint max_vec_size, uint simd_size_)
-	: Parser(max_vec_size)
+	ParserTest(uint max_vec_size, uint simd_size_, bparser::Precision precision = bparser::double_precision)
+	: Parser(max_vec_size, precision)
 	{
 		simd_size = simd_size_;
 	}
+
+	std::shared_ptr<bparser::ArenaAlloc> arena() {
+		return own_arena_;
+	}
 };
 
 
@@ -281,6 +287,970 @@ void test_expression() {
 }
 
 
+void test_recompile() {
+	std::cout << "\n" << "** test recompile" << "\n";
+	using namespace bparser;
+	std::vector<double> av2(3*vec_size, 2);
+	std::vector<double> res(3*vec_size, 0);
+	std::vector<uint> ss = std::vector<uint>(vec_size/simd_size);
+	for (uint i = 0; i < ss.size(); i++) ss[i] = i;
+
+	ParserTest p(vec_size, simd_size);
+	p.parse("av2 * av2 + 1");
+	p.set_variable("av2", {3}, &(av2[0]));
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.compile();
+	auto arena = p.arena();
+	std::size_t used = arena->used();
+	std::size_t n_chunks = arena->n_chunks();
+
+	// The arena of the first processor is reused.
+	p.compile();
+	BP_ASSERT(p.arena() == arena);
+	EXPECT(arena->used() == used);
+	EXPECT(arena->n_chunks() == n_chunks);
+	EXPECT(arena->high_water() == used);
+	p.set_subset(ss);
+	p.run();
+	for(double x : res) EXPECT(x == 5);
+
+	// Allocations over the initial size append chunks.
+	ArenaAlloc small(sizeof(double) * simd_size, 256);
+	double * a = small.create_array<double>(16);
+	auto mark = small.mark();
+	double * b = small.create_array<double>(64);
+	EXPECT(small.n_chunks() == 2);
+	EXPECT(b != a + 16);
+	small.rewind(mark);
+	EXPECT(small.create_array<double>(64) == b);
+	EXPECT(small.used() == (16 + 64) * sizeof(double));
+	small.reset();
+	EXPECT(small.create_array<double>(16) == a);
+}
+
+
+template <class T>
+std::vector<double> eval_precision(std::string expr, bparser::Precision precision, uint n) {
+	using namespace bparser;
+	std::vector<T> a(n), b(3*n), res(3*n);
+	for(uint i=0; i < n; i++) a[i] = 0.5 + 0.25 * i;
+	for(uint i=0; i < 3*n; i++) b[i] = 1 + 0.1 * i;
+
+	ParserTest p(n, simd_size, precision);
+	p.parse(expr);
+	p.set_variable("a", {}, &(a[0]));
+	p.set_variable("b", {3}, &(b[0]));
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.compile();
+	std::vector<uint> ss(n / p.simd_block_size());
+	for (uint i = 0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+	return std::vector<double>(res.begin(), res.end());
+}
+
+bool test_single(std::string expr) {
+	std::cout << "single precision test : " << expr << "\n";
+	constexpr uint n = 32;
+	auto ref = eval_precision<double>(expr, bparser::double_precision, n);
+	auto res = eval_precision<float>(expr, bparser::single_precision, n);
+	bool success = true;
+	for(uint i=0; i < ref.size(); i++) {
+		if (fabs(res[i] - ref[i]) > 1e-5 * fabs(ref[i]) + 1e-6) {
+			success = false;
+			std::cout << "  " << i << " ref: " << ref[i] << " res: " << res[i] << "\n";
+		}
+	}
+	return success;
+}
+
+void test_single_precision() {
+	std::cout << "\n" << "** test single precision" << "\n";
+	using namespace bparser;
+	EXPECT(test_single("a * b + 1"));
+	EXPECT(test_single("sin(a) * exp(b / 10) - sqrt(b)"));
+	EXPECT(test_single("a if a < b else b ** 2"));
+	EXPECT(test_single("maximum(a, b) % 3 + abs(-a)"));
+	EXPECT(test_single("1 if (a > 2) and not (b > 3) else 0"));
+
+	std::vector<double> av(vec_size);
+	Parser p(vec_size, single_precision);
+	p.parse("a + 1");
+	ASSERT_THROW(p.set_variable("a", {}, &(av[0])), "passed to the parser of different precision");
+}
+
+
+/**
+ * Evaluate 'expr' with 'a' interleaved with padding (stride 2) and 'b' as 3d vectors in AoS layout
+ * if 'interleaved', or with the default layout otherwise. Every other block is in the subset.
+ */
+template <class T>
+std::vector<double> eval_layout(std::string expr, bparser::Precision precision, uint n, bool interleaved) {
+	using namespace bparser;
+	std::vector<T> a(2*n), b(3*n), res(3*n, 0);
+	for(uint i=0; i < n; i++) {
+		T a_val = 0.5 + 0.25 * i;
+		interleaved ? (a[2*i] = a_val, a[2*i+1] = -1) : a[i] = a_val;
+		for(uint k=0; k < 3; k++)
+			(interleaved ? b[3*i + k] : b[k*n + i]) = 1 + 0.1 * i + k;
+	}
+
+	ParserTest p(n, simd_size, precision);
+	p.parse(expr);
+	if (interleaved) {
+		p.set_variable("a", {}, &(a[0]), {2, 1});
+		p.set_variable("b", {3}, &(b[0]), {3, 1});
+	} else {
+		p.set_variable("a", {}, &(a[0]));
+		p.set_variable("b", {3}, &(b[0]));
+	}
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.compile();
+	std::vector<uint> ss;
+	for (uint i = 0; i < n / p.simd_block_size(); i += 2) ss.push_back(i);
+	p.set_subset(ss);
+	p.run();
+	return std::vector<double>(res.begin(), res.end());
+}
+
+template <class T>
+bool test_layout(std::string expr, bparser::Precision precision) {
+	std::cout << "layout test : " << expr << "\n";
+	constexpr uint n = 32;
+	auto ref = eval_layout<T>(expr, precision, n, false);
+	auto res = eval_layout<T>(expr, precision, n, true);
+	bool success = true;
+	for(uint i=0; i < ref.size(); i++) {
+		if (res[i] != ref[i]) {
+			success = false;
+			std::cout << "  " << i << " ref: " << ref[i] << " res: " << res[i] << "\n";
+		}
+	}
+	return success;
+}
+
+void test_layouts() {
+	std::cout << "\n" << "** test strided layouts" << "\n";
+	using namespace bparser;
+	EXPECT(test_layout<double>("a * b + 1", double_precision));
+	EXPECT(test_layout<double>("b[2] + a if a < b[0] else b", double_precision));
+	EXPECT(test_layout<float>("a * b + 1", single_precision));
+	EXPECT(test_layout<float>("b[2] + a if a < b[0] else b", single_precision));
+
+	std::vector<double> av(vec_size);
+	Parser p(vec_size);
+	p.parse("a + 1");
+	ASSERT_THROW(p.set_variable("a", {}, &(av[0]), {0, 1}), "out of range");
+	ASSERT_THROW(p.set_variable("_result_", {}, &(av[0]), {2, 1}), "result variable");
+}
+
+
+/**
+ * Evaluate 'expr' with 'a', 'b' given as the 16-bit values in the 'format' if 'half', as the values
+ * of the processor precision otherwise. The values are exact in both formats, every other block is in the subset.
+ */
+template <class T>
+std::vector<double> eval_half(std::string expr, bparser::Precision precision, bparser::HalfFormat format, bool half,
+		bparser::ProgramOrder order, bparser::SubsetMode mode) {
+	using namespace bparser;
+	constexpr uint n = 64;
+	std::vector<T> a(n), b(3*n), res(3*n, 0);
+	std::vector<uint16_t> a_half(n), b_half(3*n);
+	for(uint i=0; i < n; i++) a[i] = 0.5 + 0.25 * i;
+	for(uint i=0; i < 3*n; i++) b[i] = 0.25 * i - 3;
+	for(uint i=0; i < n; i++) a_half[i] = (format == fp16) ? to_fp16(a[i]) : to_bf16(a[i]);
+	for(uint i=0; i < 3*n; i++) b_half[i] = (format == fp16) ? to_fp16(b[i]) : to_bf16(b[i]);
+
+	ParserTest p(n, simd_size, precision);
+	p.parse(expr);
+	if (half) {
+		p.set_variable("a", {}, &(a_half[0]), format);
+		p.set_variable("b", {3}, &(b_half[0]), format);
+	} else {
+		p.set_variable("a", {}, &(a[0]));
+		p.set_variable("b", {3}, &(b[0]));
+	}
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.set_program_order(order);
+	p.set_subset_mode(mode);
+	p.compile();
+	std::vector<uint> ss;
+	for (uint i = 0; i < n / p.simd_block_size(); i += 2) ss.push_back(i);
+	p.set_subset(ss);
+	p.run();
+	return std::vector<double>(res.begin(), res.end());
+}
+
+void test_half_precision() {
+	std::cout << "\n" << "** test half precision variables" << "\n";
+	using namespace bparser;
+	for(std::string expr : {"a * b + 1", "b[2] + a if a < b[0] else b", "b"})
+		for(HalfFormat format : {fp16, bf16})
+			for(ProgramOrder order : {op_major, element_major})
+				for(SubsetMode mode : {direct_subset, gather_subset}) {
+					EXPECT(eval_half<double>(expr, double_precision, format, true, order, mode)
+							== eval_half<double>(expr, double_precision, format, false, order, mode));
+					EXPECT(eval_half<float>(expr, single_precision, format, true, order, mode)
+							== eval_half<float>(expr, single_precision, format, false, order, mode));
+				}
+
+	// signed zeros, subnormals, the largest value, infinities, NaN
+	std::vector<uint16_t> special = {0x0000, 0x8000, 0x0001, 0x83ff, 0x0400, 0x3c00,
+			0x3555, 0x7bff, 0x7c00, 0xfc00, 0x7e00, 0xc000, 0x3f80, 0x7f7f, 0xff80, 0x0080};
+	auto fp16_value = [](uint16_t h) {
+		int e = (h >> 10) & 0x1f, m = h & 0x3ff;
+		double v = (e == 31) ? (m ? NAN : INFINITY) : (e == 0) ? std::ldexp(m, -24) : std::ldexp(m + 1024, e - 25);
+		return (h & 0x8000) ? -v : v;
+	};
+	auto bf16_value = [](uint16_t h) {
+		uint32_t b = uint32_t(h) << 16;
+		float f;
+		memcpy(&f, &b, sizeof(f));
+		return double(f);
+	};
+	constexpr uint n = 64;
+	std::vector<uint16_t> a(n);
+	for(uint i=0; i < n; i++) a[i] = special[i % special.size()];
+	for(HalfFormat format : {fp16, bf16})
+		for(ProgramOrder order : {op_major, element_major}) {
+			std::vector<double> res(n);
+			ParserTest p(n, simd_size);
+			p.parse("a");
+			p.set_variable("a", {}, &(a[0]), format);
+			p.set_variable("_result_", {}, &(res[0]));
+			p.set_program_order(order);
+			p.compile();
+			std::vector<uint> ss(n / p.simd_block_size());
+			for (uint i = 0; i < ss.size(); i++) ss[i] = i;
+			p.set_subset(ss);
+			p.run();
+			bool ok = true;
+			for(uint i=0; i < n; i++) {
+				double ref = (format == fp16) ? fp16_value(a[i]) : bf16_value(a[i]);
+				bool match = std::isnan(ref) ? std::isnan(res[i]) : (res[i] == ref && std::signbit(res[i]) == std::signbit(ref));
+				if (! match) std::cout << "  " << std::hex << a[i] << std::dec << " ref: " << ref << " res: " << res[i] << "\n";
+				ok = ok && match;
+			}
+			EXPECT(ok);
+		}
+
+	std::vector<uint16_t> av(vec_size);
+	Parser p(vec_size);
+	p.parse("a + 1");
+	ASSERT_THROW(p.set_variable("_result_", {}, &(av[0]), fp16), "Half precision result");
+}
+
+
+void test_subset_span() {
+	std::cout << "\n" << "** test subset span" << "\n";
+	using namespace bparser;
+	constexpr uint n = 64;
+	std::vector<double> a(n), res(n, 0), ref(n, 0);
+	for(uint i=0; i < n; i++) a[i] = i;
+
+	ParserTest p(n, simd_size);
+	p.parse("2 * a + 1");
+	p.set_variable("a", {}, &(a[0]));
+	p.set_variable("_result_", {}, &(res[0]));
+	p.compile();
+	uint n_blocks = n / p.simd_block_size();
+	// caller owned subset, not copied
+	std::vector<uint> odd, even;
+	for(uint i=0; i < n_blocks; i++) (i % 2 ? odd : even).push_back(i);
+	p.set_subset(&(odd[0]), odd.size());
+	p.run();
+	// in place filled buffer
+	uint * buffer = p.subset_buffer();
+	for(uint i=0; i < even.size(); i++) buffer[i] = even[i];
+	p.set_subset(buffer, even.size());
+	p.run();
+	for(uint i=0; i < n; i++) ref[i] = 2 * a[i] + 1;
+	EXPECT(res == ref);
+}
+
+
+void test_value_copy() {
+	std::cout << "\n" << "** test value copy" << "\n";
+	using namespace bparser;
+	constexpr uint n = 64;
+	std::vector<double> a(3 * n), b(3 * n), res(3 * n, 0);
+	for(uint i=0; i < a.size(); i++) a[i] = i;
+	for(uint i=0; i < b.size(); i++) b[i] = 0.5 * i;
+
+	ParserTest p(n, simd_size);
+	p.parse("a * b + b");
+	p.set_variable("a", {3}, &(a[0]));
+	p.set_var_copy("b", {3}, &(b[0]));
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.compile();
+	uint block = p.simd_block_size();
+	uint n_blocks = n / block;
+
+	// small subsets, the source changed between the runs is copied again
+	for(uint i_run=0; i_run < 3; i_run++) {
+		for(uint i=0; i < b.size(); i++) b[i] = 0.5 * i + i_run;
+		std::vector<uint> ss = {(i_run + 1) % n_blocks};
+		p.set_subset(ss);
+		p.run();
+		bool ok = true;
+		for(uint k=0; k < 3; k++)
+			for(uint j=0; j < block; j++) {
+				uint i = k * n + ss[0] * block + j;
+				ok = ok && (res[i] == a[i] * b[i] + b[i]);
+			}
+		EXPECT(ok);
+	}
+	// full subset
+	std::vector<uint> ss(n_blocks);
+	for(uint i=0; i < n_blocks; i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+	bool ok = true;
+	for(uint i=0; i < res.size(); i++) ok = ok && (res[i] == a[i] * b[i] + b[i]);
+	EXPECT(ok);
+}
+
+
+void test_temp_blocks() {
+	std::cout << "\n" << "** test temporaries capacity" << "\n";
+	using namespace bparser;
+	constexpr uint n = 64;
+	std::vector<double> a(3 * n), b(3 * n), res(3 * n), ref(3 * n);
+	for(uint i=0; i < a.size(); i++) a[i] = i;
+	for(uint i=0; i < b.size(); i++) b[i] = 0.5 * i + 1;
+	for(uint i=0; i < ref.size(); i++) ref[i] = (a[i] < b[i]) ? a[i] * b[i] + 1 : b[i] - a[i];
+
+	for(uint max_blocks : {0, 1, 3}) {
+		ParserTest p(n, simd_size);
+		p.parse("a * b + 1 if a < b else b - a");
+		p.set_variable("a", {3}, &(a[0]));
+		p.set_var_copy("b", {3}, &(b[0]));
+		p.set_variable("_result_", {3}, &(res[0]));
+		p.set_max_temp_blocks(max_blocks);
+		p.compile();
+		uint block = p.simd_block_size();
+		uint n_blocks = n / block;
+		// scattered subsets of several sizes
+		for(uint subset_size : {1u, 3u, n_blocks / 2, n_blocks}) {
+			std::fill(res.begin(), res.end(), 0.0);
+			std::vector<uint> ss(subset_size);
+			for(uint i=0; i < subset_size; i++) ss[i] = (i * 5) % n_blocks;
+			if (subset_size == n_blocks)
+				for(uint i=0; i < subset_size; i++) ss[i] = n_blocks - 1 - i;
+			p.set_subset(ss);
+			p.run();
+			bool ok = true;
+			for(uint k=0; k < 3; k++)
+				for(uint blk : ss)
+					for(uint j=0; j < block; j++) {
+						uint i = k * n + blk * block + j;
+						ok = ok && (res[i] == ref[i]);
+					}
+			EXPECT(ok);
+		}
+	}
+}
+
+
+void test_nt_stores() {
+	std::cout << "\n" << "** test non-temporal stores" << "\n";
+	using namespace bparser;
+	// large enough for ProcessorOptions::nt_store_min_bytes
+	constexpr uint n = 1 << 16;
+	ArenaAlloc arena(64, 8 * 3 * n * sizeof(double) + 1024);
+	double * a = arena.create_array<double>(n);
+	double * b = arena.create_array<double>(3 * n);
+	double * res = arena.create_array<double>(3 * n);
+	// unaligned result, stored by the regular stores
+	double * res_unaligned = arena.create_array<double>(3 * n + 1) + 1;
+	for(uint i=0; i < n; i++) a[i] = 0.5 * i;
+	for(uint i=0; i < 3 * n; i++) b[i] = 1 + 0.1 * i;
+
+	for(double * r : {res, res_unaligned}) {
+		std::fill(r, r + 3 * n, 0.0);
+		ParserTest p(n, simd_size);
+		p.parse("a * b + [1, 2, 3]");
+		p.set_variable("a", {}, a);
+		p.set_variable("b", {3}, b);
+		p.set_variable("_result_", {3}, r);
+		p.set_nt_stores(true);
+		p.compile();
+		std::vector<uint> ss(n / p.simd_block_size());
+		for(uint i=0; i < ss.size(); i++) ss[i] = i;
+		p.set_subset(ss);
+		p.run();
+		bool ok = true;
+		for(uint k=0; k < 3; k++)
+			for(uint i=0; i < n; i++)
+				ok = ok && (r[k * n + i] == a[i] * b[k * n + i] + (k + 1));
+		EXPECT(ok);
+	}
+}
+
+
+void test_subset_mode() {
+	std::cout << "\n" << "** test subset modes" << "\n";
+	using namespace bparser;
+	constexpr uint n = 64;
+	// 'c' interleaved with padding, read through the gather operation
+	std::vector<double> a(3 * n), b(3 * n), c(2 * n), res(3 * n), ref(3 * n);
+	for(uint i=0; i < a.size(); i++) a[i] = i;
+	for(uint i=0; i < b.size(); i++) b[i] = 0.5 * i + 1;
+	for(uint i=0; i < n; i++) {
+		c[2 * i] = 0.25 * i;
+		c[2 * i + 1] = -1;
+	}
+	for(uint k=0; k < 3; k++)
+		for(uint i=0; i < n; i++) {
+			uint j = k * n + i;
+			ref[j] = (a[j] < b[j]) ? a[j] * b[j] + c[2 * i] : b[j] - a[j];
+		}
+
+	for(SubsetMode mode : {auto_subset, direct_subset, gather_subset})
+		for(uint max_blocks : {0, 3}) {
+			ParserTest p(n, simd_size);
+			p.parse("a * b + c if a < b else b - a");
+			p.set_variable("a", {3}, &(a[0]));
+			p.set_var_copy("b", {3}, &(b[0]));
+			p.set_variable("c", {}, &(c[0]), {2, 1});
+			p.set_variable("_result_", {3}, &(res[0]));
+			p.set_subset_mode(mode);
+			p.set_max_temp_blocks(max_blocks);
+			p.compile();
+			uint block = p.simd_block_size();
+			uint n_blocks = n / block;
+			for(uint subset_size : {1u, 3u, n_blocks / 2, n_blocks}) {
+				std::fill(res.begin(), res.end(), 0.0);
+				std::vector<uint> ss(subset_size);
+				for(uint i=0; i < subset_size; i++) ss[i] = (i * 5) % n_blocks;
+				if (subset_size == n_blocks)
+					for(uint i=0; i < subset_size; i++) ss[i] = n_blocks - 1 - i;
+				p.set_subset(ss);
+				p.run();
+				// repeated run on the same subset, blocks out of the subset untouched
+				p.run();
+				bool ok = true;
+				std::vector<bool> in_subset(n_blocks, false);
+				for(uint blk : ss) in_subset[blk] = true;
+				for(uint k=0; k < 3; k++)
+					for(uint i=0; i < n; i++) {
+						uint j = k * n + i;
+						ok = ok && (res[j] == (in_subset[i / block] ? ref[j] : 0.0));
+					}
+				EXPECT(ok);
+			}
+		}
+}
+
+
+/**
+ * Results of 'expr' evaluated in the 'order', over the scattered subset of the 'n' values.
+ * Variables 'a', 'b' as 3d vectors, 'b' as the value copy, 'c' interleaved with padding.
+ */
+std::vector<double> eval_order(std::string expr, uint n, bparser::ProgramOrder order, bool fuse_polynomials = true,
+		bool packed_masks = true) {
+	using namespace bparser;
+	std::vector<double> a(3 * n), b(3 * n), c(2 * n), res(3 * n, 0);
+	for(uint i=0; i < a.size(); i++) a[i] = 0.5 * i - 7;
+	for(uint i=0; i < b.size(); i++) b[i] = 0.25 * i + 1;
+	for(uint i=0; i < n; i++) {
+		c[2 * i] = 0.1 * i;
+		c[2 * i + 1] = -1;
+	}
+	ParserTest p(n, simd_size);
+	p.parse(expr);
+	p.set_variable("a", {3}, &(a[0]));
+	p.set_var_copy("b", {3}, &(b[0]));
+	p.set_variable("c", {}, &(c[0]), {2, 1});
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.set_program_order(order);
+	p.set_fuse_polynomials(fuse_polynomials);
+	p.set_packed_masks(packed_masks);
+	p.compile();
+	uint n_blocks = n / p.simd_block_size();
+	std::vector<uint> ss;
+	for(uint i=0; i < n_blocks; i++)
+		if (i % 3 != 1) ss.push_back(n_blocks - 1 - i);
+	p.set_subset(ss);
+	p.run();
+	return res;
+}
+
+void test_program_order() {
+	std::cout << "\n" << "** test program order" << "\n";
+	using namespace bparser;
+	for(std::string expr : {"a * b + c if a < b else b - a",
+			"sin(a) + 2 * b - [1, 2, 3]",
+			"a if (c > 1) and not (a > b) else maximum(a, b) ** 2"})
+		for(uint n : {simd_size, 4 * simd_size, 64u}) {
+			auto ref = eval_order(expr, n, op_major);
+			EXPECT(eval_order(expr, n, element_major) == ref);
+			EXPECT(eval_order(expr, n, auto_order) == ref);
+		}
+}
+
+
+// Registered functions of test_native_function.
+struct MooneyRivlin {
+	static const char n_eval_args = 3;
+	template <typename VecType>
+	inline static void eval(VecType &res, VecType i1, VecType i2) {
+		res = 0.3 * (i1 - 3.0) + 0.2 * (i2 - 3.0);
+	}
+};
+
+struct Lerp {
+	static const char n_eval_args = 4;
+	template <typename VecType>
+	inline static void eval(VecType &res, VecType a, VecType b, VecType t) {
+		res = a + t * (b - a);
+	}
+};
+
+bool near(const std::vector<double> &res, const std::vector<double> &ref) {
+	bool success = (res.size() == ref.size());
+	for(uint i=0; success && i < res.size(); i++)
+		success = fabs(res[i] - ref[i]) <= 1e-12 * fabs(ref[i]) + 1e-12;
+	return success;
+}
+
+void test_native_function() {
+	std::cout << "\n" << "** test native function" << "\n";
+	using namespace bparser;
+	register_function<MooneyRivlin>("mooney_rivlin");
+	register_function<Lerp>("lerp");
+	ASSERT_THROW(register_function<Lerp>("lerp"), "already registered");
+
+	std::string expr = "mooney_rivlin(a, c) + lerp(a, b, c) if a < b else lerp(b, a, 0.5)";
+	std::string ref_expr = "0.3 * (a - 3.0) + 0.2 * (c - 3.0) + (a + c * (b - a)) if a < b else b + 0.5 * (a - b)";
+	for(uint n : {simd_size, 64u}) {
+		auto ref = eval_order(ref_expr, n, op_major);
+		EXPECT(near(eval_order(expr, n, op_major), ref));
+		EXPECT(near(eval_order(expr, n, element_major), ref));
+	}
+	EXPECT(test_single("mooney_rivlin(a, b) * lerp(b, a, 0.25)"));
+
+	EXPECT(fail_expr("lerp(as1, av2)", "takes 3 arguments, given 2"));
+}
+
+
+void test_interp() {
+	std::cout << "\n" << "** test interp" << "\n";
+	using namespace bparser;
+	// short table (linear search), long table (binary search), single breakpoint;
+	// parsing of the ifelse chain takes exponential time in the table size
+	std::vector<double> xp_long, fp_long;
+	for(uint k=0; k < 10; ++k) {
+		xp_long.push_back(3.0 * k - 5);
+		fp_long.push_back((k * k) % 7);
+	}
+	std::vector<std::vector<double>> xps = {{-2, 0, 5, 20}, xp_long, {3}};
+	std::vector<std::vector<double>> fps = {{1, 2, -1, 4}, fp_long, {2}};
+	for(uint i=0; i < xps.size(); ++i) {
+		std::string expr = "interp(a, " + print_vector(xps[i]) + ", " + print_vector(fps[i]) + ")";
+		std::cout << expr << "\n";
+		for(uint n : {simd_size, 64u}) {
+			auto ref = eval_order(interp_chain("a", xps[i], fps[i]), n, op_major);
+			EXPECT(near(eval_order(expr, n, op_major), ref));
+			EXPECT(near(eval_order(expr, n, element_major), ref));
+		}
+		EXPECT(test_single(expr + " * b"));
+	}
+	EXPECT(test_expr("interp(as1, [0, 2], [-1, 3])", {1}));
+	EXPECT(test_expr("interp(av2, [-1, 0, 4], [5, 3, 0]) + interp(cv4, [4, 6], [0, 1])", {1.5, 2, 2.5}));
+	EXPECT(fail_expr("interp(as1, [2, 1], [0, 1])", "breakpoints must be increasing"));
+	EXPECT(fail_expr("interp(as1, [1, as1], [0, 1])", "must be constant numbers"));
+	EXPECT(fail_expr("interp(as1, [1, 2], [0, 1, 2])", "vectors of the same size"));
+}
+
+
+void test_polyval() {
+	std::cout << "\n" << "** test polyval" << "\n";
+	using namespace bparser;
+	EXPECT(test_expr("polyval([1, 2, 3], av2)", {11, 11, 11}));
+	EXPECT(test_expr("polyval([-0.5], as1) + polyval([1, -1], cv4)", {2.5, 3.5, 4.5}));
+	EXPECT(fail_expr("polyval(2, as1)", "must be a vector"));
+	EXPECT(fail_expr("polyval([1, as1], av2)", "must be constant numbers"));
+	for(uint n : {simd_size, 64u})
+		EXPECT(near(eval_order("polyval([0.5, -1, 2, 3], a)", n, op_major),
+				eval_order("0.5 * a**3 - a**2 + 2 * a + 3", n, op_major, false)));
+
+	// polynomials recognized in the expressions, against the evaluation without the fusion
+	for(std::string expr : {"1 + 2 * a + 3 * a**2 - a**3 / 4",
+			"(a - 1) * (a + 2) * b",
+			"sin(b)**2 + 2 * sin(b) - 1",
+			"a * a if a < b else (b + 1)**3",
+			"(a + b)**2 - a / 2"}) {
+		std::cout << expr << "\n";
+		for(uint n : {simd_size, 64u}) {
+			auto ref = eval_order(expr, n, op_major, false);
+			EXPECT(near(eval_order(expr, n, op_major), ref));
+			EXPECT(near(eval_order(expr, n, element_major), ref));
+		}
+		EXPECT(test_single(expr));
+	}
+
+	// the whole polynomial is a single node
+	std::vector<double> a(3 * vec_size, 2.0);
+	ParserTest p(vec_size, simd_size);
+	p.parse("1 + 2 * a + 3 * a**2 - a**3 / 4 + sin(a)");
+	p.set_variable("a", {3}, &(a[0]));
+	p.compile();
+	const CompileStats &stats = p.compile_stats();
+	EXPECT(stats.n_nodes.at("polyval") == 3);
+	EXPECT(stats.n_nodes.count("pow") == 0 && stats.n_nodes.count("mul") == 0);
+}
+
+
+/**
+ * Result of 'expr' of the variables 'a' and 'b' (shape {3}, vectors of size n), with the derivatives
+ * 'da', 'db' (shape {3, 3}) if 'derivatives' is set.
+ */
+std::vector<double> eval_derivative(std::string expr, uint n, const std::vector<double> &a, const std::vector<double> &b,
+		bool derivatives, std::vector<double> &da, std::vector<double> &db) {
+	using namespace bparser;
+	std::vector<double> a_(a), b_(b), res(3 * n, 0);
+	ParserTest p(n, simd_size);
+	p.parse(expr);
+	p.set_variable("a", {3}, &(a_[0]));
+	p.set_var_copy("b", {3}, &(b_[0]));
+	p.set_variable("_result_", {3}, &(res[0]));
+	if (derivatives) {
+		da.assign(9 * n, 0);
+		db.assign(9 * n, 0);
+		p.set_variable("da", {3, 3}, &(da[0]));
+		p.set_variable("db", {3, 3}, &(db[0]));
+		p.set_derivative("a", "da");
+		p.set_derivative("b", "db");
+	}
+	p.compile();
+	std::vector<uint> ss(n / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+	return res;
+}
+
+// Jacobians of 'expr' by set_derivative against the central differences.
+bool test_derivative(std::string expr) {
+	std::cout << "derivative test: " << expr << "\n";
+	constexpr uint n = 32;
+	const double h = 1e-6;
+	std::vector<double> a(3 * n), b(3 * n), da, db, d_none;
+	// no kinks of the piecewise operations close to the values
+	for(uint i=0; i < 3 * n; i++) {
+		a[i] = 1.013 + 0.037 * i;
+		b[i] = 4.21 - 0.029 * i;
+	}
+	auto res = eval_derivative(expr, n, a, b, true, da, db);
+	bool success = (res == eval_derivative(expr, n, a, b, false, d_none, d_none));
+	for(uint var=0; var < 2; var++)
+		for(uint j=0; j < 3; j++) {
+			std::vector<double> a_p(a), a_m(a), b_p(b), b_m(b);
+			for(uint i=0; i < n; i++) {
+				(var == 0 ? a_p : b_p)[j * n + i] += h;
+				(var == 0 ? a_m : b_m)[j * n + i] -= h;
+			}
+			auto res_p = eval_derivative(expr, n, a_p, b_p, false, d_none, d_none);
+			auto res_m = eval_derivative(expr, n, a_m, b_m, false, d_none, d_none);
+			const std::vector<double> &d = (var == 0) ? da : db;
+			for(uint k=0; k < 3; k++)
+				for(uint i=0; i < n; i++) {
+					double fd = (res_p[k * n + i] - res_m[k * n + i]) / (2 * h);
+					double ad = d[(3 * k + j) * n + i];
+					if (fabs(ad - fd) > 1e-6 * (fabs(fd) + 1)) {
+						success = false;
+						std::cout << "  d res[" << k << "] / d " << (var == 0 ? "a" : "b") << "[" << j << "], i: " << i
+								<< " ad: " << ad << " fd: " << fd << "\n";
+					}
+				}
+		}
+	return success;
+}
+
+void test_derivatives() {
+	std::cout << "\n" << "** test derivatives" << "\n";
+	using namespace bparser;
+	EXPECT(test_derivative("a * b + sin(a) - a / b"));
+	EXPECT(test_derivative("[a[0] * a[1], a[1] ** 2 - b[2], exp(a[2]) / a[0]]"));
+	EXPECT(test_derivative("sqrt(a) * log(b) + atan2(a, b) + a ** b"));
+	EXPECT(test_derivative("maximum(a, b) ** 3 - abs(a - 2 * b) + minimum(a, b) % 3 + a % b"));
+	EXPECT(test_derivative("a if a < b else tanh(b) * cosh(a) + sinh(b)"));
+	EXPECT(test_derivative("polyval([1, 2, 3], a) / (1 + a * a) + asin(a / 5) + acos(b / 5) + atan(a) + tan(b / 4)"));
+	EXPECT(test_derivative("log10(a) + log2(b) + exp(-a) * cos(b) + floor(a) + [1, 2, 3]"));
+	// the result is an input of the other results and of the derivatives
+	EXPECT(test_derivative("c = exp(a); [c[0], c[0] * b[1], c[2]]"));
+
+	std::vector<double> a(3 * simd_size, 1), d(9 * simd_size);
+	ParserTest p(simd_size, simd_size);
+	p.parse("interp(a, [0, 1], [0, 2])");
+	p.set_variable("a", {3}, &(a[0]));
+	p.set_variable("d", {3, 3}, &(d[0]));
+	p.set_derivative("a", "d");
+	ASSERT_THROW(p.compile(), "is not supported");
+	ParserTest q(simd_size, simd_size);
+	q.parse("2 * a");
+	q.set_variable("a", {3}, &(a[0]));
+	q.set_derivative("a", "x");
+	ASSERT_THROW(q.compile(), "Undefined variable 'x'");
+	q.clear_derivatives();
+	q.set_derivative("a", "a");
+	ASSERT_THROW(q.compile(), "has shape");
+}
+
+
+void test_packed_masks() {
+	std::cout << "\n" << "** test packed masks" << "\n";
+	using namespace bparser;
+	for(std::string expr : {"a if (c > 1) and not (a > b) else b",
+			"a + 1 if (a < b) or (c > 2) and (b != 3) else b - 1",
+			"a if isnan(a / (b - 2)) or not (c < 0.5) or (a == b) else c",
+			"(a if a < b else b) if (c < 3) and (a < b) else -a"})
+		for(uint n : {simd_size, 4 * simd_size, 64u}) {
+			auto ref = eval_order(expr, n, op_major, true, false);
+			EXPECT(eval_order(expr, n, op_major) == ref);
+			EXPECT(eval_order(expr, n, element_major) == ref);
+		}
+
+	// packed result against the boolean result selecting 1 or 0
+	constexpr uint n = 64;
+	std::vector<double> a(3 * n), b(3 * n), c(2 * n);
+	for(uint i=0; i < a.size(); i++) a[i] = 0.5 * i - 7;
+	for(uint i=0; i < b.size(); i++) b[i] = 0.25 * i + 1;
+	for(uint i=0; i < n; i++) {
+		c[2 * i] = 0.1 * i;
+		c[2 * i + 1] = -1;
+	}
+	std::string expr = "(a < b) and not (c > 4)";
+	auto ref = eval_order("1 if " + expr + " else 0", n, op_major);
+	for(ProgramOrder order : {op_major, element_major})
+		for(SubsetMode mode : {direct_subset, gather_subset}) {
+			ParserTest p(n, simd_size);
+			p.parse(expr);
+			p.set_variable("a", {3}, &(a[0]));
+			p.set_var_copy("b", {3}, &(b[0]));
+			p.set_variable("c", {}, &(c[0]), {2, 1});
+			std::vector<uint8_t> bits(3 * p.packed_result_bytes(), 0xA5);
+			p.set_packed_result(&(bits[0]));
+			p.set_program_order(order);
+			p.set_subset_mode(mode);
+			p.compile();
+			uint block = p.simd_block_size();
+			uint n_blocks = n / block;
+			std::vector<uint> ss;
+			for(uint i=0; i < n_blocks; i++)
+				if (i % 3 != 1) ss.push_back(n_blocks - 1 - i);
+			p.set_subset(ss);
+			p.run();
+			bool ok = true;
+			for(uint k=0; k < 3; k++)
+				for(uint i=0; i < n; i++) {
+					bool bit = (bits[k * p.packed_result_bytes() + i / 8] >> (i % 8)) & 1;
+					// blocks out of the subset untouched
+					bool ref_bit = ((n_blocks - 1 - i / block) % 3 != 1) ? ref[k * n + i] == 1 : (0xA5 >> (i % 8)) & 1;
+					ok = ok && (bit == ref_bit);
+				}
+			EXPECT(ok);
+		}
+
+	ParserTest p(n, simd_size);
+	p.parse("a + 1");
+	p.set_variable("a", {3}, &(a[0]));
+	std::vector<uint8_t> bits(3 * p.packed_result_bytes());
+	p.set_packed_result(&(bits[0]));
+	ASSERT_THROW(p.compile(), "Packed result of a non-boolean expression");
+}
+
+
+template <class T>
+bool test_stream_case(uint chunk_size, bool double_buffer) {
+	using namespace bparser;
+	// not a multiple of the chunk size nor of the SIMD block
+	constexpr std::size_t n = 1003;
+	std::vector<T> a(n), b(3 * n), res(3 * n, 0);
+	for(uint i=0; i < n; i++) a[i] = 0.5 * i;
+	for(uint i=0; i < 3 * n; i++) b[i] = 1 + 0.1 * i;
+
+	Stream<T> s("a * b + 1", chunk_size, double_buffer);
+	s.set_source("a", {}, Stream<T>::array_source(&(a[0]), n));
+	s.set_source("b", {3}, Stream<T>::array_source(&(b[0]), n));
+	s.set_sink({3}, Stream<T>::array_sink(&(res[0]), n));
+	StreamStats stats = s.run(n);
+	bool success = (stats.n_chunks == (n + s.chunk_size() - 1) / s.chunk_size());
+	for(uint k=0; k < 3; k++)
+		for(uint i=0; i < n; i++)
+			success = success && (res[k * n + i] == a[i] * b[k * n + i] + T(1));
+	return success;
+}
+
+void test_stream() {
+	std::cout << "\n" << "** test stream" << "\n";
+	using namespace bparser;
+	EXPECT(test_stream_case<double>(64, true));
+	EXPECT(test_stream_case<double>(64, false));
+	EXPECT(test_stream_case<double>(4096, true));
+	EXPECT(test_stream_case<float>(100, true));
+
+	// file backed columns
+	constexpr std::size_t n = 300;
+	std::vector<double> a(n), res(n);
+	for(uint i=0; i < n; i++) a[i] = i;
+	std::string a_file = "test_stream_a.bin", res_file = "test_stream_res.bin";
+	Stream<double>::file_sink(a_file, n)({0, n, 1, &(a[0]), n});
+	{
+		Stream<double> s("a ** 2", 64);
+		s.set_source("a", {}, Stream<double>::file_source(a_file, n));
+		s.set_sink({}, Stream<double>::file_sink(res_file, n));
+		s.run(n);
+	}
+	Stream<double>::file_source(res_file, n)({0, n, 1, &(res[0]), n});
+	bool success = true;
+	for(uint i=0; i < n; i++) success = success && (res[i] == a[i] * a[i]);
+	EXPECT(success);
+	std::remove(a_file.c_str());
+	std::remove(res_file.c_str());
+	ASSERT_THROW(Stream<double>::file_source("no_such_file.bin", n), "can not open");
+}
+
+
+void test_profile() {
+	std::cout << "\n" << "** test profile" << "\n";
+	using namespace bparser;
+	std::vector<double> a(vec_size, 2.0), res(vec_size);
+	ParserTest p(vec_size, simd_size);
+	p.parse("sin(a) * a + 1");
+	p.set_variable("a", {}, &(a[0]));
+	p.set_variable("_result_", {}, &(res[0]));
+	p.compile();
+	p.set_subset({0});
+	p.run();
+	p.run();
+	auto profile = p.profile();
+#ifdef BP_PROFILE
+	std::cout << p.profile_listing();
+	EXPECT(profile.size() == 3);
+	for(const OpProfile &op : profile) EXPECT(op.n_calls == 2);
+	EXPECT(std::string(profile[0].op_name) == "sin");
+	p.reset_profile();
+	EXPECT(p.profile()[0].n_calls == 0);
+#else
+	EXPECT(profile.empty());
+#endif
+}
+
+
+void test_compile_stats() {
+	std::cout << "\n" << "** test compile stats" << "\n";
+	using namespace bparser;
+	std::vector<double> a(3 * vec_size, 1.0), b(3 * vec_size, 2.0);
+	for(std::string expr : {"a * b + 1", "[a, b, a] @ b + sin(a)", "a if a < b else b ** 2"}) {
+		ParserTest p(vec_size, simd_size);
+		p.parse(expr);
+		p.set_variable("a", {3}, &(a[0]));
+		p.set_var_copy("b", {3}, &(b[0]));
+		p.compile();
+		const CompileStats &stats = p.compile_stats();
+		std::cout << expr << "\n" << stats.print();
+		uint n_nodes = 0;
+		for(auto &item : stats.n_nodes) n_nodes += item.second;
+		EXPECT(n_nodes == stats.n_nodes_total);
+		EXPECT(stats.n_nodes.at("Value") == 3);
+		EXPECT(stats.n_value_copies == 3);
+		EXPECT(stats.program_length > 0);
+		EXPECT(stats.arena_used > 0);
+		EXPECT(stats.arena_used <= stats.arena_estimate);
+		EXPECT(stats.parse_time > 0 && stats.processor_time > 0);
+	}
+}
+
+
+void test_tuning() {
+	std::cout << "\n" << "** test tuning" << "\n";
+	using namespace bparser;
+	const char * calibration = "test_tuning_calibration.txt";
+	std::remove(calibration);
+	constexpr uint n = 1024;
+	std::vector<double> a(3 * n), b(3 * n), res(3 * n), ref(3 * n);
+	for(uint i=0; i < a.size(); i++) a[i] = 0.5 * i;
+	for(uint i=0; i < b.size(); i++) b[i] = 1 + 0.25 * i;
+	for(uint i=0; i < ref.size(); i++) ref[i] = (a[i] < b[i]) ? a[i] * b[i] + 1 : b[i] - a[i];
+
+	ProcessorOptions tuned;
+	for(uint i_compile=0; i_compile < 2; i_compile++) {
+		ParserTest p(n, simd_size);
+		p.parse("a * b + 1 if a < b else b - a");
+		p.set_variable("a", {3}, &(a[0]));
+		p.set_var_copy("b", {3}, &(b[0]));
+		p.set_variable("_result_", {3}, &(res[0]));
+		p.set_tuning(true, calibration);
+		p.compile();
+		const ProcessorOptions &options = p.compiled_options();
+		std::cout << "order: " << options.program_order << ", max temp blocks: " << options.max_temp_blocks
+				<< ", tuning [ms]: " << 1e3 * p.compile_stats().tuning_time << "\n";
+		EXPECT(options.program_order != auto_order);
+		if (i_compile == 0) {
+			tuned = options;
+			EXPECT(p.compile_stats().tuning_time > 0);
+		} else {
+			// decision from the calibration file
+			EXPECT(p.compile_stats().tuning_time == 0);
+			EXPECT(options.program_order == tuned.program_order);
+			EXPECT(options.max_temp_blocks == tuned.max_temp_blocks);
+		}
+		std::fill(res.begin(), res.end(), 0.0);
+		std::vector<uint> ss;
+		for(uint i=0; i < n / p.simd_block_size(); i += 3) ss.push_back(i);
+		p.set_subset(ss);
+		p.run();
+		bool ok = true;
+		for(uint k=0; k < 3; k++)
+			for(uint blk : ss)
+				for(uint j=0; j < p.simd_block_size(); j++) {
+					uint i = k * n + blk * p.simd_block_size() + j;
+					ok = ok && (res[i] == ref[i]);
+				}
+		EXPECT(ok);
+	}
+	std::remove(calibration);
+}
+
+
+void test_cost_model() {
+	std::cout << "\n" << "** test cost model" << "\n";
+	using namespace bparser;
+	std::vector<double> a(3 * vec_size, 1.0), b(3 * vec_size, 2.0), res(3 * vec_size);
+	ParserTest p(vec_size, simd_size);
+	p.parse("a * b + exp(a)");
+	p.set_variable("a", {3}, &(a[0]));
+	p.set_variable("b", {3}, &(b[0]));
+	p.set_variable("_result_", {3}, &(res[0]));
+	p.compile();
+	const CostModel &cm = p.cost_model();
+	std::cout << cm.print();
+	// per component: mul, exp, add
+	EXPECT(cm.n_ops == 9);
+	EXPECT(cm.flops == 3 * (1 + op_flops(details::_exp_::op_code) + 1));
+	EXPECT(cm.loads == 3 * (2 + 1 + 2));
+	EXPECT(cm.stores == 9);
+	// read a, b, write result
+	EXPECT(cm.bytes_external == 3 * 3 * sizeof(double));
+
+	p.set_subset({0});
+	MachineModel machine;
+	machine.peak_flops = 1e10;
+	machine.peak_bandwidth = 1e10;
+	RooflineReport report = p.roofline(10, machine);
+	std::cout << report.print();
+	EXPECT(report.n_elements == p.simd_block_size());
+	EXPECT(report.achieved_flops() > 0);
+	// intensity 66 / 72 flop/B
+	EXPECT(report.bandwidth_bound());
+	report.machine.peak_bandwidth = 1e12;
+	EXPECT(! report.bandwidth_bound());
+	EXPECT(report.attainable_flops() == 1e10);
+}
+
+
 void test_speed_cases() {
 
 }
@@ -289,6 +1259,26 @@ int main()
 {
 	test_free_variables();
 	test_expression();
+	test_recompile();
+	test_single_precision();
+	test_layouts();
+	test_half_precision();
+	test_subset_span();
+	test_value_copy();
+	test_temp_blocks();
+	test_nt_stores();
+	test_subset_mode();
+	test_program_order();
+	test_native_function();
+	test_interp();
+	test_polyval();
+	test_derivatives();
+	test_packed_masks();
+	test_stream();
+	test_profile();
+	test_compile_stats();
+	test_tuning();
+	test_cost_model();
 #ifdef NDEBUG
 	test_speed_cases();
 #endif
@@ -18,8 +18,11 @@
 #include <string>
 #include <chrono>
 #include <cmath>
+#include <iomanip>
+#include <sys/resource.h>
 #include "assert.hh"
 #include "parser.hh"
+#include "stream.hh"
 #include "test_tools.hh"
 
 #include "arena_alloc.hh"
@@ -383,8 +386,789 @@ void test_expression() {
 
 
 
+/**
+ * Measure time and peak memory of the expression compilation (parse, Array expansion,
+ * DAG sort and processor setup) for large tensor expressions.
+ * Must be called first, as the peak memory is measured as growth of the process max RSS.
+ */
+void test_compile(std::string expr, uint n_repeats) {
+	using namespace bparser;
+	uint vec_size = 64;
+	Shape tensor_shape = {3, 3, 3, 3};
+	uint tensor_size = shape_size(tensor_shape);
+	std::vector<double> a(tensor_size * vec_size, 1.0);
+	std::vector<double> b(tensor_size * vec_size, 2.0);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long max_rss_begin = usage.ru_maxrss;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+		Parser p(vec_size);
+		p.parse(expr);
+		p.set_variable("A", tensor_shape, &(a[0]));
+		p.set_variable("B", tensor_shape, &(b[0]));
+		p.compile();
+	}
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double compile_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+
+	getrusage(RUSAGE_SELF, &usage);
+	long max_rss_end = usage.ru_maxrss;
+
+	std::cout << "=== Compilation of expression: '" << expr << "' ===\n";
+	std::cout << "compile time [ms] : " << 1000 * compile_time / n_repeats << "\n";
+	std::cout << "peak RSS grow [kB]: " << max_rss_end - max_rss_begin << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+
+/**
+ * Evaluation time of the processor with given 'precision' per single value of the result.
+ */
+template <class T>
+double precision_time(std::string expr, bparser::Precision precision, uint block_size, uint n_repeats, bool fast_math = false) {
+	using namespace bparser;
+	std::vector<T> v1(3 * block_size), v2(3 * block_size), vres(3 * block_size);
+	for(uint i=0; i < v1.size(); i++) {
+		v1[i] = 100 + i;
+		v2[i] = 200 + i;
+	}
+
+	Parser p(block_size, precision);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.set_fast_math(fast_math);
+	p.compile();
+	std::vector<uint> ss(block_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+		p.run();
+	}
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return time / n_repeats / vres.size();
+}
+
+/**
+ * Compare double and single precision processors.
+ */
+void test_precision(std::string expr, uint block_size) {
+	using namespace bparser;
+	uint n_repeats = (1024 / block_size) * 20000;
+	double double_time = precision_time<double>(expr, double_precision, block_size, n_repeats);
+	double float_time = precision_time<float>(expr, single_precision, block_size, n_repeats);
+
+	std::cout << "=== Precision, expression: '" << expr << "', block size: " << block_size << " ===\n";
+	std::cout << "double time [ns/value] : " << 1e9 * double_time << "\n";
+	std::cout << "float time  [ns/value] : " << 1e9 * float_time << "\n";
+	std::cout << "float speedup          : " << double_time / float_time << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Compare exact and fast math evaluation of the elementary functions.
+ */
+void test_fast_math(std::string expr, uint block_size) {
+	using namespace bparser;
+	uint n_repeats = (1024 / block_size) * 5000;
+	double double_time = precision_time<double>(expr, double_precision, block_size, n_repeats);
+	double double_fast_time = precision_time<double>(expr, double_precision, block_size, n_repeats, true);
+	double float_time = precision_time<float>(expr, single_precision, block_size, n_repeats);
+	double float_fast_time = precision_time<float>(expr, single_precision, block_size, n_repeats, true);
+
+	std::cout << "=== Fast math, expression: '" << expr << "', block size: " << block_size << " ===\n";
+	std::cout << "double exact time [ns/value] : " << 1e9 * double_time << "\n";
+	std::cout << "double fast time  [ns/value] : " << 1e9 * double_fast_time << "\n";
+	std::cout << "double speedup               : " << double_time / double_fast_time << "\n";
+	std::cout << "float exact time  [ns/value] : " << 1e9 * float_time << "\n";
+	std::cout << "float fast time   [ns/value] : " << 1e9 * float_fast_time << "\n";
+	std::cout << "float speedup                : " << float_time / float_fast_time << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time of set_subset + run() for frequently changing small subsets,
+ * subset given as std::vector (copied), as caller owned array (no copy),
+ * or filled in place into the processor subset buffer.
+ */
+void test_subset(uint subset_size) {
+	using namespace bparser;
+	const uint vec_size = 4096;
+	const uint n_subsets = 64;
+	uint n_repeats = 200000 / subset_size;
+	std::vector<double> v1(3 * vec_size, 1.0), v2(3 * vec_size, 2.0), vres(3 * vec_size);
+
+	Parser p(vec_size);
+	p.parse("v1 * v2 + v1");
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.compile();
+	uint n_blocks = vec_size / p.simd_block_size();
+	// scattered subsets, e.g. elements of the same type in an assembly loop
+	std::vector<uint> subsets(n_subsets * subset_size);
+	for(uint i=0; i < subsets.size(); i++) subsets[i] = (i * 37) % n_blocks;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+		const uint * subset = &(subsets[(i_rep % n_subsets) * subset_size]);
+		p.set_subset(std::vector<uint>(subset, subset + subset_size));
+		p.run();
+	}
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double vector_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+
+	start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+		p.set_subset(&(subsets[(i_rep % n_subsets) * subset_size]), subset_size);
+		p.run();
+	}
+	end_time = std::chrono::high_resolution_clock::now();
+	double span_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+
+	start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+		uint * buffer = p.subset_buffer();
+		for(uint i=0; i < subset_size; i++) buffer[i] = ((i_rep % n_subsets) * subset_size + i) * 37 % n_blocks;
+		p.set_subset(buffer, subset_size);
+		p.run();
+	}
+	end_time = std::chrono::high_resolution_clock::now();
+	double buffer_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+
+	std::cout << "=== Subset change, subset size: " << subset_size << " blocks ===\n";
+	std::cout << "std::vector subset [ns/run] : " << 1e9 * vector_time / n_repeats << "\n";
+	std::cout << "span subset        [ns/run] : " << 1e9 * span_time / n_repeats << "\n";
+	std::cout << "buffer subset      [ns/run] : " << 1e9 * buffer_time / n_repeats << "\n";
+	std::cout << "span speedup                : " << vector_time / span_time << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+/**
+ * Throughput of the streaming evaluation over arrays much larger than the chunk,
+ * with and without double buffering.
+ */
+template <class T>
+void test_stream(std::string expr, std::size_t n_total, uint chunk_size) {
+	using namespace bparser;
+	std::vector<T> v1(n_total), v2(n_total), vres(n_total);
+	for(std::size_t i=0; i < n_total; i++) {
+		v1[i] = 100 + i % 1000;
+		v2[i] = 200 + i % 1000;
+	}
+	double bandwidth[2];
+	for(bool double_buffer : {false, true}) {
+		Stream<T> s(expr, chunk_size, double_buffer);
+		s.set_source("v1", {}, Stream<T>::array_source(&(v1[0]), n_total));
+		s.set_source("v2", {}, Stream<T>::array_source(&(v2[0]), n_total));
+		s.set_sink({}, Stream<T>::array_sink(&(vres[0]), n_total));
+		bandwidth[double_buffer] = s.run(n_total).bandwidth();
+	}
+
+	std::cout << "=== Stream, expression: '" << expr << "', " << (sizeof(T) == 4 ? "float" : "double")
+			<< ", values: " << n_total << ", chunk size: " << chunk_size << " ===\n";
+	std::cout << "single buffer [GB/s] : " << 1e-9 * bandwidth[0] << "\n";
+	std::cout << "double buffer [GB/s] : " << 1e-9 * bandwidth[1] << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+/**
+ * Time of run() for a small subset of a large vector, input given as the variable
+ * and as the value copy (set_var_copy).
+ */
+void test_value_copy(uint vec_size, uint subset_size) {
+	using namespace bparser;
+	uint n_repeats = std::max(1u, (1u << 22) / vec_size) * 100;
+	std::vector<double> v1(3 * vec_size, 1.0), v2(3 * vec_size, 2.0), vres(3 * vec_size);
+	double times[2];
+	for(uint i_var=0; i_var < 2; i_var++) {
+		Parser p(vec_size);
+		p.parse("v1 * v2 + v1");
+		p.set_variable("v1", {3}, &(v1[0]));
+		if (i_var == 0)
+			p.set_variable("v2", {3}, &(v2[0]));
+		else
+			p.set_var_copy("v2", {3}, &(v2[0]));
+		p.set_variable("_result_", {3}, &(vres[0]));
+		p.compile();
+		std::vector<uint> ss(subset_size);
+		for(uint i=0; i < subset_size; i++) ss[i] = (i * 37) % (vec_size / p.simd_block_size());
+		p.set_subset(ss);
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+			p.run();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		times[i_var] = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	}
+	std::cout << "=== Value copy, vec size: " << vec_size << ", subset size: " << subset_size << " blocks ===\n";
+	std::cout << "variable   [ns/run] : " << 1e9 * times[0] / n_repeats << "\n";
+	std::cout << "value copy [ns/run] : " << 1e9 * times[1] / n_repeats << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time per evaluated value of run() over the evenly spread subset of the 'density'
+ * fraction of the blocks, in the given subset mode.
+ */
+double subset_mode_time(std::string expr, uint vec_size, double density, bparser::SubsetMode mode) {
+	using namespace bparser;
+	std::vector<double> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size);
+	fill_seq(&(v1[0]), 100, 100 + 3 * vec_size);
+	fill_seq(&(v2[0]), 200, 200 + 3 * vec_size);
+	Parser p(vec_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.set_subset_mode(mode);
+	p.compile();
+	uint n_blocks = vec_size / p.simd_block_size();
+	uint subset_size = std::max(1u, uint(density * n_blocks));
+	std::vector<uint> ss(subset_size);
+	for(uint i=0; i < subset_size; i++) ss[i] = uint(double(i) * n_blocks / subset_size);
+	p.set_subset(ss);
+	p.run();
+
+	uint n_values = 3 * subset_size * p.simd_block_size();
+	uint n_repeats = std::max(1u, (1u << 24) / n_values);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return 1e9 * time / n_repeats / n_values;
+}
+
+/**
+ * Direct and gathered evaluation of the subsets of decreasing density,
+ * the crossover density under which the gather mode is faster.
+ */
+void test_subset_mode(std::string expr, uint vec_size) {
+	using namespace bparser;
+	std::cout << "=== Subset mode: " << expr << ", vec size: " << vec_size << " ===\n";
+	std::cout << "density  direct [ns/value]  gather [ns/value]  auto [ns/value]\n";
+	double crossover = 0;
+	for(double density : {1.0, 0.5, 0.25, 0.1, 0.03, 0.01}) {
+		double t_direct = subset_mode_time(expr, vec_size, density, direct_subset);
+		double t_gather = subset_mode_time(expr, vec_size, density, gather_subset);
+		double t_auto = subset_mode_time(expr, vec_size, density, auto_subset);
+		std::cout << std::setw(7) << density << std::setw(21) << t_direct
+				<< std::setw(19) << t_gather << std::setw(17) << t_auto << "\n";
+		if (crossover == 0 && t_gather < t_direct) crossover = density;
+	}
+	std::cout << "gather faster from density: " << crossover << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time of run() over the full vector of 'n_blocks' SIMD blocks in the given program order.
+ */
+double program_order_time(std::string expr, uint n_blocks, bparser::ProgramOrder order) {
+	using namespace bparser;
+	uint block = get_simd_size();
+	uint vec_size = n_blocks * block;
+	std::vector<double> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size);
+	fill_seq(&(v1[0]), 100, 100 + 3 * vec_size);
+	fill_seq(&(v2[0]), 200, 200 + 3 * vec_size);
+	Parser p(vec_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.set_program_order(order);
+	p.compile();
+	std::vector<uint> ss(n_blocks);
+	for(uint i=0; i < n_blocks; i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+
+	uint n_repeats = std::max(1u, (1u << 22) / vec_size);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return 1e9 * time / n_repeats;
+}
+
+/**
+ * Op-major and element-major evaluation of small vectors.
+ */
+void test_program_order(std::string expr) {
+	using namespace bparser;
+	std::cout << "=== Program order: " << expr << " ===\n";
+	std::cout << "blocks  op-major [ns/run]  element-major [ns/run]  auto [ns/run]\n";
+	for(uint n_blocks : {1, 2, 4, 8, 16, 64}) {
+		double t_op = program_order_time(expr, n_blocks, op_major);
+		double t_elem = program_order_time(expr, n_blocks, element_major);
+		double t_auto = program_order_time(expr, n_blocks, auto_order);
+		std::cout << std::setw(6) << n_blocks << std::setw(19) << t_op
+				<< std::setw(24) << t_elem << std::setw(15) << t_auto << "\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time per evaluated value of run() over the full vector, with the Jacobian with respect to v1
+ * into 'dv1' if 'jacobian' is set.
+ */
+double full_vector_time(std::string expr, uint vec_size, bool fuse_polynomials = true, bool jacobian = false) {
+	using namespace bparser;
+	std::vector<double> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size), dv1(9 * vec_size);
+	fill_seq(&(v1[0]), 100, 100 + 3 * vec_size);
+	fill_seq(&(v2[0]), 200, 200 + 3 * vec_size);
+	Parser p(vec_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.set_fuse_polynomials(fuse_polynomials);
+	if (jacobian) {
+		p.set_variable("dv1", {3, 3}, &(dv1[0]));
+		p.set_derivative("v1", "dv1");
+	}
+	p.compile();
+	std::vector<uint> ss(vec_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+
+	uint n_values = 3 * vec_size;
+	uint n_repeats = std::max(1u, (1u << 24) / n_values);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return 1e9 * time / n_repeats / n_values;
+}
+
+/**
+ * interp(v1, xp, fp) against the equivalent ifelse chain, tables of increasing size
+ * spanning the values of v1.
+ */
+void test_interp(uint vec_size) {
+	std::cout << "=== Interpolation, vec size: " << vec_size << " ===\n";
+	std::cout << "points  ifelse chain [ns/value]  interp [ns/value]  speedup\n";
+	for(uint n : {4, 8, 12, 16}) {
+		std::vector<double> xp, fp;
+		for(uint k=0; k < n; ++k) {
+			xp.push_back(100 + 3.0 * vec_size * k / (n - 1));
+			fp.push_back((k * k) % 7);
+		}
+		double t_chain = full_vector_time(interp_chain("v1", xp, fp), vec_size);
+		double t_interp = full_vector_time("interp(v1, " + print_vector(xp) + ", " + print_vector(fp) + ")", vec_size);
+		std::cout << std::setw(6) << n << std::setw(25) << t_chain << std::setw(19) << t_interp
+				<< std::setw(9) << t_chain / t_interp << "\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Polynomial 'c0 + c1 * v1 + c2 * v1**2 + ...' written in the expression, evaluated as is
+ * and recognized as the single polyval operation, against the polyval built-in.
+ */
+void test_polyval(uint vec_size) {
+	std::cout << "=== Polynomials, vec size: " << vec_size << " ===\n";
+	std::cout << "degree  expanded [ns/value]  recognized [ns/value]  polyval [ns/value]  speedup\n";
+	for(uint degree : {3, 6, 10}) {
+		std::stringstream expr;
+		std::vector<double> coeffs;
+		for(uint k=0; k <= degree; ++k) {
+			double c = 1.0 / (k + 1);
+			coeffs.insert(coeffs.begin(), c);
+			expr << (k > 0 ? " + " : "") << c;
+			if (k > 0) expr << " * v1";
+			if (k > 1) expr << "**" << k;
+		}
+		double t_expanded = full_vector_time(expr.str(), vec_size, false);
+		double t_recognized = full_vector_time(expr.str(), vec_size);
+		double t_polyval = full_vector_time("polyval(" + print_vector(coeffs) + ", v1)", vec_size);
+		std::cout << std::setw(6) << degree << std::setw(21) << t_expanded << std::setw(23) << t_recognized
+				<< std::setw(20) << t_polyval << std::setw(9) << t_expanded / t_recognized << "\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Values and the Jacobian with respect to v1 by the single processor (set_derivative)
+ * against the forward differences, i.e. 1 + 3 runs of the processor of the values.
+ */
+void test_derivative(uint vec_size) {
+	std::cout << "=== Jacobian, vec size: " << vec_size << " ===\n";
+	std::cout << "values [ns/value]  values + Jacobian [ns/value]  differences [ns/value]  speedup\n";
+	for(std::string expr : {"v1 * v2 + v1 / (v2 + 1)",
+			"sin(v1) * exp(v2 / 400) + sqrt(v1) * log(v2)",
+			"[v2, v2, v2] @ v1 + v1 ** 3"}) {
+		std::cout << expr << "\n";
+		double t_values = full_vector_time(expr, vec_size);
+		double t_jacobian = full_vector_time(expr, vec_size, true, true);
+		double t_differences = 4 * t_values;
+		std::cout << std::setw(17) << t_values << std::setw(30) << t_jacobian << std::setw(24) << t_differences
+				<< std::setw(9) << t_differences / t_jacobian << "\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time per value of the op-major program of 'expr', the boolean temporaries packed to bits
+ * or stored as the full masks, the boolean result written as the packed bits or as the masks.
+ */
+double mask_time(std::string expr, uint vec_size, bool packed_masks, bool packed_result) {
+	using namespace bparser;
+	std::vector<double> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size);
+	fill_seq(&(v1[0]), 100, 100 + 3 * vec_size);
+	for(uint i=0; i < v2.size(); i++) v2[i] = 100 + (37 * i) % 300;
+	Parser p(vec_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	std::vector<uint8_t> bits(3 * p.packed_result_bytes());
+	if (packed_result) p.set_packed_result(&(bits[0]));
+	p.set_program_order(op_major);
+	p.set_packed_masks(packed_masks);
+	p.compile();
+	std::vector<uint> ss(vec_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+
+	uint n_values = 3 * vec_size;
+	uint n_repeats = std::max(1u, (1u << 24) / n_values);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return 1e9 * time / n_repeats / n_values;
+}
+
+void test_packed_masks(uint vec_size) {
+	std::string cond = "(v1 > v2) and (v2 < 250) or not (v2 < 150) and (v1 != v2 + 1)";
+	std::cout << "=== Packed masks, vec size: " << vec_size << " ===\n";
+	std::cout << "                 full masks [ns/value]  packed [ns/value]  speedup\n";
+	double t_full = mask_time("v1 if " + cond + " else v2", vec_size, false, false);
+	double t_packed = mask_time("v1 if " + cond + " else v2", vec_size, true, false);
+	std::cout << "temporaries  " << std::setw(26) << t_full << std::setw(19) << t_packed
+			<< std::setw(9) << t_full / t_packed << "\n";
+	t_full = mask_time(cond, vec_size, false, false);
+	t_packed = mask_time(cond, vec_size, true, true);
+	std::cout << "result       " << std::setw(26) << t_full << std::setw(19) << t_packed
+			<< std::setw(9) << t_full / t_packed << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time per value of 'expr' with the 3d vectors 'v1', 'v2' stored as T or, if 'half', as the 16-bit values in the 'format'.
+ */
+template <class T>
+double half_time(std::string expr, uint vec_size, bool half, bparser::HalfFormat format) {
+	using namespace bparser;
+	Precision precision = (sizeof(T) == sizeof(float)) ? single_precision : double_precision;
+	std::vector<T> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size);
+	std::vector<uint16_t> h1(3 * vec_size), h2(3 * vec_size);
+	for(uint i=0; i < v1.size(); i++) {
+		v1[i] = 1 + (i % 1000) / 1024.0;
+		v2[i] = 2 + (i % 700) / 1024.0;
+		h1[i] = (format == fp16) ? to_fp16(v1[i]) : to_bf16(v1[i]);
+		h2[i] = (format == fp16) ? to_fp16(v2[i]) : to_bf16(v2[i]);
+	}
+	Parser p(vec_size, precision);
+	p.parse(expr);
+	if (half) {
+		p.set_variable("v1", {3}, &(h1[0]), format);
+		p.set_variable("v2", {3}, &(h2[0]), format);
+	} else {
+		p.set_variable("v1", {3}, &(v1[0]));
+		p.set_variable("v2", {3}, &(v2[0]));
+	}
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.compile();
+	std::vector<uint> ss(vec_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+
+	uint n_values = 3 * vec_size;
+	uint n_repeats = std::max(1u, (1u << 24) / n_values);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	return 1e9 * time / n_repeats / n_values;
+}
+
+/**
+ * Bandwidth of the half precision inputs against the inputs of the processor precision,
+ * the bytes of both inputs and of the result per time.
+ */
+template <class T>
+void test_half_precision(std::string expr, uint vec_size) {
+	using namespace bparser;
+	std::cout << "=== Half precision inputs, " << (sizeof(T) == 4 ? "float" : "double")
+			<< ", expression: '" << expr << "', vec size: " << vec_size << " ===\n";
+	std::cout << "inputs   [ns/value]  [GB/s]  speedup\n";
+	double t_full = half_time<T>(expr, vec_size, false, fp16);
+	std::cout << (sizeof(T) == 4 ? "float  " : "double ") << std::setw(12) << t_full
+			<< std::setw(8) << 3 * sizeof(T) / t_full << std::setw(9) << 1.0 << "\n";
+	for(HalfFormat format : {fp16, bf16}) {
+		double t_half = half_time<T>(expr, vec_size, true, format);
+		std::cout << (format == fp16 ? "fp16   " : "bf16   ") << std::setw(12) << t_half
+				<< std::setw(8) << (2 * sizeof(uint16_t) + sizeof(T)) / t_half << std::setw(9) << t_full / t_half << "\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Run time of the default and of the tuned strategy (Parser::set_tuning), full vector.
+ */
+void test_tuning(std::string expr, uint vec_size) {
+	using namespace bparser;
+	std::vector<double> v1(3 * vec_size), v2(3 * vec_size), vres(3 * vec_size);
+	fill_seq(&(v1[0]), 100, 100 + 3 * vec_size);
+	fill_seq(&(v2[0]), 200, 200 + 3 * vec_size);
+	uint n_repeats = std::max(1u, (1u << 22) / vec_size);
+	std::cout << "=== Tuning: " << expr << ", vec size: " << vec_size << " ===\n";
+	for(bool tuning : {false, true}) {
+		Parser p(vec_size);
+		p.parse(expr);
+		p.set_variable("v1", {3}, &(v1[0]));
+		p.set_variable("v2", {3}, &(v2[0]));
+		p.set_variable("_result_", {3}, &(vres[0]));
+		p.set_tuning(tuning);
+		p.compile();
+		std::vector<uint> ss(vec_size / p.simd_block_size());
+		for(uint i=0; i < ss.size(); i++) ss[i] = i;
+		p.set_subset(ss);
+		p.run();
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+			p.run();
+		auto end_time = std::chrono::high_resolution_clock::now();
+		double time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+		const ProcessorOptions &options = p.compiled_options();
+		std::cout << (tuning ? "tuned  " : "default") << " [ns/run] : " << 1e9 * time / n_repeats
+				<< " (order: " << options.program_order << ", max temp blocks: " << options.max_temp_blocks
+				<< ", tuning [ms]: " << 1e3 * p.compile_stats().tuning_time << ")\n";
+	}
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Throughput of the large vector evaluation with the results written by the regular
+ * and by the non-temporal stores.
+ */
+double nt_time(std::string expr, uint vec_size, uint n_repeats, bool nt_stores) {
+	using namespace bparser;
+	ArenaAlloc arena(64, 3 * 3 * vec_size * sizeof(double) + 1024);
+	double * v1 = arena.create_array<double>(3 * vec_size);
+	double * v2 = arena.create_array<double>(3 * vec_size);
+	double * vres = arena.create_array<double>(3 * vec_size);
+	fill_seq(v1, 100, 100 + 3 * vec_size);
+	fill_seq(v2, 200, 200 + 3 * vec_size);
+	fill_const(vres, 3 * vec_size, -100);
+
+	Parser p(vec_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, v1);
+	p.set_variable("v2", {3}, v2);
+	p.set_variable("_result_", {3}, vres);
+	p.set_nt_stores(nt_stores);
+	p.compile();
+	std::vector<uint> ss(vec_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+	p.run();
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for(uint i_rep=0; i_rep < n_repeats; i_rep++)
+		p.run();
+	auto end_time = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count() / n_repeats;
+}
+
+void test_nt_stores(std::string expr, uint vec_size) {
+	uint n_repeats = std::max(1u, (1u << 24) / vec_size);
+	// bytes of the inputs and results
+	double bytes = 3.0 * 3 * vec_size * sizeof(double);
+	double cached_time = nt_time(expr, vec_size, n_repeats, false);
+	double nt = nt_time(expr, vec_size, n_repeats, true);
+
+	std::cout << "=== Non-temporal stores, expression: '" << expr << "', vec size: " << vec_size << " ===\n";
+	std::cout << "regular stores      [GB/s] : " << 1e-9 * bytes / cached_time << "\n";
+	std::cout << "non-temporal stores [GB/s] : " << 1e-9 * bytes / nt << "\n";
+	std::cout << "speedup                    : " << cached_time / nt << "\n";
+	std::cout << "======================================================\n\n";
+}
+
+
+/**
+ * Time of the single operation kernel (arguments of 'n_blocks' blocks of VecType)
+ * with 1, 2 and 4 SIMD blocks per loop iteration. Variants alternate in rounds,
+ * minimum of the rounds is reported.
+ */
+template <uint NParams, class T, typename VecType>
+void test_unroll(std::string name, uint n_blocks) {
+	using namespace bparser;
+	typedef typename Vec<VecType>::Scalar Scalar;
+	const uint n_lanes = Vec<VecType>::n_lanes;
+	const uint n_repeats = std::max(1u, (1u << 22) / (n_blocks * n_lanes));
+	const uint n_rounds = 7;
+
+	std::vector<std::vector<Scalar>> values(NParams, std::vector<Scalar>(n_blocks * n_lanes));
+	for(uint k=0; k < NParams; k++)
+		for(uint i=0; i < n_blocks * n_lanes; i++) values[k][i] = 1.0 + 0.001 * ((i + k) % 100);
+	std::vector<uint> subset(n_blocks);
+	for(uint i=0; i < n_blocks; i++) subset[i] = i;
+	std::vector<Vec<VecType>> vectors(NParams);
+	for(uint k=0; k < NParams; k++) vectors[k].set(&(values[k][0]), &(subset[0]));
+
+	Workspace<VecType> w;
+	w.vec_n_blocks = n_blocks;
+	w.vector = &(vectors[0]);
+	w.n_vectors = NParams;
+	w.subset_size = n_blocks;
+	w.vec_subset = &(subset[0]);
+	Operation op = {(unsigned char)T::op_code, {0, 1, 2, 3}};
+
+	double times[3] = {1e100, 1e100, 1e100};
+	for(uint i_round=0; i_round < n_rounds; i_round++) {
+		for(uint i_var=0; i_var < 3; i_var++) {
+			// results feed the next repetition, values stay in range for all tested operations
+			for(uint k=0; k < NParams; k++)
+				for(uint i=0; i < n_blocks * n_lanes; i++) values[k][i] = 1.0 + 0.001 * ((i + k) % 100);
+			auto start_time = std::chrono::high_resolution_clock::now();
+			for(uint i_rep=0; i_rep < n_repeats; i_rep++) {
+				if (i_var == 0) EvalImpl<NParams, T, VecType>::template eval_blocks<1>(op, w);
+				if (i_var == 1) EvalImpl<NParams, T, VecType>::template eval_blocks<2>(op, w);
+				if (i_var == 2) EvalImpl<NParams, T, VecType>::template eval_blocks<4>(op, w);
+			}
+			auto end_time = std::chrono::high_resolution_clock::now();
+			double t = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+			times[i_var] = std::min(times[i_var], t);
+		}
+	}
+	double ns = 1e9 / n_repeats / (n_blocks * n_lanes);
+	std::cout << std::setw(8) << name << " " << std::setw(6) << (8 * sizeof(VecType)) << "b x" << n_lanes
+			  << " unroll 1/2/4 [ns/value]: " << ns * times[0] << " " << ns * times[1] << " " << ns * times[2]
+			  << "  default: " << unroll_factor(T::op_code) << "\n";
+}
+
+
+/**
+ * Kernel unrolling across the SIMD widths, cheap and expensive operations.
+ */
+template <typename VecType>
+void test_unroll_vec(uint n_blocks) {
+	using namespace bparser::details;
+	test_unroll<3, _add_, VecType>("add", n_blocks);
+	test_unroll<3, _mul_, VecType>("mul", n_blocks);
+	test_unroll<3, _div_, VecType>("div", n_blocks);
+	test_unroll<4, _ifelse_, VecType>("ifelse", n_blocks);
+	test_unroll<2, _sqrt_, VecType>("sqrt", n_blocks);
+	test_unroll<2, _exp_, VecType>("exp", n_blocks);
+	test_unroll<2, _sin_, VecType>("sin", n_blocks);
+	test_unroll<2, _fast_exp_, VecType>("fast_exp", n_blocks);
+	test_unroll<3, _pow_, VecType>("pow", n_blocks);
+}
+
+
+/**
+ * Measured flops and bandwidth against the roofline cost model.
+ */
+void test_roofline(std::string expr, uint block_size, const bparser::MachineModel &machine) {
+	using namespace bparser;
+	std::vector<double> v1(3 * block_size), v2(3 * block_size), vres(3 * block_size);
+	for(uint i=0; i < v1.size(); i++) {
+		v1[i] = 100 + i % 1000;
+		v2[i] = 200 + i % 1000;
+	}
+	Parser p(block_size);
+	p.parse(expr);
+	p.set_variable("v1", {3}, &(v1[0]));
+	p.set_variable("v2", {3}, &(v2[0]));
+	p.set_variable("_result_", {3}, &(vres[0]));
+	p.compile();
+	std::vector<uint> ss(block_size / p.simd_block_size());
+	for(uint i=0; i < ss.size(); i++) ss[i] = i;
+	p.set_subset(ss);
+
+	std::cout << "=== Roofline, expression: '" << expr << "', block size: " << block_size << " ===\n";
+	std::cout << p.roofline(std::max(1u, (1u << 24) / block_size), machine).print();
+	std::cout << "======================================================\n\n";
+}
+
+
 int main()
 {
+	test_compile("C = A @ B; D = C @ A @ B; D * C + sin(A) - B / (C + 1)", 20);
+	test_compile("C = A @ B; D = C @ C; E = D @ D; F = E @ E; (F + E) * (D - C) + exp(A) / (1 + B @ F @ A @ B)", 20);
+	test_precision("v1 * v2 + v1", 64);
+	test_precision("v1 * v2 + v1", 1024);
+	test_precision("sin(v1) * exp(v2 / 400) + sqrt(v1)", 64);
+	test_precision("sin(v1) * exp(v2 / 400) + sqrt(v1)", 1024);
+	test_fast_math("exp(v1 / 400)", 1024);
+	test_fast_math("log(v1)", 1024);
+	test_fast_math("v1 ** (v2 / 400)", 1024);
+	test_fast_math("sin(v1) + cos(v2)", 1024);
+	test_fast_math("tanh(v1 / 300)", 1024);
+	test_subset(1);
+	test_subset(4);
+	test_subset(32);
+	test_stream<double>("v1 * v2 + v1", 1 << 22, 1 << 14);
+	test_stream<double>("sin(v1) * exp(v2 / 400) + sqrt(v1)", 1 << 22, 1 << 14);
+	test_stream<float>("v1 * v2 + v1", 1 << 22, 1 << 14);
+	bparser::MachineModel machine = bparser::MachineModel::measure();
+	test_roofline("v1 * v2 + v1", 1 << 20, machine);
+	test_roofline("sin(v1) * exp(v2 / 400) + sqrt(v1)", 1 << 20, machine);
+	test_roofline("v1 * v2 + v1", 1024, machine);
+	test_value_copy(1 << 16, 4);
+	test_value_copy(1 << 16, 1024);
+	test_nt_stores("v1 * v2 + v1", 1 << 16);
+	test_nt_stores("v1 * v2 + v1", 1 << 20);
+	test_nt_stores("v1 + v2", 1 << 22);
+	test_subset_mode("v1 * v2 + v1", 1 << 18);
+	test_subset_mode("v1 * v2 + v1 * sin(v2) - v1 / (v2 + 1) + v1 * v1 * (v2 - 3)", 1 << 18);
+	test_program_order("v1 * v2 + v1");
+	test_program_order("v1 * v2 + v1 * sin(v2) - v1 / (v2 + 1) + v1 * v1 * (v2 - 3)");
+	test_program_order("[v2, v2, v2] @ v1 + v1 if v1 > v2 else v2 ** 2");
+	test_tuning("v1 * v2 + v1 * sin(v2) - v1 / (v2 + 1) + v1 * v1 * (v2 - 3)", 16);
+	test_tuning("v1 * v2 + v1 * sin(v2) - v1 / (v2 + 1) + v1 * v1 * (v2 - 3)", 1 << 16);
+	test_interp(1024);
+	test_polyval(1024);
+	test_derivative(1024);
+	test_packed_masks(1024);
+	test_packed_masks(1 << 18);
+	test_half_precision<double>("v1 * v2 + v1", 1 << 20);
+	test_half_precision<float>("v1 * v2 + v1", 1 << 20);
+	test_half_precision<double>("v1 * v2 + v1", 1024);
+	std::cout << "=== Unrolled kernels, 256 blocks ===\n";
+	test_unroll_vec<Vec2d>(256);
+	test_unroll_vec<Vec4d>(256);
+	test_unroll_vec<Vec8d>(256);
+	test_unroll_vec<Vec8f>(256);
+	std::cout << "======================================================\n\n";
 	test_expression();
 }
 
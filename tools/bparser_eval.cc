@@ -0,0 +1,252 @@
+/*
+ * bparser_eval.cc
+ *
+ * Command line batch evaluator of an expression over raw binary columns.
+ *
+ *     bparser-eval [options] EXPR SYMBOL=FILE ... -o RESULT_FILE
+ *
+ * Each FILE holds the values of the symbol in the native byte order, component-major
+ * for the array symbols: SYMBOL[3]=v.bin holds all x components, then all y, then all z.
+ * The inputs are memory mapped and evaluated in chunks, optionally on several threads,
+ * the result is written to the mapped RESULT_FILE. Timing and bandwidth go to stderr.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parser.hh"
+#include "stream.hh"
+
+using namespace bparser;
+
+
+const char * usage =
+	"Usage: bparser-eval [options] EXPR SYMBOL[SHAPE]=FILE ... -o RESULT_FILE\n"
+	"Evaluate EXPR over the raw binary columns, SHAPE e.g. [3] or [3,3], default scalar.\n"
+	"Options:\n"
+	"  -o FILE     result file\n"
+	"  -r SHAPE    shape of the result, e.g. 3 or 3,3, default scalar\n"
+	"  -f          single precision (float) files, default double\n"
+	"  -n N        number of elements, default given by the size of the input files\n"
+	"  -c CHUNK    chunk size, default 65536\n"
+	"  -t THREADS  number of threads, default 1\n"
+	"  --fast-math use the fast approximations of the elementary functions\n";
+
+
+struct Options {
+	std::string expr;
+	std::vector<std::string> symbols;
+	std::string result_file;
+	Shape result_shape;
+	bool single = false;
+	std::size_t n = 0;
+	uint chunk_size = 65536;
+	uint n_threads = 1;
+	bool fast_math = false;
+};
+
+
+/// Parse shape given as "3,3".
+Shape parse_shape(const std::string &str) {
+	Shape shape;
+	std::size_t pos = 0;
+	while (pos < str.size()) {
+		std::size_t end = str.find(',', pos);
+		if (end == std::string::npos) end = str.size();
+		shape.push_back(std::stoul(str.substr(pos, end - pos)));
+		pos = end + 1;
+	}
+	return shape;
+}
+
+
+/// Read only or read write mapping of a binary file.
+struct MappedFile {
+	MappedFile(const std::string &path, std::size_t size = 0)
+	: path(path), size(size), data(nullptr), fd(-1)
+	{
+		bool write = (size > 0);
+		fd = open(path.c_str(), write ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+		if (fd < 0)
+			Throw() << "Can not open file '" << path << "'.\n";
+		if (write) {
+			if (ftruncate(fd, size) != 0)
+				Throw() << "Can not resize file '" << path << "' to " << size << " bytes.\n";
+		} else {
+			struct stat st;
+			fstat(fd, &st);
+			this->size = st.st_size;
+		}
+		if (this->size > 0) {
+			data = mmap(nullptr, this->size, write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+			if (data == MAP_FAILED)
+				Throw() << "Can not map file '" << path << "'.\n";
+			if (! write)
+				madvise(data, this->size, MADV_SEQUENTIAL);
+		}
+	}
+
+	~MappedFile() {
+		if (data != nullptr && data != MAP_FAILED) munmap(data, size);
+		if (fd >= 0) close(fd);
+	}
+
+	std::string path;
+	std::size_t size;
+	void * data;
+	int fd;
+};
+
+
+struct Column {
+	std::string name;
+	Shape shape;
+	std::shared_ptr<MappedFile> file;
+};
+
+
+/**
+ * Evaluate elements [begin, begin + n) of the columns of 'n_total' elements.
+ */
+template <class T>
+StreamStats eval_range(const Options &opt, const std::vector<Column> &columns, T *result,
+		std::size_t n_total, std::size_t begin, std::size_t n) {
+	Stream<T> stream(opt.expr, opt.chunk_size, false);
+	for(const Column &col : columns) {
+		const T * data = (const T *)col.file->data;
+		stream.set_source(col.name, col.shape, [data, n_total, begin](const StreamChunk<T> &chunk) {
+			for(uint k=0; k < chunk.n_comp; ++k)
+				memcpy(chunk.data + k * chunk.stride, data + k * n_total + begin + chunk.begin, chunk.n * sizeof(T));
+		});
+	}
+	stream.set_sink(opt.result_shape, [result, n_total, begin](const StreamChunk<const T> &chunk) {
+		for(uint k=0; k < chunk.n_comp; ++k)
+			memcpy(result + k * n_total + begin + chunk.begin, chunk.data + k * chunk.stride, chunk.n * sizeof(T));
+	});
+	stream.set_fast_math(opt.fast_math);
+	return stream.run(n);
+}
+
+
+template <class T>
+void eval(const Options &opt) {
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	std::vector<Column> columns;
+	std::size_t n_total = opt.n;
+	for(const std::string &sym : opt.symbols) {
+		std::size_t eq = sym.find('=');
+		if (eq == std::string::npos)
+			Throw() << "Expected SYMBOL=FILE, got '" << sym << "'.\n";
+		Column col;
+		col.name = sym.substr(0, eq);
+		std::size_t bracket = col.name.find('[');
+		if (bracket != std::string::npos) {
+			col.shape = parse_shape(col.name.substr(bracket + 1, col.name.size() - bracket - 2));
+			col.name = col.name.substr(0, bracket);
+		}
+		col.file = std::make_shared<MappedFile>(sym.substr(eq + 1));
+		std::size_t n_file = col.file->size / sizeof(T) / shape_size(col.shape);
+		if (n_total == 0)
+			n_total = n_file;
+		if (n_file < n_total)
+			Throw() << "File '" << col.file->path << "' has " << n_file << " elements, expected " << n_total << ".\n";
+		columns.push_back(col);
+	}
+	if (n_total == 0)
+		Throw() << "Unknown number of elements, use -n.\n";
+	if (opt.result_file.empty())
+		Throw() << "No result file, use -o.\n";
+
+	MappedFile result_file(opt.result_file, n_total * shape_size(opt.result_shape) * sizeof(T));
+	T * result = (T *)result_file.data;
+
+	auto eval_start = std::chrono::high_resolution_clock::now();
+	uint n_threads = std::max(1u, opt.n_threads);
+	std::vector<StreamStats> stats(n_threads);
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(n_threads);
+	// contiguous ranges aligned to the chunk size
+	std::size_t range = align_size(opt.chunk_size, (n_total + n_threads - 1) / n_threads);
+	for(uint i_th=0; i_th < n_threads; ++i_th) {
+		std::size_t begin = std::min(n_total, i_th * range);
+		std::size_t n = std::min(n_total - begin, range);
+		threads.emplace_back([&, i_th, begin, n]() {
+			try {
+				stats[i_th] = eval_range<T>(opt, columns, result, n_total, begin, n);
+			} catch (...) {
+				errors[i_th] = std::current_exception();
+			}
+		});
+	}
+	for(std::thread &th : threads) th.join();
+	for(std::exception_ptr &e : errors)
+		if (e) std::rethrow_exception(e);
+	auto end_time = std::chrono::high_resolution_clock::now();
+
+	double total_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - start_time).count();
+	double eval_time = std::chrono::duration_cast<std::chrono::duration<double>>(end_time - eval_start).count();
+	std::size_t bytes = 0;
+	for(const StreamStats &s : stats) bytes += s.bytes_read + s.bytes_written;
+	std::cerr << "expression   : " << opt.expr << "\n"
+			  << "precision    : " << (opt.single ? "float" : "double") << "\n"
+			  << "elements     : " << n_total << "\n"
+			  << "threads      : " << n_threads << "\n"
+			  << "chunk size   : " << opt.chunk_size << "\n"
+			  << "total time   : " << total_time << " s\n"
+			  << "eval time    : " << eval_time << " s\n"
+			  << "data [MB]    : " << 1e-6 * bytes << "\n"
+			  << "bandwidth    : " << 1e-9 * bytes / eval_time << " GB/s\n";
+}
+
+
+int main(int argc, char **argv) {
+	Options opt;
+	std::vector<std::string> positional;
+	try {
+		for(int i=1; i < argc; ++i) {
+			std::string arg = argv[i];
+			auto next = [&]() -> std::string {
+				if (i + 1 >= argc)
+					Throw() << "Missing value of the option " << arg << ".\n";
+				return argv[++i];
+			};
+			if (arg == "-h" || arg == "--help") {
+				std::cout << usage;
+				return 0;
+			}
+			else if (arg == "-o") opt.result_file = next();
+			else if (arg == "-r") opt.result_shape = parse_shape(next());
+			else if (arg == "-f") opt.single = true;
+			else if (arg == "-n") opt.n = std::stoull(next());
+			else if (arg == "-c") opt.chunk_size = std::stoul(next());
+			else if (arg == "-t") opt.n_threads = std::stoul(next());
+			else if (arg == "--fast-math") opt.fast_math = true;
+			else positional.push_back(arg);
+		}
+		if (positional.empty()) {
+			std::cerr << usage;
+			return 1;
+		}
+		opt.expr = positional[0];
+		opt.symbols.assign(positional.begin() + 1, positional.end());
+
+		if (opt.single)
+			eval<float>(opt);
+		else
+			eval<double>(opt);
+	} catch (std::exception &e) {
+		std::string msg = e.what();
+		std::cerr << "bparser-eval: " << msg << (msg.empty() || msg.back() != '\n' ? "\n" : "");
+		return 1;
+	}
+	return 0;
+}